@@ -35,7 +35,11 @@ int main(int argc, char *argv[]) {
 
     rpc_handle *handle_add2 = rpc_find(state, "add2");
     if (handle_add2 == NULL) {
-        fprintf(stderr, "ERROR: Function add2 does not exist\n");
+        if (rpc_get_status(state) == RPC_BUSY) {
+            fprintf(stderr, "ERROR: Server too busy to find add2\n");
+        } else {
+            fprintf(stderr, "ERROR: Function add2 does not exist\n");
+        }
         exit_code = 1;
         goto cleanup;
     }
@@ -50,7 +54,11 @@ int main(int argc, char *argv[]) {
         /* Call and receive response */
         rpc_data *response_data = rpc_call(state, handle_add2, &request_data);
         if (response_data == NULL) {
-            fprintf(stderr, "Function call of add2 failed\n");
+            if (rpc_get_status(state) == RPC_BUSY) {
+                fprintf(stderr, "Server too busy to call add2\n");
+            } else {
+                fprintf(stderr, "Function call of add2 failed\n");
+            }
             exit_code = 1;
             goto cleanup;
         }
@@ -0,0 +1,460 @@
+#include "src/rpc.h"
+#include "src/capture.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* A request read from the log, along with how replaying it went */
+struct request {
+    const struct capture_record *record;
+    // position in the log, so that each connection's requests stay in order once grouped
+    size_t index;
+    // row of the report the request is counted in
+    int row;
+    int failed;
+    uint64_t latency;
+};
+
+/* The requests of one recorded connection, replayed in order over a connection of their own */
+struct replay {
+    struct request *requests;
+    size_t count;
+    rpc_client *cl;
+};
+
+/* Procedure known under a name to a replaying connection, its handle NULL until found */
+struct found {
+    const char *name;
+    rpc_handle *handle;
+};
+
+static char *addr = NULL;
+static int port;
+// 1 replays at the recorded pace, 2 twice as fast, 0 as fast as each connection's calls complete
+static double speed = 1;
+static uint64_t first_time;
+// replays wait for every connection to be made and its procedures found, so that neither counts as
+// falling behind
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t go = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ready = PTHREAD_COND_INITIALIZER;
+static size_t num_ready;
+static uint64_t started;
+
+static void *run_replay(void *arg);
+static struct found *lookup_found(struct found *found, int num_found, const char *name);
+static struct found *add_found(struct found **found, int *num_found, const char *name);
+static int add_row(const char ***rows, int *num_rows, const char *name);
+static void print_row(const char *name, struct request *requests, size_t count, int row, uint64_t *samples);
+static int compare_request(const void *a, const void *b);
+static int compare_sample(const void *a, const void *b);
+static uint64_t now_ns();
+
+int main(int argc, char *argv[]) {
+
+    int opt;
+    char *path = NULL;
+    // Reads command line flags and values
+    while ((opt = getopt(argc, argv, "i:p:f:s:")) != -1) {
+        switch (opt) {
+            case 'i':
+                addr = strdup(optarg);
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'f':
+                path = strdup(optarg);
+                break;
+            case 's':
+                speed = atof(optarg);
+                break;
+            case '?':
+                fprintf(stderr, "Usage: %s -i addr -p port -f log [-s speed]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (!addr || !path || speed < 0) {
+        fprintf(stderr, "Usage: %s -i addr -p port -f log [-s speed]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // the log is read in place, payloads are sent straight from the mapping
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(struct capture_header)) {
+        fprintf(stderr, "Error: Cannot read %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    const char *log = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    const struct capture_header *header = (const struct capture_header *) log;
+    if (log == MAP_FAILED || memcmp(header->magic, CAPTURE_MAGIC, sizeof(header->magic)) != 0
+        || header->version != CAPTURE_VERSION || header->header_len > (size_t) st.st_size) {
+        fprintf(stderr, "Error: %s is not a capture log\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    // a log cut short by the server stopping ends at the last record written in full
+    size_t count = 0, size = 1024;
+    struct request *requests = malloc(size * sizeof(*requests));
+    const char **rows = NULL;
+    int num_rows = 0;
+    if (!requests || add_row(&rows, &num_rows, "(find)") == -1) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t off = header->header_len; off + sizeof(struct capture_record) <= (size_t) st.st_size;) {
+        const struct capture_record *record = (const struct capture_record *) (log + off);
+        if (record->length < sizeof(*record) || record->length > st.st_size - off
+            || record->kept > record->data2_len
+            || record->kept + record->name_len + 1 > record->length - sizeof(*record)) {
+            break;
+        }
+        off += record->length;
+        const char *name = (const char *) (record + 1) + record->kept;
+        // a call to an id the server did not know cannot be told apart from any other
+        if (record->type != 'f' && (record->type != 'c' || record->name_len == 0)) {
+            continue;
+        }
+        if (count == size) {
+            size *= 2;
+            if (!(requests = realloc(requests, size * sizeof(*requests)))) {
+                fprintf(stderr, "Error: Out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        int row = record->type == 'f' ? 0 : add_row(&rows, &num_rows, name);
+        if (row == -1) {
+            fprintf(stderr, "Error: Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        if (count == 0 || record->time < first_time) {
+            first_time = record->time;
+        }
+        requests[count] = (struct request) {.record = record, .index = count, .row = row};
+        count++;
+    }
+    if (count == 0) {
+        fprintf(stderr, "Error: %s holds no requests\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    // each recorded connection is replayed on its own, so requests keep the concurrency they arrived with
+    qsort(requests, count, sizeof(*requests), compare_request);
+    size_t num_replays = 0;
+    struct replay *replays = malloc(count * sizeof(*replays));
+    pthread_t *threads = malloc(count * sizeof(*threads));
+    uint64_t *samples = malloc(count * sizeof(*samples));
+    if (!replays || !threads || !samples) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (i == 0 || requests[i].record->connection != requests[i - 1].record->connection) {
+            replays[num_replays++] = (struct replay) {.requests = &requests[i], .count = 0};
+        }
+        replays[num_replays - 1].count++;
+    }
+
+    for (size_t i = 0; i < num_replays; i++) {
+        replays[i].cl = rpc_init_client(addr, port);
+    }
+    size_t num_threads = 0;
+    for (; num_threads < num_replays; num_threads++) {
+        if (pthread_create(&threads[num_threads], NULL, run_replay, &replays[num_threads]) != 0) {
+            fprintf(stderr, "Error: Cannot replay more than %zu connections\n", num_threads);
+            break;
+        }
+    }
+    for (size_t i = num_threads; i < num_replays; i++) {
+        for (size_t j = 0; j < replays[i].count; j++) {
+            replays[i].requests[j].failed = 1;
+        }
+    }
+    pthread_mutex_lock(&lock);
+    while (num_ready < num_threads) {
+        pthread_cond_wait(&ready, &lock);
+    }
+    started = now_ns();
+    pthread_cond_broadcast(&go);
+    pthread_mutex_unlock(&lock);
+    for (size_t i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = (now_ns() - started) / 1e9;
+
+    printf("Replayed %zu requests over %zu connections in %.3f s (%.1f per second)\n", count, num_threads,
+           elapsed, elapsed > 0 ? count / elapsed : 0);
+    printf("%-24s %9s %7s %10s %10s %10s %10s %10s\n", "latency (us)", "count", "failed", "p50", "p90", "p99",
+           "p99.9", "max");
+    for (int row = 1; row < num_rows; row++) {
+        print_row(rows[row], requests, count, row, samples);
+    }
+    print_row(rows[0], requests, count, 0, samples);
+    print_row("(all calls)", requests, count, -1, samples);
+
+    for (size_t i = num_threads; i < num_replays; i++) {
+        rpc_close_client(replays[i].cl);
+    }
+    free(samples);
+    free(threads);
+    free(replays);
+    free(rows);
+    free(requests);
+    munmap((void *) log, st.st_size);
+    close(fd);
+    free(path);
+    free(addr);
+
+    return 0;
+}
+
+
+/**
+ * Replays the requests of one recorded connection, each no earlier than it arrived relative to the
+ * first request of the log. When the replay falls behind, latency counts from when the request was
+ * due rather than when it could be sent, so a slow server is not hidden by sending less
+ *
+ * @param arg Requests to be replayed
+ * @return NULL on exit thread
+ */
+static void *run_replay(void *arg) {
+
+    struct replay *replay = (struct replay *) arg;
+    struct found *found = NULL;
+    int num_found = 0;
+    rpc_client *cl = replay->cl;
+
+    // calls use the handle of the find replayed before them, and a procedure called with no find in the
+    // log is found now so that looking it up is not counted in its first call
+    for (size_t i = 0; cl && i < replay->count; i++) {
+        const struct capture_record *record = replay->requests[i].record;
+        const char *name = (const char *) (record + 1) + record->kept;
+        if (lookup_found(found, num_found, name)) {
+            continue;
+        }
+        struct found *entry = add_found(&found, &num_found, name);
+        if (entry && record->type == 'c') {
+            entry->handle = rpc_find(cl, (char *) name);
+        }
+    }
+    pthread_mutex_lock(&lock);
+    num_ready++;
+    pthread_cond_signal(&ready);
+    while (!started) {
+        pthread_cond_wait(&go, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+    for (size_t i = 0; i < replay->count; i++) {
+        struct request *request = &replay->requests[i];
+        const struct capture_record *record = request->record;
+        const char *name = (const char *) (record + 1) + record->kept;
+
+        uint64_t due = started;
+        if (speed > 0) {
+            due += (uint64_t) ((record->time - first_time) / speed);
+            struct timespec ts = {.tv_sec = due / 1000000000ULL, .tv_nsec = due % 1000000000ULL};
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+            }
+        }
+        uint64_t sent = now_ns();
+        if (!cl) {
+            request->failed = 1;
+        } else if (record->type == 'f') {
+            rpc_handle *h = rpc_find(cl, (char *) name);
+            request->failed = !h;
+            struct found *entry = lookup_found(found, num_found, name);
+            if (entry && !entry->handle) {
+                entry->handle = h;
+            } else {
+                free(h);
+            }
+        } else {
+            struct found *entry = lookup_found(found, num_found, name);
+            rpc_handle *h = entry ? entry->handle : NULL;
+            rpc_data in = {.data1 = record->data1, .data2_len = record->data2_len,
+                           .data2 = record->data2_len ? (void *) (record + 1) : NULL};
+            // the part of a payload left out of the log is made up with zeros, so the call is the same size
+            char *padded = NULL;
+            if (record->kept < record->data2_len && (padded = calloc(1, record->data2_len))) {
+                memcpy(padded, record + 1, record->kept);
+                in.data2 = padded;
+            }
+            rpc_data *out = h && (padded || record->kept == record->data2_len) ? rpc_call(cl, h, &in) : NULL;
+            request->failed = !out;
+            rpc_data_free(out);
+            free(padded);
+        }
+        uint64_t done = now_ns();
+        request->latency = done - (speed > 0 && due < sent ? due : sent);
+    }
+
+    for (int i = 0; i < num_found; i++) {
+        free(found[i].handle);
+    }
+    free(found);
+    rpc_close_client(cl);
+    return NULL;
+}
+
+
+/**
+ * Looks up what a connection has found under a name
+ *
+ * @param found Procedures the connection knows of
+ * @param num_found Number of procedures known
+ * @param name Name of the procedure
+ * @return Entry for the procedure, NULL if there is none
+ */
+static struct found *lookup_found(struct found *found, int num_found, const char *name) {
+
+    for (int i = 0; i < num_found; i++) {
+        if (strcmp(found[i].name, name) == 0) {
+            return &found[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Adds a procedure to those a connection knows of, with no handle until it is found
+ *
+ * @param found Procedures the connection knows of, grown as needed
+ * @param num_found Number of procedures known
+ * @param name Name of the procedure
+ * @return Entry added, NULL on failure
+ */
+static struct found *add_found(struct found **found, int *num_found, const char *name) {
+
+    struct found *grown = realloc(*found, (*num_found + 1) * sizeof(**found));
+    if (!grown) {
+        return NULL;
+    }
+    grown[*num_found] = (struct found) {.name = name, .handle = NULL};
+    *found = grown;
+
+    return &grown[(*num_found)++];
+}
+
+
+/**
+ * Finds the row of the report a procedure is counted in, adding one if it has none yet
+ *
+ * @param rows Names of the rows so far, grown as needed
+ * @param num_rows Number of rows so far
+ * @param name Name of the procedure
+ * @return Index of the row, -1 on failure
+ */
+static int add_row(const char ***rows, int *num_rows, const char *name) {
+
+    for (int i = 0; i < *num_rows; i++) {
+        if (strcmp((*rows)[i], name) == 0) {
+            return i;
+        }
+    }
+    const char **grown = realloc(*rows, (*num_rows + 1) * sizeof(**rows));
+    if (!grown) {
+        return -1;
+    }
+    grown[*num_rows] = name;
+    *rows = grown;
+
+    return (*num_rows)++;
+}
+
+
+/**
+ * Prints the latency distribution of the requests counted in one row of the report
+ *
+ * @param name Label of the row
+ * @param requests Every request replayed
+ * @param count Number of requests
+ * @param row Row to be printed, -1 for every call
+ * @param samples Buffer large enough for every request's latency
+ */
+static void print_row(const char *name, struct request *requests, size_t count, int row, uint64_t *samples) {
+
+    size_t n = 0, failed = 0, total = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (row == -1 ? requests[i].row == 0 : requests[i].row != row) {
+            continue;
+        }
+        total++;
+        if (requests[i].failed) {
+            failed++;
+        } else {
+            samples[n++] = requests[i].latency;
+        }
+    }
+    if (total == 0) {
+        return;
+    }
+    printf("%-24s %9zu %7zu", name, total, failed);
+    if (n == 0) {
+        printf("\n");
+        return;
+    }
+
+    // nearest rank, so each figure is a latency that was actually seen
+    qsort(samples, n, sizeof(*samples), compare_sample);
+    int permille[] = {500, 900, 990, 999, 1000};
+    for (size_t i = 0; i < sizeof(permille) / sizeof(*permille); i++) {
+        size_t rank = (n * permille[i] + 999) / 1000;
+        printf(" %10.1f", samples[rank > 0 ? rank - 1 : 0] / 1e3);
+    }
+    printf("\n");
+}
+
+
+/**
+ * Orders requests by the connection they arrived on, then by where they are in the log
+ *
+ * @param a First request
+ * @param b Second request
+ * @return Negative, zero or positive as a comes before, with or after b
+ */
+static int compare_request(const void *a, const void *b) {
+
+    const struct request *x = a, *y = b;
+    if (x->record->connection != y->record->connection) {
+        return x->record->connection < y->record->connection ? -1 : 1;
+    }
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+
+/**
+ * Orders latencies from shortest to longest
+ *
+ * @param a First latency
+ * @param b Second latency
+ * @return Negative, zero or positive as a is shorter than, equal to or longer than b
+ */
+static int compare_sample(const void *a, const void *b) {
+
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+
+/**
+ * Reads the monotonic clock
+ *
+ * @return Time in nanoseconds
+ */
+static uint64_t now_ns() {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -8,14 +8,43 @@ rpc_data *add2_i8(rpc_data *);
 
 int main(int argc, char *argv[]) {
     rpc_server *state;
+    rpc_server_opts opts;
     int opt;
     int port;
+    int listeners_set = 0;
+    rpc_server_opts_init(&opts);
     // Reads command line flags and values
-    while ((opt = getopt(argc, argv, "p:")) != -1) {
+    while ((opt = getopt(argc, argv, "p:l:b:cm:i:w:t:r:")) != -1) {
         switch (opt) {
             case 'p':
                 port = atoi(optarg);
                 break;
+            case 'l':
+                opts.listeners = atoi(optarg);
+                opts.pin_threads = 1;
+                listeners_set = 1;
+                break;
+            case 'b':
+                opts.backlog = atoi(optarg);
+                break;
+            case 'c':
+                opts.thread_per_core = 1;
+                break;
+            case 'm':
+                opts.max_connections = atoi(optarg);
+                break;
+            case 'i':
+                opts.max_inflight = atoi(optarg);
+                break;
+            case 'w':
+                opts.workers = atoi(optarg);
+                break;
+            case 't':
+                opts.idle_timeout_ms = atoi(optarg);
+                break;
+            case 'r':
+                opts.capture_path = optarg;
+                break;
             case '?':
                 fprintf(stderr, "Error: Incorrect port number");
                 exit(EXIT_FAILURE);
@@ -23,8 +52,12 @@ int main(int argc, char *argv[]) {
         }
 
     }
+    // thread-per-core mode runs one event loop per core unless told how many
+    if (opts.thread_per_core && !listeners_set) {
+        opts.listeners = 0;
+    }
 
-    state = rpc_init_server(port);
+    state = rpc_init_server_opts(port, &opts);
     if (state == NULL) {
         fprintf(stderr, "Failed to init\n");
         exit(EXIT_FAILURE);
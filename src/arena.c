@@ -0,0 +1,130 @@
+/*
+ * arena.c - Contains definitions for a bump allocator whose allocations are all released at once
+ */
+
+#include "arena.h"
+#include <stdlib.h>
+
+#define ALIGNMENT 16
+
+
+typedef struct block {
+    struct block *next;
+    size_t size;
+    size_t used;
+    _Alignas(ALIGNMENT) char data[];
+} block_t;
+
+struct arena {
+    block_t *head;
+    size_t block_size;
+};
+
+static block_t *create_block(size_t size);
+
+
+/**
+ * Creates an empty arena
+ *
+ * @param block_size Size of each block the arena carves allocations from
+ * @return Newly created arena, NULL on failure
+ */
+arena_t *create_arena(size_t block_size) {
+
+    arena_t *arena = malloc(sizeof(*arena));
+    if (!arena) {
+        return NULL;
+    }
+    arena->block_size = block_size;
+    arena->head = create_block(block_size);
+    if (!arena->head) {
+        free(arena);
+        return NULL;
+    }
+
+    return arena;
+}
+
+
+/**
+ * Creates a block able to hold a given number of bytes
+ *
+ * @param size Usable size of the block
+ * @return Newly created block, NULL on failure
+ */
+static block_t *create_block(size_t size) {
+
+    block_t *block = malloc(sizeof(*block) + size);
+    if (!block) {
+        return NULL;
+    }
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+
+    return block;
+}
+
+
+/**
+ * Allocates memory from an arena, valid until the arena is next reset
+ *
+ * @param arena Arena to be allocated from
+ * @param size Number of bytes
+ * @return Pointer to the allocated memory, NULL on failure
+ */
+void *arena_alloc(arena_t *arena, size_t size) {
+
+    size = (size + ALIGNMENT - 1) & ~((size_t) ALIGNMENT - 1);
+
+    block_t *block = arena->head;
+    if (block->size - block->used < size) {
+        // oversized requests get a block of their own
+        block = create_block(size > arena->block_size ? size : arena->block_size);
+        if (!block) {
+            return NULL;
+        }
+        block->next = arena->head;
+        arena->head = block;
+    }
+
+    void *ptr = block->data + block->used;
+    block->used += size;
+
+    return ptr;
+}
+
+
+/**
+ * Releases every allocation made from an arena, keeping its first block for reuse
+ *
+ * @param arena Arena to be reset
+ */
+void arena_reset(arena_t *arena) {
+
+    block_t *block = arena->head;
+    // the first block created is at the tail of the list
+    while (block->next) {
+        block_t *next = block->next;
+        free(block);
+        block = next;
+    }
+    block->used = 0;
+    arena->head = block;
+}
+
+
+/**
+ * Frees a given arena along with all of its allocations
+ *
+ * @param arena Arena to be freed
+ */
+void free_arena(arena_t *arena) {
+
+    if (arena == NULL) {
+        return;
+    }
+    arena_reset(arena);
+    free(arena->head);
+    free(arena);
+}
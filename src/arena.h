@@ -0,0 +1,43 @@
+/*
+ * arena.h - Contains the interface for a bump allocator whose allocations are all released at once
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+typedef struct arena arena_t;
+
+/**
+ * Creates an empty arena
+ *
+ * @param block_size Size of each block the arena carves allocations from
+ * @return Newly created arena, NULL on failure
+ */
+arena_t *create_arena(size_t block_size);
+
+/**
+ * Allocates memory from an arena, valid until the arena is next reset
+ *
+ * @param arena Arena to be allocated from
+ * @param size Number of bytes
+ * @return Pointer to the allocated memory, NULL on failure
+ */
+void *arena_alloc(arena_t *arena, size_t size);
+
+/**
+ * Releases every allocation made from an arena, keeping its first block for reuse
+ *
+ * @param arena Arena to be reset
+ */
+void arena_reset(arena_t *arena);
+
+/**
+ * Frees a given arena along with all of its allocations
+ *
+ * @param arena Arena to be freed
+ */
+void free_arena(arena_t *arena);
+
+#endif
@@ -0,0 +1,351 @@
+/*
+ * buffer.c - Contains definitions for a growable byte buffer used to stage network I/O
+ */
+
+#include "buffer.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* smallest amount of free space offered to a single read */
+#define MIN_READ 4096
+/* most segments handed to a single sendmsg, including the buffer's own */
+#define MAX_SEND_IOV 64
+
+
+/**
+ * Creates an empty buffer
+ *
+ * @param size Initial capacity in bytes
+ * @return Newly created buffer, NULL on failure
+ */
+buffer_t *create_buffer(size_t size) {
+
+    buffer_t *buf = malloc(sizeof(*buf));
+    if (!buf) {
+        return NULL;
+    }
+
+    buf->data = malloc(size);
+    if (!buf->data) {
+        free(buf);
+        return NULL;
+    }
+    buf->start = 0;
+    buf->end = 0;
+    buf->size = size;
+
+    return buf;
+}
+
+
+/**
+ * Number of unread bytes in a buffer
+ *
+ * @param buf Buffer to be checked
+ * @return Number of unread bytes
+ */
+size_t buffer_length(buffer_t *buf) {
+
+    return buf->end - buf->start;
+}
+
+
+/**
+ * Makes sure a given number of bytes can be written after the end of a buffer
+ *
+ * @param buf Buffer to be grown
+ * @param n Number of free bytes required
+ * @return 0 on success, -1 on failure
+ */
+int buffer_reserve(buffer_t *buf, size_t n) {
+
+    // rewind once everything has been read so the space is reused without copying
+    if (buf->start == buf->end) {
+        buf->start = 0;
+        buf->end = 0;
+    }
+    if (buf->size - buf->end >= n) {
+        return 0;
+    }
+
+    // reclaim the space of already read bytes first
+    size_t length = buffer_length(buf);
+    if (buf->start > 0) {
+        memmove(buf->data, buf->data + buf->start, length);
+        buf->start = 0;
+        buf->end = length;
+        if (buf->size - buf->end >= n) {
+            return 0;
+        }
+    }
+
+    size_t size = buf->size > 0 ? buf->size : MIN_READ;
+    while (size - length < n) {
+        size *= 2;
+    }
+    char *data = realloc(buf->data, size);
+    if (!data) {
+        return -1;
+    }
+    buf->data = data;
+    buf->size = size;
+
+    return 0;
+}
+
+
+/**
+ * Gives back the memory of a buffer that has grown past a limit, once its unread bytes fit a smaller
+ * capacity
+ *
+ * @param buf Buffer to be shrunk
+ * @param size Capacity to shrink to
+ * @param limit Capacity above which the buffer is shrunk
+ * @return 0 on success (including when left as is), -1 on failure
+ */
+int buffer_shrink(buffer_t *buf, size_t size, size_t limit) {
+
+    size_t length = buffer_length(buf);
+    if (buf->size <= limit || length > size) {
+        return 0;
+    }
+
+    memmove(buf->data, buf->data + buf->start, length);
+    buf->start = 0;
+    buf->end = length;
+    char *data = realloc(buf->data, size);
+    if (!data) {
+        return -1;
+    }
+    buf->data = data;
+    buf->size = size;
+
+    return 0;
+}
+
+
+/**
+ * Copies bytes onto the end of a buffer
+ *
+ * @param buf Buffer to be appended to
+ * @param data Bytes to be appended
+ * @param n Number of bytes
+ * @return 0 on success, -1 on failure
+ */
+int buffer_append(buffer_t *buf, const void *data, size_t n) {
+
+    if (buffer_reserve(buf, n) == -1) {
+        return -1;
+    }
+    memcpy(buf->data + buf->end, data, n);
+    buf->end += n;
+
+    return 0;
+}
+
+
+/**
+ * Marks bytes at the start of a buffer as read
+ *
+ * @param buf Buffer to be consumed from
+ * @param n Number of bytes
+ */
+void buffer_consume(buffer_t *buf, size_t n) {
+
+    buf->start += n;
+}
+
+
+/**
+ * Reads whatever is available on a socket into the free space of a buffer
+ *
+ * @param buf Buffer to be read into
+ * @param fd Socket to be read over
+ * @return Number of bytes read, 0 on end of stream, -1 on failure (errno is set)
+ */
+ssize_t buffer_read_fd(buffer_t *buf, int fd) {
+
+    if (buffer_reserve(buf, MIN_READ) == -1) {
+        return -1;
+    }
+
+    ssize_t n = recv(fd, buf->data + buf->end, buf->size - buf->end, 0);
+    if (n > 0) {
+        buf->end += n;
+    }
+
+    return n;
+}
+
+
+/**
+ * Sends as much of the unread part of a buffer as the socket takes, consuming what was sent
+ *
+ * @param buf Buffer to be sent
+ * @param fd Socket to be sent over
+ * @return Number of bytes sent, -1 on failure (errno is set)
+ */
+ssize_t buffer_write_fd(buffer_t *buf, int fd) {
+
+    // MSG_NOSIGNAL so a peer that has gone away is reported rather than killing the process
+    ssize_t n = send(fd, buf->data + buf->start, buffer_length(buf), MSG_NOSIGNAL);
+    if (n > 0) {
+        buffer_consume(buf, n);
+    }
+
+    return n;
+}
+
+
+/**
+ * Sends the unread part of a buffer followed by further segments with a single sendmsg, so the segments
+ * need not be copied in first. Whatever the socket does not take is appended to the buffer
+ *
+ * @param buf Buffer to be sent ahead of the segments
+ * @param fd Socket to be sent over
+ * @param iov Segments to be sent
+ * @param iovcnt Number of segments
+ * @return Number of bytes sent (0 if the socket was full), -1 on failure (errno is set)
+ */
+ssize_t buffer_send_iov(buffer_t *buf, int fd, const struct iovec *iov, int iovcnt) {
+
+    struct iovec vec[MAX_SEND_IOV];
+    struct msghdr msg = {0};
+    size_t pending = buffer_length(buf);
+    int count = 0;
+    ssize_t n;
+
+    if (pending > 0) {
+        vec[count].iov_base = buf->data + buf->start;
+        vec[count].iov_len = pending;
+        count++;
+    }
+    // segments past the limit are appended below
+    for (int i = 0; i < iovcnt && count < MAX_SEND_IOV; i++) {
+        vec[count++] = iov[i];
+    }
+    msg.msg_iov = vec;
+    msg.msg_iovlen = count;
+
+    do {
+        n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+        n = 0;
+    }
+
+    // drop what was sent from the buffer, then keep the unsent tail of every segment
+    size_t sent = (size_t) n;
+    size_t from_buf = sent < pending ? sent : pending;
+    buffer_consume(buf, from_buf);
+    sent -= from_buf;
+    for (int i = 0; i < iovcnt; i++) {
+        size_t skip = sent < iov[i].iov_len ? sent : iov[i].iov_len;
+        sent -= skip;
+        if (iov[i].iov_len > skip
+            && buffer_append(buf, (char *) iov[i].iov_base + skip, iov[i].iov_len - skip) == -1) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    return n;
+}
+
+
+/**
+ * Sends the unread part of a buffer followed by a region of a file, the file going out with sendfile so
+ * it never passes through user space. Stops early if the socket is full
+ *
+ * @param buf Buffer to be sent ahead of the file
+ * @param fd Socket to be sent over
+ * @param file_fd File to be sent from
+ * @param offset Offset of the region, advanced past what was sent
+ * @param len Length of the region, reduced by what was sent
+ * @return 0 on success (the region is not finished if len is not 0), -1 on failure (errno is set)
+ */
+int buffer_send_file(buffer_t *buf, int fd, int file_fd, off_t *offset, size_t *len) {
+
+    ssize_t n;
+
+    // the file can only follow once everything ahead of it has gone
+    while (buffer_length(buf) > 0) {
+        if ((n = buffer_write_fd(buf, fd)) >= 0 || errno == EINTR) {
+            continue;
+        }
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+
+    while (*len > 0) {
+        n = sendfile(fd, file_fd, offset, *len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        } else if (n == 0) {
+            // the file is shorter than the region
+            errno = EIO;
+            return -1;
+        }
+        *len -= n;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Reads a region of a file onto the end of a buffer
+ *
+ * @param buf Buffer to be appended to
+ * @param file_fd File to be read from
+ * @param offset Offset of the region
+ * @param len Length of the region
+ * @return 0 on success, -1 on failure (errno is set)
+ */
+int buffer_read_file(buffer_t *buf, int file_fd, off_t offset, size_t len) {
+
+    if (buffer_reserve(buf, len) == -1) {
+        errno = ENOMEM;
+        return -1;
+    }
+    while (len > 0) {
+        ssize_t n = pread(file_fd, buf->data + buf->end, len, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            if (n == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        buf->end += n;
+        offset += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Frees a given buffer
+ *
+ * @param buf Buffer to be freed
+ */
+void free_buffer(buffer_t *buf) {
+
+    if (buf == NULL) {
+        return;
+    }
+    free(buf->data);
+    free(buf);
+}
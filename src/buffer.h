@@ -0,0 +1,135 @@
+/*
+ * buffer.h - Contains the interface for a growable byte buffer used to stage network I/O
+ */
+
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Bytes between start and end are unread, bytes after end are free */
+typedef struct buffer {
+    char *data;
+    size_t start;
+    size_t end;
+    size_t size;
+} buffer_t;
+
+/**
+ * Creates an empty buffer
+ *
+ * @param size Initial capacity in bytes
+ * @return Newly created buffer, NULL on failure
+ */
+buffer_t *create_buffer(size_t size);
+
+/**
+ * Number of unread bytes in a buffer
+ *
+ * @param buf Buffer to be checked
+ * @return Number of unread bytes
+ */
+size_t buffer_length(buffer_t *buf);
+
+/**
+ * Makes sure a given number of bytes can be written after the end of a buffer
+ *
+ * @param buf Buffer to be grown
+ * @param n Number of free bytes required
+ * @return 0 on success, -1 on failure
+ */
+int buffer_reserve(buffer_t *buf, size_t n);
+
+/**
+ * Gives back the memory of a buffer that has grown past a limit, once its unread bytes fit a smaller
+ * capacity
+ *
+ * @param buf Buffer to be shrunk
+ * @param size Capacity to shrink to
+ * @param limit Capacity above which the buffer is shrunk
+ * @return 0 on success (including when left as is), -1 on failure
+ */
+int buffer_shrink(buffer_t *buf, size_t size, size_t limit);
+
+/**
+ * Copies bytes onto the end of a buffer
+ *
+ * @param buf Buffer to be appended to
+ * @param data Bytes to be appended
+ * @param n Number of bytes
+ * @return 0 on success, -1 on failure
+ */
+int buffer_append(buffer_t *buf, const void *data, size_t n);
+
+/**
+ * Marks bytes at the start of a buffer as read
+ *
+ * @param buf Buffer to be consumed from
+ * @param n Number of bytes
+ */
+void buffer_consume(buffer_t *buf, size_t n);
+
+/**
+ * Reads whatever is available on a socket into the free space of a buffer
+ *
+ * @param buf Buffer to be read into
+ * @param fd Socket to be read over
+ * @return Number of bytes read, 0 on end of stream, -1 on failure (errno is set)
+ */
+ssize_t buffer_read_fd(buffer_t *buf, int fd);
+
+/**
+ * Sends as much of the unread part of a buffer as the socket takes, consuming what was sent
+ *
+ * @param buf Buffer to be sent
+ * @param fd Socket to be sent over
+ * @return Number of bytes sent, -1 on failure (errno is set)
+ */
+ssize_t buffer_write_fd(buffer_t *buf, int fd);
+
+/**
+ * Sends the unread part of a buffer followed by further segments with a single sendmsg, so the segments
+ * need not be copied in first. Whatever the socket does not take is appended to the buffer
+ *
+ * @param buf Buffer to be sent ahead of the segments
+ * @param fd Socket to be sent over
+ * @param iov Segments to be sent
+ * @param iovcnt Number of segments
+ * @return Number of bytes sent (0 if the socket was full), -1 on failure (errno is set)
+ */
+ssize_t buffer_send_iov(buffer_t *buf, int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Sends the unread part of a buffer followed by a region of a file, the file going out with sendfile so
+ * it never passes through user space. Stops early if the socket is full
+ *
+ * @param buf Buffer to be sent ahead of the file
+ * @param fd Socket to be sent over
+ * @param file_fd File to be sent from
+ * @param offset Offset of the region, advanced past what was sent
+ * @param len Length of the region, reduced by what was sent
+ * @return 0 on success (the region is not finished if len is not 0), -1 on failure (errno is set)
+ */
+int buffer_send_file(buffer_t *buf, int fd, int file_fd, off_t *offset, size_t *len);
+
+/**
+ * Reads a region of a file onto the end of a buffer
+ *
+ * @param buf Buffer to be appended to
+ * @param file_fd File to be read from
+ * @param offset Offset of the region
+ * @param len Length of the region
+ * @return 0 on success, -1 on failure (errno is set)
+ */
+int buffer_read_file(buffer_t *buf, int file_fd, off_t offset, size_t len);
+
+/**
+ * Frees a given buffer
+ *
+ * @param buf Buffer to be freed
+ */
+void free_buffer(buffer_t *buf);
+
+#endif
@@ -0,0 +1,253 @@
+/*
+ * capture.c - Contains definitions for writing logs of captured requests
+ */
+
+#include "capture.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// records gathered are written at least this often, so a log is never far behind
+#define FLUSH_NS 100000000ULL
+
+
+struct capture {
+    int fd;
+    // monotonic time the capture started, record times count from here
+    uint64_t started;
+    size_t size;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    // buffer records are appended to
+    char *active;
+    size_t used;
+    // buffer handed to the writer and not yet taken, NULL if there is none
+    char *pending;
+    size_t pending_len;
+    // buffer free to be swapped in, NULL while the writer has it
+    char *spare;
+    atomic_ulong dropped;
+};
+
+static void *run_writer(void *arg);
+static void swap_buffers(capture_t *capture);
+static int write_all(int fd, const char *bytes, size_t len);
+static uint64_t clock_ns(clockid_t clock);
+
+
+/**
+ * Creates a capture log, truncating any file already at the path, and starts the thread writing it out.
+ * Records are gathered in one of two buffers while the other is written, so appending never waits on
+ * the disk
+ *
+ * @param path File the log is written to
+ * @param buffer_size Bytes of records gathered before they are written, held twice over
+ * @return Newly created capture, NULL on failure
+ */
+capture_t *create_capture(const char *path, size_t buffer_size) {
+
+    capture_t *capture = malloc(sizeof(*capture));
+    if (!capture) {
+        return NULL;
+    }
+    capture->active = malloc(buffer_size);
+    capture->spare = malloc(buffer_size);
+    capture->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (!capture->active || !capture->spare || capture->fd < 0) {
+        if (capture->fd >= 0) {
+            close(capture->fd);
+        }
+        free(capture->active);
+        free(capture->spare);
+        free(capture);
+        return NULL;
+    }
+
+    struct capture_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    header.version = CAPTURE_VERSION;
+    header.header_len = sizeof(header);
+    header.started = clock_ns(CLOCK_REALTIME);
+    capture->started = clock_ns(CLOCK_MONOTONIC);
+    capture->size = buffer_size;
+    capture->used = 0;
+    capture->pending = NULL;
+    capture->pending_len = 0;
+    atomic_init(&capture->dropped, 0);
+    pthread_mutex_init(&capture->lock, NULL);
+    pthread_cond_init(&capture->ready, NULL);
+
+    // the writer lives as long as the process
+    pthread_t thread;
+    if (write_all(capture->fd, (char *) &header, sizeof(header)) == -1
+        || pthread_create(&thread, NULL, run_writer, capture) != 0) {
+        close(capture->fd);
+        free(capture->active);
+        free(capture->spare);
+        free(capture);
+        return NULL;
+    }
+    pthread_detach(thread);
+
+    return capture;
+}
+
+
+/**
+ * Appends a record to a capture log. The record is dropped rather than waiting when the writer has fallen
+ * a whole buffer behind, or when it would not fit in a buffer at all
+ *
+ * @param capture Capture to be appended to
+ * @param record Record header, its length and time are filled in
+ * @param time Monotonic time the request arrived, in nanoseconds
+ * @param name Procedure name, name_len bytes long
+ * @param payload Payload, at least kept bytes long
+ * @return 0 on success, -1 if the record was dropped
+ */
+int capture_append(capture_t *capture, struct capture_record *record, uint64_t time, const char *name,
+                   const void *payload) {
+
+    // the name is followed by a nul so that it can be used straight from a mapped log
+    size_t len = sizeof(*record) + record->kept + record->name_len + 1;
+    len = (len + CAPTURE_ALIGN - 1) & ~(size_t) (CAPTURE_ALIGN - 1);
+    if (len > capture->size || len > UINT32_MAX) {
+        atomic_fetch_add_explicit(&capture->dropped, 1, memory_order_relaxed);
+        return -1;
+    }
+    record->length = len;
+    record->time = time > capture->started ? time - capture->started : 0;
+
+    pthread_mutex_lock(&capture->lock);
+    if (capture->used + len > capture->size) {
+        if (!capture->spare) {
+            pthread_mutex_unlock(&capture->lock);
+            atomic_fetch_add_explicit(&capture->dropped, 1, memory_order_relaxed);
+            return -1;
+        }
+        swap_buffers(capture);
+    }
+    char *p = capture->active + capture->used;
+    memcpy(p, record, sizeof(*record));
+    p += sizeof(*record);
+    if (record->kept) {
+        memcpy(p, payload, record->kept);
+        p += record->kept;
+    }
+    memcpy(p, name, record->name_len);
+    p += record->name_len;
+    memset(p, 0, capture->active + capture->used + len - p);
+    capture->used += len;
+    pthread_mutex_unlock(&capture->lock);
+
+    return 0;
+}
+
+
+/**
+ * Counts the records a capture has dropped
+ *
+ * @param capture Capture to be checked
+ * @return Number of records dropped
+ */
+unsigned long capture_dropped(capture_t *capture) {
+
+    return atomic_load_explicit(&capture->dropped, memory_order_relaxed);
+}
+
+
+/**
+ * Writes out each buffer handed over, taking whatever has been gathered itself once none has been for a
+ * while
+ *
+ * @param arg Capture to be written
+ * @return NULL on exit thread
+ */
+static void *run_writer(void *arg) {
+
+    capture_t *capture = (capture_t *) arg;
+
+    pthread_mutex_lock(&capture->lock);
+    while (1) {
+        if (!capture->pending) {
+            uint64_t until = clock_ns(CLOCK_REALTIME) + FLUSH_NS;
+            struct timespec ts = {.tv_sec = until / 1000000000ULL, .tv_nsec = until % 1000000000ULL};
+            if (pthread_cond_timedwait(&capture->ready, &capture->lock, &ts) == ETIMEDOUT
+                && !capture->pending && capture->used > 0 && capture->spare) {
+                swap_buffers(capture);
+            }
+            continue;
+        }
+        char *bytes = capture->pending;
+        size_t len = capture->pending_len;
+        capture->pending = NULL;
+        pthread_mutex_unlock(&capture->lock);
+
+        write_all(capture->fd, bytes, len);
+
+        pthread_mutex_lock(&capture->lock);
+        capture->spare = bytes;
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Hands the buffer being appended to over to the writer and starts on the spare, the lock being held
+ *
+ * @param capture Capture whose buffers are swapped
+ */
+static void swap_buffers(capture_t *capture) {
+
+    capture->pending = capture->active;
+    capture->pending_len = capture->used;
+    capture->active = capture->spare;
+    capture->spare = NULL;
+    capture->used = 0;
+    pthread_cond_signal(&capture->ready);
+}
+
+
+/**
+ * Writes bytes to a file in full
+ *
+ * @param fd File to be written to
+ * @param bytes Bytes to be written
+ * @param len Number of bytes
+ * @return 0 on success, -1 on failure
+ */
+static int write_all(int fd, const char *bytes, size_t len) {
+
+    while (len > 0) {
+        ssize_t n = write(fd, bytes, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            return -1;
+        }
+        bytes += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Reads a clock
+ *
+ * @param clock Clock to be read
+ * @return Time in nanoseconds
+ */
+static uint64_t clock_ns(clockid_t clock) {
+
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -0,0 +1,83 @@
+/*
+ * capture.h - Contains the interface for writing, and the layout of, logs of captured requests
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CAPTURE_MAGIC "RPCCAP01"
+#define CAPTURE_VERSION 1
+// records start, and are padded to end, on a multiple of this
+#define CAPTURE_ALIGN 8
+
+/* Start of a capture log. Everything is in the byte order of the host that wrote it, so that a log can be
+ * mapped into memory and read in place */
+struct capture_header {
+    char magic[8];
+    uint32_t version;
+    // where the first record starts
+    uint32_t header_len;
+    // wall clock time the capture started, in nanoseconds since the epoch
+    uint64_t started;
+};
+
+/* A request as received, followed by the part of its payload kept, then its procedure name and a
+ * terminating nul, then padding up to the next record */
+struct capture_record {
+    // nanoseconds after the capture started that the request arrived
+    uint64_t time;
+    // whole record including its padding, so a reader can skip to the next
+    uint32_t length;
+    // connection the request arrived on, numbered from 0 in the order connections were accepted
+    uint32_t connection;
+    // id the procedure was found under, 0 if it was not
+    uint32_t proc_id;
+    int32_t data1;
+    uint64_t data2_len;
+    // leading bytes of the payload kept, the rest having been left out to bound the cost of capturing
+    uint32_t kept;
+    uint16_t name_len;
+    // 'f' for a find, 'c' for a call
+    char type;
+    char pad;
+};
+
+typedef struct capture capture_t;
+
+/**
+ * Creates a capture log, truncating any file already at the path, and starts the thread writing it out.
+ * Records are gathered in one of two buffers while the other is written, so appending never waits on
+ * the disk
+ *
+ * @param path File the log is written to
+ * @param buffer_size Bytes of records gathered before they are written, held twice over
+ * @return Newly created capture, NULL on failure
+ */
+capture_t *create_capture(const char *path, size_t buffer_size);
+
+/**
+ * Appends a record to a capture log. The record is dropped rather than waiting when the writer has fallen
+ * a whole buffer behind, or when it would not fit in a buffer at all
+ *
+ * @param capture Capture to be appended to
+ * @param record Record header, its length and time are filled in
+ * @param time Monotonic time the request arrived, in nanoseconds
+ * @param name Procedure name, name_len bytes long
+ * @param payload Payload, at least kept bytes long
+ * @return 0 on success, -1 if the record was dropped
+ */
+int capture_append(capture_t *capture, struct capture_record *record, uint64_t time, const char *name,
+                   const void *payload);
+
+/**
+ * Counts the records a capture has dropped
+ *
+ * @param capture Capture to be checked
+ * @return Number of records dropped
+ */
+unsigned long capture_dropped(capture_t *capture);
+
+#endif
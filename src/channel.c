@@ -0,0 +1,199 @@
+/*
+ * channel.c - Contains definitions for a bounded in-memory byte stream between threads
+ */
+
+#include "channel.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* initial capacity of the bytes held, which grows up to the channel's capacity */
+#define MIN_HELD 4096
+
+
+struct channel {
+    pthread_mutex_t lock;
+    // signalled when bytes are written or the channel is closed, and when the reader makes room
+    pthread_cond_t readable;
+    pthread_cond_t writable;
+    // bytes written and not yet read
+    buffer_t *held;
+    size_t capacity;
+    int closed;
+};
+
+static int wait_until(pthread_cond_t *cond, pthread_mutex_t *lock, uint64_t deadline);
+
+
+/**
+ * Creates an empty channel
+ *
+ * @param capacity Bytes that may be written ahead of the reader before writing waits
+ * @return Newly created channel, NULL on failure
+ */
+channel_t *create_channel(size_t capacity) {
+
+    channel_t *channel = malloc(sizeof(*channel));
+    if (!channel) {
+        return NULL;
+    }
+    channel->held = create_buffer(capacity < MIN_HELD ? capacity : MIN_HELD);
+    if (!channel->held) {
+        free(channel);
+        return NULL;
+    }
+    channel->capacity = capacity;
+    channel->closed = 0;
+    pthread_mutex_init(&channel->lock, NULL);
+    // deadlines are taken from the monotonic clock
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&channel->readable, &attr);
+    pthread_cond_init(&channel->writable, &attr);
+    pthread_condattr_destroy(&attr);
+
+    return channel;
+}
+
+
+/**
+ * Moves the unread part of a buffer into a channel, waiting for the reader to make room as needed
+ *
+ * @param channel Channel to be written to
+ * @param buf Buffer to be sent, consuming what was moved
+ * @param deadline Monotonic time in nanoseconds to give up waiting, 0 for none
+ * @return Number of bytes moved, -1 on failure (errno is EPIPE once the channel is closed, or EAGAIN if
+ * the deadline passed with some of the buffer left)
+ */
+ssize_t channel_write(channel_t *channel, buffer_t *buf, uint64_t deadline) {
+
+    ssize_t moved = 0;
+
+    pthread_mutex_lock(&channel->lock);
+    while (buffer_length(buf) > 0) {
+        if (channel->closed) {
+            pthread_mutex_unlock(&channel->lock);
+            errno = EPIPE;
+            return -1;
+        }
+        size_t room = channel->capacity - buffer_length(channel->held);
+        if (room == 0) {
+            if (wait_until(&channel->writable, &channel->lock, deadline) == -1) {
+                pthread_mutex_unlock(&channel->lock);
+                errno = EAGAIN;
+                return -1;
+            }
+            continue;
+        }
+        size_t n = buffer_length(buf) < room ? buffer_length(buf) : room;
+        if (buffer_append(channel->held, buf->data + buf->start, n) == -1) {
+            pthread_mutex_unlock(&channel->lock);
+            errno = ENOMEM;
+            return -1;
+        }
+        buffer_consume(buf, n);
+        moved += n;
+        pthread_cond_signal(&channel->readable);
+    }
+    pthread_mutex_unlock(&channel->lock);
+
+    return moved;
+}
+
+
+/**
+ * Waits for bytes in a channel and moves all of them onto the end of a buffer
+ *
+ * @param channel Channel to be read from
+ * @param buf Buffer to be read into
+ * @param deadline Monotonic time in nanoseconds to give up waiting, 0 for none
+ * @return Number of bytes moved, 0 once the channel is closed and empty, -1 on failure (errno is EAGAIN
+ * if the deadline passed)
+ */
+ssize_t channel_read(channel_t *channel, buffer_t *buf, uint64_t deadline) {
+
+    pthread_mutex_lock(&channel->lock);
+    while (buffer_length(channel->held) == 0) {
+        if (channel->closed) {
+            pthread_mutex_unlock(&channel->lock);
+            return 0;
+        } else if (wait_until(&channel->readable, &channel->lock, deadline) == -1) {
+            pthread_mutex_unlock(&channel->lock);
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+    size_t n = buffer_length(channel->held);
+    if (buffer_append(buf, channel->held->data + channel->held->start, n) == -1) {
+        pthread_mutex_unlock(&channel->lock);
+        errno = ENOMEM;
+        return -1;
+    }
+    buffer_consume(channel->held, n);
+    pthread_cond_signal(&channel->writable);
+    pthread_mutex_unlock(&channel->lock);
+
+    return n;
+}
+
+
+/**
+ * Closes a channel. The reader still gets the bytes already written, while writers fail from now on
+ *
+ * @param channel Channel to be closed
+ */
+void channel_close(channel_t *channel) {
+
+    pthread_mutex_lock(&channel->lock);
+    channel->closed = 1;
+    pthread_cond_broadcast(&channel->readable);
+    pthread_cond_broadcast(&channel->writable);
+    pthread_mutex_unlock(&channel->lock);
+}
+
+
+/**
+ * Frees a given channel
+ *
+ * @param channel Channel to be freed
+ */
+void free_channel(channel_t *channel) {
+
+    if (channel == NULL) {
+        return;
+    }
+    pthread_mutex_destroy(&channel->lock);
+    pthread_cond_destroy(&channel->readable);
+    pthread_cond_destroy(&channel->writable);
+    free_buffer(channel->held);
+    free(channel);
+}
+
+
+/**
+ * Waits on a condition until it is signalled or a deadline passes
+ *
+ * @param cond Condition to be waited on
+ * @param lock Lock held by the caller
+ * @param deadline Monotonic time in nanoseconds to give up waiting, 0 for none
+ * @return 0 once signalled (or woken spuriously), -1 if the deadline has passed
+ */
+static int wait_until(pthread_cond_t *cond, pthread_mutex_t *lock, uint64_t deadline) {
+
+    if (!deadline) {
+        pthread_cond_wait(cond, lock);
+        return 0;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec >= deadline) {
+        return -1;
+    }
+    struct timespec ts = {.tv_sec = deadline / 1000000000ULL, .tv_nsec = deadline % 1000000000ULL};
+    pthread_cond_timedwait(cond, lock, &ts);
+
+    return 0;
+}
@@ -0,0 +1,58 @@
+/*
+ * channel.h - Contains the interface for a bounded in-memory byte stream between threads
+ */
+
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include "buffer.h"
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef struct channel channel_t;
+
+/**
+ * Creates an empty channel
+ *
+ * @param capacity Bytes that may be written ahead of the reader before writing waits
+ * @return Newly created channel, NULL on failure
+ */
+channel_t *create_channel(size_t capacity);
+
+/**
+ * Moves the unread part of a buffer into a channel, waiting for the reader to make room as needed
+ *
+ * @param channel Channel to be written to
+ * @param buf Buffer to be sent, consuming what was moved
+ * @param deadline Monotonic time in nanoseconds to give up waiting, 0 for none
+ * @return Number of bytes moved, -1 on failure (errno is EPIPE once the channel is closed, or EAGAIN if
+ * the deadline passed with some of the buffer left)
+ */
+ssize_t channel_write(channel_t *channel, buffer_t *buf, uint64_t deadline);
+
+/**
+ * Waits for bytes in a channel and moves all of them onto the end of a buffer
+ *
+ * @param channel Channel to be read from
+ * @param buf Buffer to be read into
+ * @param deadline Monotonic time in nanoseconds to give up waiting, 0 for none
+ * @return Number of bytes moved, 0 once the channel is closed and empty, -1 on failure (errno is EAGAIN
+ * if the deadline passed)
+ */
+ssize_t channel_read(channel_t *channel, buffer_t *buf, uint64_t deadline);
+
+/**
+ * Closes a channel. The reader still gets the bytes already written, while writers fail from now on
+ *
+ * @param channel Channel to be closed
+ */
+void channel_close(channel_t *channel);
+
+/**
+ * Frees a given channel
+ *
+ * @param channel Channel to be freed
+ */
+void free_channel(channel_t *channel);
+
+#endif
@@ -0,0 +1,196 @@
+/*
+ * crc32c.c - Contains definitions for computing CRC32C (Castagnoli) checksums
+ */
+
+#include "crc32c.h"
+#include <pthread.h>
+#include <string.h>
+#include <endian.h>
+
+#if defined(__x86_64__)
+    #include <nmmintrin.h>
+#endif
+
+// reflected Castagnoli polynomial
+#define POLY 0x82f63b78
+// long buffers are taken three blocks of this size at a time, as three independent crc32 chains keep the
+// instruction's pipeline full where one would wait on each result
+#define BLOCK 8192
+
+
+// table[k][b] is the checksum of byte b followed by k zero bytes, so 8 bytes are folded in at once
+static uint32_t table[8][256];
+// shift[k][b] is the register that byte b in position k of a register becomes after BLOCK zero bytes,
+// which joins the checksums of consecutive blocks
+static uint32_t shift[4][256];
+static int hardware;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static void init_crc32c(void);
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len);
+static uint32_t shift_block(uint32_t crc);
+#if defined(__x86_64__)
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len);
+#endif
+
+
+/**
+ * Extends a CRC32C checksum over more bytes, using the SSE4.2 crc32 instruction where the CPU has it and
+ * slicing by 8 bytes otherwise
+ *
+ * @param crc Checksum of the bytes before, 0 to start a new one
+ * @param data Bytes to be added
+ * @param len Number of bytes
+ * @return Checksum of the bytes before followed by these
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+
+    pthread_once(&once, init_crc32c);
+
+    // the register starts and ends inverted, so checksums of consecutive pieces chain
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (hardware) {
+        return ~crc32c_hw(crc, data, len);
+    }
+#endif
+
+    return ~crc32c_sw(crc, data, len);
+}
+
+
+/**
+ * Builds the tables for slicing by 8 and checks whether the CPU has the crc32 instruction
+ */
+static void init_crc32c(void) {
+
+    for (int b = 0; b < 256; b++) {
+        uint32_t c = b;
+        for (int i = 0; i < 8; i++) {
+            c = c & 1 ? (c >> 1) ^ POLY : c >> 1;
+        }
+        table[0][b] = c;
+    }
+    for (int b = 0; b < 256; b++) {
+        for (int k = 1; k < 8; k++) {
+            table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xff];
+        }
+    }
+
+    // the register is linear in its bits, so a shift is the sum of those of each bit set
+    uint32_t bits[32];
+    for (int i = 0; i < 32; i++) {
+        uint32_t c = (uint32_t) 1 << i;
+        for (int n = 0; n < BLOCK; n++) {
+            c = (c >> 8) ^ table[0][c & 0xff];
+        }
+        bits[i] = c;
+    }
+    for (int k = 0; k < 4; k++) {
+        for (int b = 0; b < 256; b++) {
+            shift[k][b] = 0;
+            for (int i = 0; i < 8; i++) {
+                if (b & (1 << i)) {
+                    shift[k][b] ^= bits[8 * k + i];
+                }
+            }
+        }
+    }
+
+#if defined(__x86_64__)
+    hardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+
+/**
+ * Moves a checksum register past BLOCK zero bytes
+ *
+ * @param crc Register
+ * @return Register after the zero bytes
+ */
+static uint32_t shift_block(uint32_t crc) {
+
+    return shift[0][crc & 0xff] ^ shift[1][(crc >> 8) & 0xff] ^ shift[2][(crc >> 16) & 0xff]
+           ^ shift[3][crc >> 24];
+}
+
+
+/**
+ * Folds bytes into an inverted checksum register 8 at a time with table lookups
+ *
+ * @param crc Register
+ * @param p Bytes to be added
+ * @param len Number of bytes
+ * @return Register after the bytes
+ */
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len) {
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        word ^= crc;
+        crc = table[7][word & 0xff] ^ table[6][(word >> 8) & 0xff] ^ table[5][(word >> 16) & 0xff]
+              ^ table[4][(word >> 24) & 0xff] ^ table[3][(word >> 32) & 0xff] ^ table[2][(word >> 40) & 0xff]
+              ^ table[1][(word >> 48) & 0xff] ^ table[0][word >> 56];
+        p += 8;
+        len -= 8;
+    }
+#endif
+    while (len-- > 0) {
+        crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+    }
+
+    return crc;
+}
+
+
+#if defined(__x86_64__)
+/**
+ * Folds bytes into an inverted checksum register 8 at a time with the SSE4.2 crc32 instruction
+ *
+ * @param crc Register
+ * @param p Bytes to be added
+ * @param len Number of bytes
+ * @return Register after the bytes
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+
+    while (len >= 3 * BLOCK) {
+        uint64_t c0 = crc, c1 = 0, c2 = 0;
+        const unsigned char *end = p + BLOCK;
+        do {
+            uint64_t w0, w1, w2;
+            memcpy(&w0, p, sizeof(w0));
+            memcpy(&w1, p + BLOCK, sizeof(w1));
+            memcpy(&w2, p + 2 * BLOCK, sizeof(w2));
+            c0 = _mm_crc32_u64(c0, w0);
+            c1 = _mm_crc32_u64(c1, w1);
+            c2 = _mm_crc32_u64(c2, w2);
+            p += 8;
+        } while (p < end);
+        // the blocks were each checksummed from zero, so the earlier ones only need moving past the later
+        crc = shift_block((uint32_t) c0) ^ (uint32_t) c1;
+        crc = shift_block(crc) ^ (uint32_t) c2;
+        p += 2 * BLOCK;
+        len -= 3 * BLOCK;
+    }
+
+    uint64_t c = crc;
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        c = _mm_crc32_u64(c, word);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t) c;
+    while (len-- > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+
+    return crc;
+}
+#endif
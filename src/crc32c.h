@@ -0,0 +1,22 @@
+/*
+ * crc32c.h - Contains the interface for computing CRC32C (Castagnoli) checksums
+ */
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Extends a CRC32C checksum over more bytes, using the SSE4.2 crc32 instruction where the CPU has it and
+ * slicing by 8 bytes otherwise
+ *
+ * @param crc Checksum of the bytes before, 0 to start a new one
+ * @param data Bytes to be added
+ * @param len Number of bytes
+ * @return Checksum of the bytes before followed by these
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+#endif
@@ -87,7 +87,7 @@ int insert_data(hash_table_t *table, void *key, void *data, hash_func hash, comp
     } else {
         node_t *current = table->buckets[index];
 
-        while (current != NULL) {
+        while (1) {
             // replace the data
             if (cmp(current->key, key) == 0) {
                 // free replaced data (keeps current key)
@@ -100,7 +100,10 @@ int insert_data(hash_table_t *table, void *key, void *data, hash_func hash, comp
                     key = NULL;
                 }
                 current->data = data;
-                table->num_items++;
+                free(new_node);
+                return 1;
+            }
+            if (current->next == NULL) {
                 break;
             }
             current = current->next;
@@ -137,6 +140,23 @@ void *get_data(hash_table_t *table, void *key, hash_func hash, compare_func cmp)
     return NULL;
 }
 
+/**
+ * Calls a function on every element of a given hash-table
+ *
+ * @param table Table to be iterated over
+ * @param func Function taking the key, data and extra argument
+ * @param arg Extra argument passed to the function
+ */
+void iterate_table(hash_table_t *table, iter_func func, void *arg) {
+
+    for (int i = 0; i < TABLE_SIZE; i++) {
+        for (node_t *current = table->buckets[i]; current; current = current->next) {
+            func(current->key, current->data, arg);
+        }
+    }
+}
+
+
 /**
  * Frees a given hash-table
  *
@@ -13,6 +13,7 @@ typedef struct hash_table hash_table_t;
 typedef uint32_t (*hash_func)(void *);
 typedef int (*compare_func)(void *, void *);
 typedef void (*free_func)(void *);
+typedef void (*iter_func)(void *, void *, void *);
 
 /**
  * Creates an empty hash table
@@ -47,6 +48,15 @@ int insert_data(hash_table_t *table, void *key, void *data, hash_func hash, comp
  */
 void *get_data(hash_table_t *table, void *key, hash_func hash, compare_func cmp);
 
+/**
+ * Calls a function on every element of a given hash-table
+ *
+ * @param table Table to be iterated over
+ * @param func Function taking the key, data and extra argument
+ * @param arg Extra argument passed to the function
+ */
+void iterate_table(hash_table_t *table, iter_func func, void *arg);
+
 /**
  * Frees a given hash-table
  *
@@ -0,0 +1,389 @@
+/*
+ * pool.c - Contains definitions for a work-stealing pool of worker threads
+ */
+
+#include "pool.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#define MIN_TASKS 64
+
+
+typedef struct task {
+    task_func func;
+    void *arg;
+} task_t;
+
+/* a worker's queue, the owner takes its oldest task while thieves take the newest */
+typedef struct deque {
+    pthread_mutex_t lock;
+    task_t *tasks;
+    size_t head;
+    size_t count;
+    size_t size;
+} deque_t;
+
+typedef struct worker {
+    pool_t *pool;
+    int index;
+    // one queue per lane
+    deque_t *deques;
+    // lane being served and how many more tasks may be taken from it before moving on
+    int lane;
+    int credit;
+} worker_t;
+
+struct pool {
+    int num_workers;
+    worker_t *workers;
+    int num_lanes;
+    // NULL for strict priority between lanes
+    int *weights;
+    // tasks queued across every deque, workers only sleep once it reaches zero
+    atomic_size_t pending;
+    // spreads tasks submitted from outside the pool across the workers
+    atomic_uint next;
+    atomic_int sleeping;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    // set under the lock when the pool could not be created, telling the workers started to exit
+    int stopping;
+};
+
+// the worker running on this thread, if any
+static __thread worker_t *current;
+
+static void free_pool(pool_t *pool, pthread_t *threads, int started);
+static void *run_worker(void *arg);
+static int take_task(worker_t *worker, task_t *task);
+static int take_from_lane(worker_t *worker, int lane, task_t *task);
+static int deque_push(deque_t *deque, task_t task);
+static int deque_pop(deque_t *deque, task_t *task);
+static int deque_steal(deque_t *deque, task_t *task);
+
+
+/**
+ * Creates a pool and starts its workers, each with its own queue of tasks for every lane. Lower lanes
+ * are served first, strictly or in proportion to their weights
+ *
+ * @param num_workers Number of worker threads
+ * @param num_lanes Number of lanes tasks may be submitted to
+ * @param weights Tasks a worker takes from each lane before moving to the next, NULL to always take from
+ * the lowest lane with any
+ * @return Newly created pool, NULL on failure
+ */
+pool_t *create_pool(int num_workers, int num_lanes, const int *weights) {
+
+    pool_t *pool = malloc(sizeof(*pool));
+    if (!pool) {
+        return NULL;
+    }
+    pool->num_workers = num_workers;
+    pool->num_lanes = num_lanes;
+    atomic_init(&pool->pending, 0);
+    atomic_init(&pool->next, 0);
+    atomic_init(&pool->sleeping, 0);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->ready, NULL);
+    pool->stopping = 0;
+    pool->workers = calloc(num_workers, sizeof(*pool->workers));
+    pool->weights = weights ? malloc(num_lanes * sizeof(*pool->weights)) : NULL;
+    if (!pool->workers || (weights && !pool->weights)) {
+        free_pool(pool, NULL, 0);
+        return NULL;
+    }
+    for (int i = 0; weights && i < num_lanes; i++) {
+        // every lane gets a turn
+        pool->weights[i] = weights[i] > 0 ? weights[i] : 1;
+    }
+
+    int allocated = 1;
+    for (int i = 0; allocated && i < num_workers; i++) {
+        worker_t *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->index = i;
+        worker->lane = 0;
+        worker->credit = weights ? pool->weights[0] : 0;
+        worker->deques = calloc(num_lanes, sizeof(*worker->deques));
+        for (int j = 0; worker->deques && j < num_lanes; j++) {
+            deque_t *deque = &worker->deques[j];
+            pthread_mutex_init(&deque->lock, NULL);
+            deque->tasks = malloc(MIN_TASKS * sizeof(*deque->tasks));
+            deque->head = 0;
+            deque->count = 0;
+            deque->size = MIN_TASKS;
+            allocated = allocated && deque->tasks;
+        }
+        allocated = allocated && worker->deques;
+    }
+    pthread_t *threads = allocated ? malloc(num_workers * sizeof(*threads)) : NULL;
+    if (!threads) {
+        free_pool(pool, NULL, 0);
+        return NULL;
+    }
+
+    // threads are only let go once every one has started, so that a failure can still stop them
+    for (int i = 0; i < num_workers; i++) {
+        if (pthread_create(&threads[i], NULL, run_worker, &pool->workers[i]) != 0) {
+            free_pool(pool, threads, i);
+            free(threads);
+            return NULL;
+        }
+    }
+    // workers live as long as the process
+    for (int i = 0; i < num_workers; i++) {
+        pthread_detach(threads[i]);
+    }
+    free(threads);
+
+    return pool;
+}
+
+
+/**
+ * Submits a task to a pool. Tasks submitted by a worker go to its own queue, others are spread across
+ * the workers, and idle workers steal from the others
+ *
+ * @param pool Pool to run the task
+ * @param lane Lane the task is queued in
+ * @param func Function to be run
+ * @param arg Argument passed to the function
+ * @return 0 on success, -1 on failure
+ */
+int pool_submit(pool_t *pool, int lane, task_func func, void *arg) {
+
+    worker_t *worker = current;
+    if (!worker || worker->pool != pool) {
+        worker = &pool->workers[atomic_fetch_add_explicit(&pool->next, 1, memory_order_relaxed)
+                                % pool->num_workers];
+    }
+
+    if (lane < 0 || lane >= pool->num_lanes) {
+        return -1;
+    }
+    task_t task = {.func = func, .arg = arg};
+    if (deque_push(&worker->deques[lane], task) == -1) {
+        return -1;
+    }
+
+    // pairs with the sleeping count being raised before pending is checked, so a wakeup is never lost
+    atomic_fetch_add(&pool->pending, 1);
+    if (atomic_load(&pool->sleeping) > 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->ready);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return 0;
+}
+
+
+/**
+ * Frees a pool that could not be created in full, first stopping and waiting for any workers started
+ *
+ * @param pool Pool to be freed
+ * @param threads Threads of the workers started, NULL if none were
+ * @param started Number of workers started
+ */
+static void free_pool(pool_t *pool, pthread_t *threads, int started) {
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 0; pool->workers && i < pool->num_workers; i++) {
+        deque_t *deques = pool->workers[i].deques;
+        for (int j = 0; deques && j < pool->num_lanes; j++) {
+            pthread_mutex_destroy(&deques[j].lock);
+            free(deques[j].tasks);
+        }
+        free(deques);
+    }
+    free(pool->workers);
+    free(pool->weights);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->ready);
+    free(pool);
+}
+
+
+/**
+ * Runs tasks from a worker's own queue, stealing from the other workers once it is empty and sleeping
+ * once there is nothing left anywhere
+ *
+ * @param arg Worker to be run
+ * @return NULL on exit thread
+ */
+static void *run_worker(void *arg) {
+
+    worker_t *worker = (worker_t *) arg;
+    pool_t *pool = worker->pool;
+    task_t task;
+    current = worker;
+
+    while (1) {
+        if (take_task(worker, &task)) {
+            atomic_fetch_sub(&pool->pending, 1);
+            task.func(task.arg);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        atomic_fetch_add(&pool->sleeping, 1);
+        while (atomic_load(&pool->pending) == 0 && !pool->stopping) {
+            pthread_cond_wait(&pool->ready, &pool->lock);
+        }
+        atomic_fetch_sub(&pool->sleeping, 1);
+        if (pool->stopping) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Takes the next task for a worker, choosing the lane by the pool's policy
+ *
+ * @param worker Worker looking for a task
+ * @param task Buffer to store the task
+ * @return 1 if a task was taken, 0 if every queue is empty
+ */
+static int take_task(worker_t *worker, task_t *task) {
+
+    pool_t *pool = worker->pool;
+
+    if (!pool->weights) {
+        for (int lane = 0; lane < pool->num_lanes; lane++) {
+            if (take_from_lane(worker, lane, task)) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    // weighted round robin, a lane with nothing queued gives up the rest of its turn
+    for (int i = 0; i <= pool->num_lanes; i++) {
+        if (worker->credit > 0 && take_from_lane(worker, worker->lane, task)) {
+            worker->credit--;
+            return 1;
+        }
+        worker->lane = (worker->lane + 1) % pool->num_lanes;
+        worker->credit = pool->weights[worker->lane];
+    }
+
+    return 0;
+}
+
+
+/**
+ * Takes a task from one lane, first from the worker's own queue and then from the others in turn
+ *
+ * @param worker Worker looking for a task
+ * @param lane Lane to take from
+ * @param task Buffer to store the task
+ * @return 1 if a task was taken, 0 if the lane is empty
+ */
+static int take_from_lane(worker_t *worker, int lane, task_t *task) {
+
+    pool_t *pool = worker->pool;
+
+    if (deque_pop(&worker->deques[lane], task)) {
+        return 1;
+    }
+    for (int i = 1; i < pool->num_workers; i++) {
+        worker_t *victim = &pool->workers[(worker->index + i) % pool->num_workers];
+        if (deque_steal(&victim->deques[lane], task)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * Adds a task to the back of a queue, growing it if full
+ *
+ * @param deque Queue to be added to
+ * @param task Task to be added
+ * @return 0 on success, -1 on failure
+ */
+static int deque_push(deque_t *deque, task_t task) {
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == deque->size) {
+        task_t *tasks = malloc(deque->size * 2 * sizeof(*tasks));
+        if (!tasks) {
+            pthread_mutex_unlock(&deque->lock);
+            return -1;
+        }
+        // unwrap the ring into the new array
+        for (size_t i = 0; i < deque->count; i++) {
+            tasks[i] = deque->tasks[(deque->head + i) % deque->size];
+        }
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->head = 0;
+        deque->size *= 2;
+    }
+    deque->tasks[(deque->head + deque->count) % deque->size] = task;
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+
+    return 0;
+}
+
+
+/**
+ * Takes the oldest task from a queue, used by its owner so that calls run in the order they arrived
+ *
+ * @param deque Queue to be taken from
+ * @param task Buffer to store the task
+ * @return 1 if a task was taken, 0 if the queue is empty
+ */
+static int deque_pop(deque_t *deque, task_t *task) {
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == 0) {
+        pthread_mutex_unlock(&deque->lock);
+        return 0;
+    }
+    *task = deque->tasks[deque->head];
+    deque->head = (deque->head + 1) % deque->size;
+    deque->count--;
+    pthread_mutex_unlock(&deque->lock);
+
+    return 1;
+}
+
+
+/**
+ * Takes the newest task from a queue, used by other workers so they contend with the owner as little
+ * as possible
+ *
+ * @param deque Queue to be taken from
+ * @param task Buffer to store the task
+ * @return 1 if a task was taken, 0 if the queue is empty
+ */
+static int deque_steal(deque_t *deque, task_t *task) {
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == 0) {
+        pthread_mutex_unlock(&deque->lock);
+        return 0;
+    }
+    deque->count--;
+    *task = deque->tasks[(deque->head + deque->count) % deque->size];
+    pthread_mutex_unlock(&deque->lock);
+
+    return 1;
+}
@@ -0,0 +1,37 @@
+/*
+ * pool.h - Contains the interface for a work-stealing pool of worker threads
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+typedef struct pool pool_t;
+
+/* Work run by a pool, given the argument it was submitted with */
+typedef void (*task_func)(void *);
+
+/**
+ * Creates a pool and starts its workers, each with its own queue of tasks for every lane. Lower lanes
+ * are served first, strictly or in proportion to their weights
+ *
+ * @param num_workers Number of worker threads
+ * @param num_lanes Number of lanes tasks may be submitted to
+ * @param weights Tasks a worker takes from each lane before moving to the next, NULL to always take from
+ * the lowest lane with any
+ * @return Newly created pool, NULL on failure
+ */
+pool_t *create_pool(int num_workers, int num_lanes, const int *weights);
+
+/**
+ * Submits a task to a pool. Tasks submitted by a worker go to its own queue, others are spread across
+ * the workers, and idle workers steal from the others
+ *
+ * @param pool Pool to run the task
+ * @param lane Lane the task is queued in
+ * @param func Function to be run
+ * @param arg Argument passed to the function
+ * @return 0 on success, -1 on failure
+ */
+int pool_submit(pool_t *pool, int lane, task_func func, void *arg);
+
+#endif
@@ -4,20 +4,39 @@
  * Date: 1-5-2023
  */
 
+#define _GNU_SOURCE
+
 #include "rpc.h"
 #include "hash_table.h"
+#include "buffer.h"
+#include "arena.h"
+#include "pool.h"
+#include "crc32c.h"
+#include "capture.h"
+#include "channel.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 #include <endian.h>
 #include <time.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 
 
 /* redefining htobe64 and be64toh */
@@ -31,37 +50,526 @@
 
 /* constants */
 #define MAX_NAME_LEN 1000
-#define NUM_ERROR_MESSAGES 12
-
-/* flags */
+#define NUM_ERROR_MESSAGES 14
+#define DEFAULT_BACKLOG SOMAXCONN
+#define BUFFER_SIZE 4096
+#define ARENA_BLOCK_SIZE 65536
+#define MAX_EVENTS 64
+#define MAX_VARINT_LEN 10
+// payloads this large are sent from where they are rather than copied into the output buffer
+#define GATHER_MIN 4096
+// input buffers grown past this by a large payload are shrunk back once it has been handled
+#define MAX_IDLE_BUFFER 65536
+// responses to pipelined requests are held back to go out together until this many bytes are waiting
+#define COALESCE_BYTES 65536
+// or until the oldest would otherwise wait longer than this
+#define COALESCE_NS 200000
+// pause before accepting again once the process has run out of descriptors or memory
+#define ACCEPT_BACKOFF_NS 10000000
+
+/* protocol versions, a client proposes one in a HELLO before any other request and both sides use the
+ * lower of theirs. Clients that never send one are served with fixed-width fields */
+#define PROTOCOL_FIXED 1
+// integers, lengths and ids as LEB128 varints, integers zigzag encoded
+#define PROTOCOL_COMPACT 2
+#define PROTOCOL_VERSION PROTOCOL_COMPACT
+/* features a client may ask for in the bits of its HELLO above the version. The server answers with the
+ * version along with the features it agrees to, which older servers never do */
+#define VERSION_MASK 0xff
+// every frame after the HELLO ends with a CRC32C of the whole frame, see rpc_set_checksums
+#define FEATURE_CHECKSUMS 0x100
+#define CHECKSUM_LEN 4
+
+/* flags, every request carries an id that is echoed in its response so that calls may finish out of order */
 #define FIND 'f'
 #define CALL 'c'
 #define FOUND 'y'
 #define NOT_FOUND 'n'
 #define CONSISTENT 'g'
 #define INCONSISTENT 'b'
+#define BUSY 'z'
+#define TIMEOUT 't'
+#define TOO_LARGE 'l'
+#define HELLO 'h'
+// a frame whose checksum did not match, the connection is closed after it
+#define CORRUPT 'k'
+// a call over its procedure's rate limit
+#define THROTTLED 'q'
+// frames of streaming calls. Messages go from the server and records from the client, each followed by
+// an END, and the side taking them hands back credit. The client may also cancel a stream
+#define MESSAGE 'm'
+#define RECORD 'r'
+#define END 'e'
+#define CREDIT 'w'
+#define CANCEL 'x'
+// responses with this id concern the connection as a whole rather than one request
+#define CONNECTION_ID 0
+
+#define DEFAULT_EJECT_FAILURES 3
+#define DEFAULT_EJECT_MS 1000
+// how many times an ejection may double
+#define MAX_EJECT_SHIFT 5
+#define DEFAULT_HEDGE_PERCENTILE 95
+// recent latencies kept for each procedure of a cluster
+#define LATENCY_SAMPLES 128
+// calls are only hedged once this many latencies are known, and the delay is worked out again as often
+#define HEDGE_SAMPLES 16
+// bytes of messages or records a stream, and all the streams of a connection, may have sent that the
+// other side has not yet taken. Credit is handed back half a window at a time
+#define STREAM_WINDOW 262144
+#define CONNECTION_WINDOW 1048576
+// counted for every message or record on top of its payload, so that empty ones use up credit too
+#define FRAME_COST 64
+// largest record an upload may send, counting FRAME_COST. Anything larger could wait for credit forever,
+// as a window with less than half of it taken hands nothing back
+#define MAX_RECORD_COST (STREAM_WINDOW / 2)
+// buckets of the table of single-flight calls being run
+#define FLIGHT_BUCKETS 64
+// payloads received up to this size are kept in the same allocation as their rpc_data
+#define INLINE_PAYLOAD 64
+// calls of a batch procedure run together at most, and how long the first waits for others, by default
+#define DEFAULT_MAX_BATCH 64
+#define DEFAULT_BATCH_WAIT_US 0
+// buckets of the table of peer addresses with rate limits
+#define PEER_BUCKETS 64
+// records of captured requests gathered before they are written, held twice over
+#define CAPTURE_BUFFER 4194304
+// bytes either end of an in-process connection may send ahead of the other reading them, as a socket's
+// buffers would hold
+#define LOOPBACK_CAPACITY 262144
+
+/* a payload made up of segments by rpc_data_from_iov, whose data2 is set to iov_payload */
+struct iov_data {
+    rpc_data data;
+    int iovcnt;
+    struct iovec iov[];
+};
+static char iov_payload;
+
+/* a payload referring to a file region by rpc_data_from_file, whose data2 is set to file_payload */
+struct file_data {
+    rpc_data data;
+    int fd;
+    off_t offset;
+};
+static char file_payload;
+
+/* a payload received and kept past the read, whose data2 points at bytes when it is small enough to
+ * fit there instead of being allocated on its own */
+struct inline_data {
+    rpc_data data;
+    unsigned char bytes[INLINE_PAYLOAD];
+};
 
 #define NONBLOCKING
 
-struct rpc_server {
+/* work admitted by a server, or by a single core in thread-per-core mode, along with its limits */
+struct load {
+    atomic_int connections;
+    atomic_int inflight;
+    atomic_size_t queued_bytes;
+    atomic_ulong shed_calls;
+    atomic_ulong shed_connections;
+    atomic_ulong expired_calls;
+    atomic_ulong rejected_payloads;
+    atomic_ulong idle_closed;
+    atomic_ulong coalesced_calls;
+    atomic_ulong corrupt_frames;
+    atomic_ulong throttled_calls;
+    // payload bytes held across the whole server, shared by every load
+    atomic_size_t *payload_memory;
+    int max_connections;
+    int max_inflight;
+    size_t max_queued_bytes;
+};
+
+/* a listening socket served by its own accept loop */
+struct listener {
+    rpc_server *srv;
     int listenfd;
-    int connectfd;
+    int index;
+    struct load *load;
+};
+
+/* the two directions of an in-process connection, shared by its client and the server's end of it */
+struct loopback {
+    channel_t *to_server;
+    channel_t *to_client;
+    // held by each end, the channels are freed once both have let go
+    atomic_int refs;
+};
+
+struct rpc_server {
+    int num_listeners;
+    struct listener *listeners;
+    int pin_threads;
+    int thread_per_core;
+    int numa_local;
+    // one per core in thread-per-core mode, otherwise shared by all listeners
+    int num_loads;
+    struct load *loads;
     hash_table_t *reg_procedures;
-    hash_table_t *found_procedures;
+    hash_table_t *id_procedures;
+    // handler threads calls are handed to, NULL to run handlers on the thread that read them
+    int num_workers;
+    pool_t *pool;
+    int strict_priority;
+    int priority_weights[RPC_NUM_PRIORITIES];
+    int idle_timeout_ms;
+    size_t max_payload;
+    size_t max_payload_memory;
+    atomic_size_t payload_memory;
+    // single-flight calls being run, by the hash of their procedure and input
+    pthread_mutex_t flights_lock;
+    struct flight *flights[FLIGHT_BUCKETS];
+    // batches of every batch procedure, run at the end of a pass if they have no wait
+    struct batch *batches;
+    // procedures with a rate limit, each with its buckets at its own index on every connection and peer
+    int num_limits;
+    int limit_peers;
+    // how long a peer without connections is remembered, after which its buckets would be full again
+    uint64_t peer_linger;
+    pthread_mutex_t peers_lock;
+    struct peer *peers[PEER_BUCKETS];
+    // log every request received is appended to, NULL unless capturing, and the connections numbered so far
+    capture_t *capture;
+    size_t capture_max_payload;
+    atomic_uint captured_connections;
+};
+
+/* state owned by a single pinned thread in thread-per-core mode, never touched by other cores */
+struct core {
+    rpc_server *srv;
+    struct listener *listener;
+    int epollfd;
+    // read-only snapshot of the server's procedures
+    hash_table_t *reg_procedures;
+    hash_table_t *id_procedures;
+    // holds incoming requests, reset after every pass of the event loop
+    arena_t *arena;
+    // every open connection, checked for idleness every so often
+    struct connection *connections;
+    uint64_t swept;
+    // the core's own batches of its batch procedures
+    struct batch *batches;
+};
+
+/* an accepted connection along with its staged input and output */
+struct connection {
+    rpc_server *srv;
+    int connectfd;
+    buffer_t *in;
+    buffer_t *out;
+    // owning core in thread-per-core mode, NULL when the connection has a thread of its own
+    struct core *core;
+    struct load *load;
+    uint32_t events;
+    // when input last arrived, deadlines of the requests in it count from here
+    uint64_t arrival;
+    // protocol version agreed with the client, and whether frames carry checksums
+    int version;
+    int checksums;
+    // where the request being handled starts in the input buffer
+    size_t frame;
+    // guards the output and closed flag, responses may be sent from any thread
+    pthread_mutex_t lock;
+    int closed;
+    // held by the thread reading the connection and by each call still to complete
+    atomic_int refs;
+    // when a request was last handled or a call completed
+    atomic_ullong active;
+    // payload memory reserved for the call being received
+    size_t reserved;
+    // bytes still to be dropped of a payload that was refused
+    size_t discard;
+    // neighbours in the owning core's list of connections
+    struct connection *prev;
+    struct connection *next;
+    // streaming calls in progress, guarded by the lock
+    struct rpc_sink *streams;
+    struct rpc_source *uploads;
+    // bytes of messages that may still be sent across every stream, and of records the client may still
+    // send across every upload, along with those taken since credit was last handed back
+    long send_credit;
+    long recv_credit;
+    size_t recv_consumed;
+    // set while the connection's input is being handled, responses are held back until it has been.
+    // Those held back have been waiting since held, which only the thread reading the connection touches
+    int batching;
+    uint64_t held;
+    // whether the socket is corked so that a batch written in parts still goes out in full segments
+    int corked;
+    // whether a call was queued this pass on a batch without a wait, which is then run at the end of it
+    int queued_batch;
+    // whether the call being received has been admitted, so that it is only counted once as it arrives
+    int receiving;
+    // buckets of the procedures with a rate limit on each connection, touched only by the reading thread
+    struct bucket *buckets;
+    // the peer's shared buckets, NULL unless a procedure is limited by address
+    struct peer *peer;
+    // calls the connection has queued on the workers, the rest wait in order until one of those has run,
+    // so that each connection with work gets its turn. Guarded by the lock
+    int queued;
+    struct rpc_token *waiting;
+    struct rpc_token *waiting_last;
+    // number the connection's requests are captured under
+    uint32_t capture_id;
+    // channels to a client in the same process, NULL for a socket
+    struct loopback *loop;
+};
+
+/* a response as read by the client, the fields used depend on the status */
+struct response {
+    char status;
+    uint32_t call_id;
+    uint32_t proc_id;
+    size_t version;
+    size_t credit;
+    rpc_data data;
 };
 
 struct rpc_client {
+    // -1 for a client in the same process as its server, which goes through loop instead
     int sockfd;
+    struct loopback *loop;
+    buffer_t *in;
+    buffer_t *out;
+    rpc_status status;
+    // protocol version agreed with the server, and whether frames carry checksums
+    int version;
+    int checksums;
+    // set once the server has turned the connection away as too busy
+    int rejected;
+    // id of the next request, responses to any other id are from calls given up on
+    uint32_t next_id;
+    // the latest response, whose payload is left in the input buffer
+    struct response response;
+    // stream in progress, which has the connection to itself until it is closed
+    struct rpc_stream *stream;
+    // bytes of records that may still be sent across every upload, and of messages taken since credit
+    // for the connection was last handed back
+    long send_credit;
+    size_t recv_consumed;
+};
+
+/* a streaming call as seen by the client, either taking messages or sending records */
+struct rpc_stream {
+    rpc_client *client;
+    uint32_t call_id;
+    int upload;
+    // bytes of messages taken since credit was last handed back
+    size_t consumed;
+    // bytes of records that may be sent before the server hands back credit
+    long credit;
+    // set once the stream has ended or failed
+    int done;
+    // answer to an upload that arrived before it was closed, along with its status
+    rpc_data *result;
+    rpc_status status;
 };
 
 struct rpc_handle {
     uint32_t id;
+    // set for handles found through a cluster, whose procedure ids differ between servers
+    char *name;
+    // id on each of the cluster's servers, tagged with the server's generation, 0 until found
+    atomic_ullong *ids;
+    struct latencies *latencies;
+};
+
+/* recent latencies of a cluster's procedure, from which the delay before hedging its calls is taken */
+struct latencies {
+    atomic_uint count;
+    // microseconds, oldest overwritten first
+    atomic_uint samples[LATENCY_SAMPLES];
+    // nanoseconds, 0 until enough latencies are known
+    atomic_ullong hedge_delay;
+};
+
+/* one copy of a call made through a cluster, on a connection taken for it */
+struct leg {
+    struct endpoint *ep;
+    rpc_client *client;
+    uint32_t call_id;
+    // set once the connection has failed
+    int failed;
+    // set once the copy is no longer waited for
+    int abandoned;
+};
+
+/* health of a server in a cluster */
+enum endpoint_state {
+    ENDPOINT_HEALTHY = 0,
+    ENDPOINT_EJECTED,
+    // ejected but sitting out no longer, a single call is finding out whether it is back
+    ENDPOINT_PROBING
+};
+
+/* a server of a cluster, along with its connections that no call is using */
+struct endpoint {
+    char *addr;
+    int port;
+    pthread_mutex_t lock;
+    rpc_client **idle;
+    int num_idle;
+    int max_idle;
+    atomic_int outstanding;
+    atomic_int state;
+    // calls failed in a row
+    atomic_int failures;
+    // ejections since the server last answered, each sitting out twice as long
+    atomic_int ejections;
+    atomic_ullong ejected_until;
+    // raised whenever a connection fails, as the server may have restarted with new procedure ids
+    atomic_uint generation;
+};
+
+struct rpc_cluster {
+    int num_endpoints;
+    struct endpoint *endpoints;
+    rpc_balance balance;
+    int eject_failures;
+    int eject_ms;
+    int hedge_percentile;
+    // rotates where the least outstanding search starts, so ties are spread
+    atomic_uint next;
 };
 
-/* used to store both handler and handler id in hash table */
+/* used to store both handler and handler id in hash table, only one kind of handler is set */
 struct handler_item {
+    // name the procedure was registered under, owned by the table it is in
+    char *name;
     rpc_handler handler;
+    rpc_async_handler async_handler;
+    rpc_stream_handler stream_handler;
+    rpc_upload_handler upload_handler;
+    rpc_batch_handler batch_handler;
     uint32_t id;
+    rpc_priority priority;
+    // identical calls arriving while one is run wait for its output, see rpc_set_single_flight
+    int single_flight;
+    // moving average of how long the handler takes when run by the thread reading a connection
+    atomic_ullong cost;
+    // calls of a batch procedure waiting to be run together, NULL for any other
+    struct batch *batch;
+    // index of the procedure's buckets, -1 if its calls are not rate limited
+    int limit_index;
+    rpc_rate_limit limits[RPC_NUM_LIMIT_SCOPES];
+};
+
+/* a call handed to a worker or an asynchronous handler, holding a reference to its connection */
+struct rpc_token {
+    struct connection *conn;
+    uint32_t call_id;
+    rpc_data *data;
+    struct handler_item *item;
+    // when the client stops waiting, 0 for never
+    uint64_t deadline;
+    // identical calls waiting on this one, NULL if the procedure is not single-flight
+    struct flight *flight;
+    // where a streaming procedure sends its messages, NULL for any other
+    struct rpc_sink *sink;
+    // where an upload procedure takes its records from, NULL for any other
+    struct rpc_source *source;
+    // next call of the connection waiting for its turn on the workers
+    struct rpc_token *next;
+};
+
+/* a streaming call being run on the server, its messages sent as the client hands back credit */
+struct rpc_sink {
+    struct connection *conn;
+    uint32_t call_id;
+    // bytes of messages that may be sent before the client hands back credit, guarded by the connection's
+    // lock. Any message may be sent while there is some left, so it may go below zero
+    long credit;
+    int cancelled;
+    // signalled along with the connection's lock when credit arrives or the stream is given up on
+    pthread_cond_t ready;
+    struct rpc_sink *next;
+};
+
+/* a record of an upload waiting to be taken, freed by rpc_data_free like any payload */
+struct record {
+    struct inline_data data;
+    struct record *next;
+};
+
+/* an upload being run on the server, holding the records that have arrived but not been taken */
+struct rpc_source {
+    struct connection *conn;
+    uint32_t call_id;
+    // records in the order they arrived, guarded by the connection's lock along with the rest
+    struct record *first;
+    struct record *last;
+    // bytes of records the client may still send, and of those taken since credit was last handed back
+    long credit;
+    size_t consumed;
+    // set once the client has sent its last record, or given up
+    int ended;
+    // signalled along with the connection's lock when a record arrives or the upload ends
+    pthread_cond_t ready;
+    struct rpc_source *next;
+};
+
+/* a single-flight call being run, whose output answers every identical call that arrives meanwhile */
+struct flight {
+    uint32_t proc_id;
+    uint64_t hash;
+    // input of the call being run, compared in full as hashes may collide
+    rpc_data *data;
+    struct waiter *waiters;
+    struct flight *next;
+};
+
+/* calls of a batch procedure collected to be run together, one per core in thread-per-core mode */
+struct batch {
+    rpc_server *srv;
+    struct handler_item *item;
+    int max_calls;
+    uint64_t max_wait;
+    pthread_mutex_t lock;
+    // signalled when the first call of a batch arrives, for the thread running batches once they have waited
+    pthread_cond_t ready;
+    int timer;
+    rpc_token **tokens;
+    int count;
+    // when the first call of the batch arrived
+    uint64_t started;
+    struct batch *next;
+};
+
+/* a batch taken to be run, along with the arrays its handler is given */
+struct batch_run {
+    struct handler_item *item;
+    int count;
+    rpc_token **tokens;
+    rpc_data **in;
+    rpc_data **out;
+};
+
+/* the allowance left of a rate limit, refilled continuously up to its burst */
+struct bucket {
+    double calls;
+    double bytes;
+    // when it was last refilled, 0 while it is still full from the start
+    uint64_t updated;
+};
+
+/* a peer address with a rate limit, shared by its connections and remembered for a while after them */
+struct peer {
+    struct in6_addr addr;
+    int refs;
+    uint64_t released;
+    struct peer *next;
+    struct bucket buckets[];
+};
+
+/* an identical call waiting on a flight, holding a reference to its connection and its admission */
+struct waiter {
+    struct connection *conn;
+    uint32_t call_id;
+    size_t bytes;
+    struct waiter *next;
 };
 
 /* error handling */
@@ -77,7 +585,9 @@ const char *error_messages[NUM_ERROR_MESSAGES] = {
         "Overlength",
         "Insertion failed",
         "Thread failed",
-        "Invalid procedure name"
+        "Invalid procedure name",
+        "Checksum mismatch",
+        "Capture log failed"
 };
 
 enum error_codes {
@@ -92,28 +602,141 @@ enum error_codes {
     OVERLENGTH,
     INSERTION,
     THREAD,
-    INVALID_NAME
+    INVALID_NAME,
+    CHECKSUM,
+    CAPTURE
 };
 
 
 
-static int send_size(size_t size, int sockfd);
-static int recv_size(int sockfd, size_t *size);
-static int send_string(char *message, int sockfd);
-static int recv_string(size_t size, char *buffer, int sockfd);
-static int send_data(int sockfd, rpc_data *data);
-static int recv_data(int sockfd, rpc_data *buffer);
-static int recv_int(int sockfd, int *data);
-static int send_int(int sockfd, int data);
-static int send_void(int sockfd, size_t size, void *data);
-static int recv_void(int sockfd, size_t size, void *data);
+static int encode_flag(buffer_t *buf, char flag);
+static int decode_flag(buffer_t *buf, char *flag);
+static int encode_int(buffer_t *buf, int version, int data);
+static int decode_int(buffer_t *buf, int version, int *num);
+static int encode_size(buffer_t *buf, int version, size_t size);
+static int decode_size(buffer_t *buf, int version, size_t *size);
+static int encode_id(buffer_t *buf, int version, uint32_t id);
+static int decode_id(buffer_t *buf, int version, uint32_t *id);
+static int encode_varint(buffer_t *buf, uint64_t value);
+static int decode_varint(buffer_t *buf, uint64_t *value);
+static int encode_string(buffer_t *buf, int version, char *str);
+static int decode_string(buffer_t *buf, int version, char *str);
+static int encode_data(buffer_t *buf, int version, rpc_data *data);
+static int decode_data(buffer_t *buf, int version, rpc_data *data);
+static int decode_data_header(buffer_t *buf, int version, rpc_data *data);
+static int decode_payload(buffer_t *buf, rpc_data *data);
+static uint32_t frame_checksum(buffer_t *buf, size_t frame, rpc_data *data);
+static int encode_checksum(buffer_t *buf, uint32_t crc);
+static int decode_checksum(buffer_t *buf, size_t frame);
+static int send_data(buffer_t *buf, int fd, rpc_data *data);
+static int own_payload(struct inline_data *owned);
+static int payload_segments(rpc_data *data, const struct iovec **iov, struct iovec *single);
 static uint32_t hash_djb2(char* str);
 static uint32_t hash_int(uint32_t* num);
 static uint32_t generate_id();
+static uint32_t next_call_id(rpc_client *cl);
 int int_cmp(uint32_t *a, uint32_t *b);
-static int send_flag(int sockfd, char data);
-static int recv_flag(int sockfd, char *data);
-static void *handle_connection(void *srv);
+static int register_procedure(rpc_server *srv, char *name, struct handler_item *handlers);
+static void *handle_connection(void *arg);
+static void *accept_loop(void *arg);
+static void *run_core(void *arg);
+static struct core *create_core(struct listener *listener);
+static void copy_procedure(void *key, void *data, void *arg);
+static void accept_connections(struct core *core);
+static void sweep_connections(struct core *core, uint64_t now);
+static int service_connection(struct connection *conn);
+static struct connection *create_connection(rpc_server *srv, int connectfd, struct core *core, struct load *load);
+static void close_connection(struct connection *conn);
+static void release_connection(struct connection *conn);
+static int is_idle(struct connection *conn, uint64_t now);
+static int process_input(struct connection *conn);
+static int handle_hello(struct connection *conn);
+static int handle_find(struct connection *conn);
+static int handle_call(struct connection *conn);
+static int check_frame(struct connection *conn, uint32_t call_id);
+static void capture_request(struct connection *conn, char type, char *name, uint32_t proc_id, rpc_data *data);
+static void run_call(void *arg);
+static int expire_call(rpc_token *token);
+static struct batch *create_batch(rpc_server *srv, struct handler_item *item, int max_calls,
+                                  uint64_t max_wait);
+static void queue_batch(struct connection *conn, struct batch *batch, rpc_token *token);
+static struct batch_run *take_batch(struct batch *batch);
+static void dispatch_batch(rpc_server *srv, struct batch_run *run);
+static void run_batch(void *arg);
+static void *run_batch_timer(void *arg);
+static void run_due_batches(struct connection *conn);
+static void *run_stream_thread(void *arg);
+static void run_stream(rpc_token *token);
+static int handle_stream_control(struct connection *conn, char type);
+static int handle_record(struct connection *conn);
+static struct rpc_sink *create_sink(struct connection *conn, uint32_t call_id);
+static void free_sink(struct rpc_sink *sink);
+static struct rpc_source *create_source(struct connection *conn, uint32_t call_id);
+static void free_source(struct rpc_source *source);
+static void connection_credit(struct connection *conn, size_t bytes);
+static int join_flight(struct connection *conn, uint32_t call_id, struct handler_item *item, rpc_data *data,
+                       struct flight **flight);
+static int abandon_flight(rpc_server *srv, struct flight *flight);
+static void finish_flight(rpc_server *srv, struct flight *flight, rpc_data *result);
+static uint64_t hash_call(uint32_t id, rpc_data *data);
+static rpc_data *copy_result(rpc_data *result);
+static int send_result(struct connection *conn, uint32_t call_id, rpc_data *result);
+static int send_status(struct connection *conn, uint32_t call_id, char status);
+static int send_response(struct connection *conn, size_t frame, rpc_data *data);
+static void release_held(struct connection *conn, uint64_t expected);
+static int flush_connection(struct connection *conn);
+static void cork_connection(struct connection *conn, int cork);
+static void init_load(struct load *load, rpc_server_opts *opts, int share, atomic_size_t *payload_memory);
+static int admit_connection(struct load *load, int connectfd);
+static int admit_call(struct load *load, size_t bytes);
+static void release_call(struct load *load, size_t bytes);
+static char reserve_payload(struct connection *conn, size_t bytes);
+static void release_payload(struct connection *conn, size_t bytes);
+static int throttle_call(struct connection *conn, struct handler_item *item, size_t bytes);
+static int refill_bucket(struct bucket *bucket, const rpc_rate_limit *limit, uint64_t now);
+static void charge_bucket(struct bucket *bucket, size_t bytes);
+static struct peer *find_peer(rpc_server *srv, int connectfd);
+static void release_peer(rpc_server *srv, struct peer *peer);
+static void submit_call(struct connection *conn, rpc_token *token);
+static void run_turn(void *arg);
+static void pass_turn(struct connection *conn);
+static void set_events(struct connection *conn, uint32_t events);
+static int create_listener(struct addrinfo *addr, int backlog, int reuseport);
+static int count_cpus();
+static int pin_thread(int index);
+static rpc_client *create_client(int sockfd, struct loopback *loop);
+static void release_loopback(struct loopback *loop);
+static int negotiate_version(rpc_client *cl, size_t features);
+static rpc_data *call_procedure(rpc_client *cl, rpc_handle *h, rpc_data *payload, int timeout_ms);
+static int send_call(rpc_client *cl, rpc_handle *h, rpc_data *payload, uint64_t deadline, uint32_t *call_id);
+static rpc_data *call_output(rpc_client *cl);
+static rpc_data *take_result(rpc_client *cl, rpc_data *result);
+static int decode_response(buffer_t *buf, int version, int checksums, struct response *res);
+static int client_receive(rpc_client *cl, uint32_t call_id, struct response *res, uint64_t deadline);
+static int client_send(rpc_client *cl, size_t frame, rpc_data *payload, uint64_t deadline);
+static int client_flush(rpc_client *cl, uint64_t deadline);
+static int client_fill(rpc_client *cl, uint64_t deadline);
+static rpc_stream *open_stream(rpc_client *cl, rpc_handle *h, rpc_data *payload, int upload);
+static int send_control(rpc_client *cl, char type, uint32_t call_id, size_t credit, uint64_t deadline);
+static int await_credit(rpc_stream *stream);
+static int client_consumed(rpc_client *cl, size_t bytes, uint64_t deadline);
+static uint64_t now_ns();
+static int cluster_call(rpc_cluster *cl, rpc_handle *h, rpc_data *payload, int timeout_ms, int hedge,
+                        rpc_data **result, rpc_status *status);
+static int start_leg(rpc_cluster *cl, rpc_handle *h, rpc_data *payload, uint64_t deadline, struct endpoint *avoid,
+                     struct leg *leg, rpc_status *status);
+static int await_legs(struct leg *legs, int num_legs, uint64_t until);
+static void finish_leg(rpc_cluster *cl, struct leg *leg);
+static int client_take_response(rpc_client *cl, uint32_t call_id, struct response *res);
+static void record_latency(rpc_cluster *cl, rpc_handle *h, uint64_t latency);
+static int compare_latency(const void *a, const void *b);
+static struct endpoint *pick_endpoint(rpc_cluster *cl, struct endpoint *avoid);
+static int claim_endpoint(struct endpoint *ep, uint64_t now);
+static rpc_client *checkout_client(struct endpoint *ep, rpc_status *status);
+static void checkin_client(struct endpoint *ep, rpc_client *client);
+static int resolve_id(rpc_cluster *cl, struct endpoint *ep, rpc_client *client, rpc_handle *h, uint32_t *id);
+static void record_outcome(rpc_cluster *cl, struct endpoint *ep, rpc_status status);
+static void eject_endpoint(rpc_cluster *cl, struct endpoint *ep);
 static void error_print(enum error_codes code);
 static int is_valid_char(char c);
 static int is_valid_name(char *name);
@@ -128,17 +751,89 @@ static int is_valid_name(char *name);
  */
 rpc_server *rpc_init_server(int port) {
 
-    int enable = 1, s, listenfd;
-    struct addrinfo hints, *res, *p;
+    return rpc_init_server_opts(port, NULL);
+}
+
+
+/**
+ * Fills server options with their default values (a single listener)
+ *
+ * @param opts Options to be initialised
+ */
+void rpc_server_opts_init(rpc_server_opts *opts) {
+
+    if (opts == NULL) {
+        return;
+    }
+    memset(opts, 0, sizeof(*opts));
+    opts->listeners = 1;
+    opts->backlog = DEFAULT_BACKLOG;
+    opts->pin_threads = 0;
+    opts->thread_per_core = 0;
+    opts->numa_local = 0;
+    opts->max_connections = 0;
+    opts->max_inflight = 0;
+    opts->max_queued_bytes = 0;
+    opts->workers = 0;
+    opts->strict_priority = 0;
+    opts->priority_weights[RPC_PRIORITY_CONTROL] = 8;
+    opts->priority_weights[RPC_PRIORITY_NORMAL] = 4;
+    opts->priority_weights[RPC_PRIORITY_BULK] = 1;
+    opts->idle_timeout_ms = 0;
+    opts->max_payload = 0;
+    opts->max_payload_memory = 0;
+    opts->capture_path = NULL;
+    opts->capture_max_payload = 0;
+}
+
+
+/**
+ * Initialises data used for the server and creates the listening sockets described by the options
+ *
+ * @param port Port number
+ * @param opts Server options, NULL for defaults
+ * @return Rpc server data
+ */
+rpc_server *rpc_init_server_opts(int port, rpc_server_opts *opts) {
+
+    int s, num_listeners;
+    struct addrinfo hints, *res;
+    rpc_server_opts defaults;
 
     char port_str[6];
 
+    if (opts == NULL) {
+        rpc_server_opts_init(&defaults);
+        opts = &defaults;
+    }
+    // thread-per-core mode defaults to a listener for every core
+    num_listeners = opts->listeners;
+    if (num_listeners == 0 && opts->thread_per_core) {
+        num_listeners = count_cpus();
+    }
+    if (num_listeners < 1 || opts->backlog < 1 || opts->workers < 0 || opts->idle_timeout_ms < 0) {
+        error_print(INVALID_ARGUMENTS);
+        return NULL;
+    }
+
+    // cores each keep their own counts so admission never touches another core's memory
+    int num_loads = opts->thread_per_core ? num_listeners : 1;
+
     struct rpc_server *server = malloc(sizeof(*server));
+    struct listener *listeners = malloc(num_listeners * sizeof(*listeners));
+    struct load *loads = malloc(num_loads * sizeof(*loads));
 
-    if (!server) {
+    if (!server || !listeners || !loads) {
         error_print(MEMORY_ALL0CATION);
+        free(server);
+        free(listeners);
+        free(loads);
         return NULL;
     }
+    atomic_init(&server->payload_memory, 0);
+    for (int i = 0; i < num_loads; i++) {
+        init_load(&loads[i], opts, num_loads, &server->payload_memory);
+    }
 
     // convert port to string
     sprintf(port_str, "%d", port);
@@ -150,43 +845,122 @@ rpc_server *rpc_init_server(int port) {
     s = getaddrinfo(NULL, port_str, &hints, &res);
     if (s != 0) {
         error_print(ADDRESS_INFO);
+        free(server);
+        free(listeners);
+        free(loads);
+        return NULL;
+    }
+
+    // each listener gets its own socket bound to the same port, the kernel then spreads connections across them
+    for (int i = 0; i < num_listeners; i++) {
+        listeners[i].srv = server;
+        listeners[i].index = i;
+        listeners[i].load = &loads[i % num_loads];
+        listeners[i].listenfd = create_listener(res, opts->backlog, num_listeners > 1);
+
+        if (listeners[i].listenfd < 0) {
+            error_print(SOCKET_CREATION);
+            while (i-- > 0) {
+                close(listeners[i].listenfd);
+            }
+            freeaddrinfo(res);
+            free(server);
+            free(listeners);
+            free(loads);
+            return NULL;
+        }
+    }
+
+    freeaddrinfo(res);
+
+    // the log is opened last, as its writer cannot be stopped again
+    capture_t *capture = NULL;
+    if (opts->capture_path && !(capture = create_capture(opts->capture_path, CAPTURE_BUFFER))) {
+        error_print(CAPTURE);
+        for (int i = 0; i < num_listeners; i++) {
+            close(listeners[i].listenfd);
+        }
+        free(server);
+        free(listeners);
+        free(loads);
         return NULL;
     }
 
+    // assign to server
+    server->num_listeners = num_listeners;
+    server->listeners = listeners;
+    server->pin_threads = opts->pin_threads;
+    server->thread_per_core = opts->thread_per_core;
+    server->numa_local = opts->numa_local;
+    server->num_workers = opts->workers;
+    server->pool = NULL;
+    server->strict_priority = opts->strict_priority;
+    memcpy(server->priority_weights, opts->priority_weights, sizeof(server->priority_weights));
+    server->idle_timeout_ms = opts->idle_timeout_ms;
+    server->max_payload = opts->max_payload;
+    server->max_payload_memory = opts->max_payload_memory;
+    pthread_mutex_init(&server->flights_lock, NULL);
+    memset(server->flights, 0, sizeof(server->flights));
+    server->batches = NULL;
+    server->num_limits = 0;
+    server->limit_peers = 0;
+    server->peer_linger = 0;
+    pthread_mutex_init(&server->peers_lock, NULL);
+    memset(server->peers, 0, sizeof(server->peers));
+    server->capture = capture;
+    server->capture_max_payload = opts->capture_max_payload;
+    atomic_init(&server->captured_connections, 0);
+    server->num_loads = num_loads;
+    server->loads = loads;
+
+    server->reg_procedures = create_empty_table();
+    server->id_procedures = create_empty_table();
+
+
+    return server;
+}
+
+
+/**
+ * Creates a listening socket on the first IPv6 address given
+ *
+ * @param addr Address info list to bind to
+ * @param backlog Length of the connection queue
+ * @param reuseport Whether the port is shared with other listening sockets
+ * @return Listening socket on success, -1 on failure
+ */
+static int create_listener(struct addrinfo *addr, int backlog, int reuseport) {
+
+    int enable = 1, listenfd = -1;
+    struct addrinfo *p;
+
     // finding a valid IPv6 address
-    for (p = res; p != NULL; p = p->ai_next) {
+    for (p = addr; p != NULL; p = p->ai_next) {
         // only creates socket if address is IPv6
         if (p->ai_family == AF_INET6 &&
-                (listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) > 0) {
+                (listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) >= 0) {
             // success
             break;
         }
     }
 
+    if (listenfd < 0) {
+        return -1;
+    }
 
-    if (listenfd < 0
-        || setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0
+    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0
+        || (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) < 0)
         // binds an address and the port number to listen socket
-        || bind(listenfd, res->ai_addr, res->ai_addrlen) < 0
-        // the listen socket can now add available connections to a queue of 5
-        || listen(listenfd, 5) < 0) {
+        || bind(listenfd, p->ai_addr, p->ai_addrlen) < 0
+        // the listen socket can now add available connections to its queue
+        || listen(listenfd, backlog) < 0) {
 
-        error_print(SOCKET_CREATION);
-        return NULL;
+        close(listenfd);
+        return -1;
 
     }
 
-
-    // assign to server
-    server->listenfd = listenfd;
-
-    freeaddrinfo(res);
-
-    server->reg_procedures = create_empty_table();
-    server->found_procedures = create_empty_table();
-
-
-    return server;
+    return listenfd;
 }
 
 
@@ -202,11 +976,6 @@ rpc_client *rpc_init_client(char *addr, int port) {
     int connectfd, s;
     struct addrinfo hints, *servinfo, *p;
     char port_str[6];
-    struct rpc_client *client = malloc(sizeof(*client));
-    if (!client) {
-        error_print(MEMORY_ALL0CATION);
-        return NULL;
-    }
 
     memset(&hints, 0, sizeof hints);
     hints.ai_family = AF_INET6;
@@ -230,822 +999,5668 @@ rpc_client *rpc_init_client(char *addr, int port) {
         close(connectfd);
     }
 
+    freeaddrinfo(servinfo);
+
     if (p == NULL) {
         error_print(NETWORK_FAIL);
         return NULL;
     }
-    // assign to client
-    client->sockfd = connectfd;
-
-    freeaddrinfo(servinfo);
+    // requests are written whole, so Nagle would only hold back one sent while another is unacknowledged
+    int nodelay = 1;
+    setsockopt(connectfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    // waits on the socket are bounded by each call's deadline
+    if (fcntl(connectfd, F_SETFL, fcntl(connectfd, F_GETFL) | O_NONBLOCK) < 0) {
+        error_print(SOCKET_CREATION);
+        close(connectfd);
+        return NULL;
+    }
+    rpc_client *client = create_client(connectfd, NULL);
+    if (!client) {
+        close(connectfd);
+        return NULL;
+    }
+    if (negotiate_version(client, 0) == -1) {
+        rpc_close_client(client);
+        return NULL;
+    }
 
     return client;
 }
 
 
 /**
- * Registers a procedure to the server by name
+ * Connects a client to a server in the same process through a pair of in-memory channels instead of a
+ * socket. The server's end is handled by a thread of its own, as an accepted connection would be
  *
- * @param srv Server struct
- * @param name Name procedure
- * @param handler Actual procedure
- * @return Procedure ID on success
+ * @param srv Server to connect to
+ * @return Rpc client data
  */
-int rpc_register(rpc_server *srv, char *name, rpc_handler handler) {
+rpc_client *rpc_init_loopback(rpc_server *srv) {
 
-    if (srv == NULL || name == NULL || handler == NULL) {
+    if (srv == NULL) {
         error_print(INVALID_ARGUMENTS);
-        return -1;
-    } else if (!is_valid_name(name)) {
-        error_print(INVALID_NAME);
-        return -1;
+        return NULL;
     }
-    struct handler_item *item = malloc(sizeof(*item));
-    char *name_cpy = strdup(name);
-    if (!item | !name_cpy) {
+    struct loopback *loop = malloc(sizeof(*loop));
+    if (!loop) {
         error_print(MEMORY_ALL0CATION);
-        return -1;
+        return NULL;
+    }
+    loop->to_server = create_channel(LOOPBACK_CAPACITY);
+    loop->to_client = create_channel(LOOPBACK_CAPACITY);
+    atomic_init(&loop->refs, 2);
+    rpc_client *client = loop->to_server && loop->to_client ? create_client(-1, loop) : NULL;
+    if (!client) {
+        error_print(MEMORY_ALL0CATION);
+        free_channel(loop->to_server);
+        free_channel(loop->to_client);
+        free(loop);
+        return NULL;
     }
 
-    item->handler= handler;
-    item->id = generate_id();
-    // inserts procedure into hash table
-    if (insert_data(srv->reg_procedures, name_cpy, (void *) item, (hash_func) hash_djb2, (compare_func) strcmp,
-                    (free_func) free, NULL) == -1) {
-        free(item);
-        item = NULL;
-        free(name_cpy);
-        name_cpy = NULL;
-        return -1;
+    // in thread-per-core mode the connection counts against the first core's share of the limits
+    struct load *load = &srv->loads[0];
+    int admitted = admit_connection(load, -1);
+    if (!admitted) {
+        // the client reads this in place of the response to its first request, as over a socket
+        if (encode_flag(client->in, BUSY) == -1
+            || encode_id(client->in, PROTOCOL_FIXED, CONNECTION_ID) == -1) {
+            error_print(MEMORY_ALL0CATION);
+            release_loopback(loop);
+            rpc_close_client(client);
+            return NULL;
+        }
+    } else {
+        struct connection *conn = create_connection(srv, -1, NULL, load);
+        if (!conn) {
+            atomic_fetch_sub_explicit(&load->connections, 1, memory_order_relaxed);
+            release_loopback(loop);
+            rpc_close_client(client);
+            return NULL;
+        }
+        conn->loop = loop;
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, handle_connection, conn) != 0) {
+            error_print(THREAD);
+            close_connection(conn);
+            rpc_close_client(client);
+            return NULL;
+        }
+        pthread_detach(thread);
+    }
+    int s = negotiate_version(client, 0);
+    // a client turned away has nothing more to hear
+    if (!admitted) {
+        release_loopback(loop);
+    }
+    if (s == -1) {
+        rpc_close_client(client);
+        return NULL;
     }
-    return item->id;
 
+    return client;
 }
 
 
 /**
- * Accepts new connections from clients and completes requests
+ * Creates the state of a client that has just connected
  *
- * @param srv Server data
+ * @param sockfd Connected socket, -1 for a client in the same process as its server
+ * @param loop Channels to a server in the same process, NULL for a socket
+ * @return Newly created client, NULL on failure
  */
-void rpc_serve_all(rpc_server *srv) {
+static rpc_client *create_client(int sockfd, struct loopback *loop) {
 
-    if (srv == NULL) {
-        error_print(INVALID_ARGUMENTS);
-        exit(EXIT_FAILURE);
+    struct rpc_client *client = malloc(sizeof(*client));
+    if (!client) {
+        error_print(MEMORY_ALL0CATION);
+        return NULL;
+    }
+    client->sockfd = sockfd;
+    client->loop = loop;
+    client->status = RPC_OK;
+    client->next_id = CONNECTION_ID + 1;
+    client->version = PROTOCOL_FIXED;
+    client->checksums = 0;
+    client->rejected = 0;
+    client->stream = NULL;
+    client->send_credit = CONNECTION_WINDOW;
+    client->recv_consumed = 0;
+    client->in = create_buffer(BUFFER_SIZE);
+    client->out = create_buffer(BUFFER_SIZE);
+    if (!client->in || !client->out) {
+        error_print(MEMORY_ALL0CATION);
+        free_buffer(client->in);
+        free_buffer(client->out);
+        free(client);
+        return NULL;
     }
-    // make connection
-    struct sockaddr_in6 client_addr;
-    socklen_t client_addr_size = sizeof(client_addr);
 
-    while (1) {
-        // accept connection from client (takes from listen queue)
-        int connectfd = accept(srv->listenfd, (struct sockaddr *) &client_addr, &client_addr_size);
-        if (connectfd < 0) {
-            error_print(NETWORK_FAIL);
-        }
+    return client;
+}
 
-        srv->connectfd = connectfd;
-        // creates new thread for each connection
-        pthread_t thread;
-        if (pthread_create(&thread, NULL, handle_connection, srv) != 0) {
-            error_print(THREAD);
-            close(connectfd);
-        }
+
+/**
+ * Lets go of one end of an in-process connection, closing both directions so that the other end sees it
+ * as gone. The channels are freed once both ends have let go
+ *
+ * @param loop Channels of the connection
+ */
+static void release_loopback(struct loopback *loop) {
+
+    channel_close(loop->to_server);
+    channel_close(loop->to_client);
+    if (atomic_fetch_sub_explicit(&loop->refs, 1, memory_order_acq_rel) != 1) {
+        return;
     }
+    free_channel(loop->to_server);
+    free_channel(loop->to_client);
+    free(loop);
 }
 
 
 /**
- * Handles rpc_find and call requests from a specific client
+ * Asks the server to end every frame on the connection with a CRC32C checksum, or to stop. A frame that
+ * arrives corrupt is not acted on, its request failing with RPC_CORRUPT instead
  *
- * @param arg Server data containing the connection socket
- * @return NULL on exit thread
+ * @param cl Client data
+ * @param enabled Non-zero to turn checksums on, 0 to turn them off
+ * @return 1 if frames now carry checksums, 0 if they do not (including with a server too old to have
+ * them), -1 on failure
  */
-static void *handle_connection(void *arg) {
+int rpc_set_checksums(rpc_client *cl, int enabled) {
 
-    // Retrieve the connection file descriptor from the argument
-    rpc_server *srv = (rpc_server *) arg;
-    int connectfd = srv->connectfd;
+    if (cl == NULL || cl->stream) {
+        error_print(INVALID_ARGUMENTS);
+        return -1;
+    } else if (cl->rejected) {
+        cl->status = RPC_BUSY;
+        return -1;
+    }
 
-    char type;
-    size_t size;
-    char name[MAX_NAME_LEN + 1];
+    if (negotiate_version(cl, enabled ? FEATURE_CHECKSUMS : 0) == -1) {
+        cl->status = RPC_ERROR;
+        return -1;
+    }
+    cl->status = RPC_OK;
 
-    while(1) {
-        // type (either find or call)
-        type = 0;
-        if (recv_flag(connectfd, &type) == 0) {
-            close(connectfd);
-            pthread_exit(NULL);
-        };
+    return cl->checksums;
+}
 
-        switch(type) {
-            // rpc_find request
-            case FIND:
-                // reads function name size
-                if (recv_size(connectfd, &size) == 0
-                    // reads function name
-                    || recv_string(size, name, connectfd) == 0) {
-
-                    close(connectfd);
-                    pthread_exit(NULL);
-
-                }
-                // finds procedure given the name
-                struct handler_item *item = (struct handler_item *) get_data(srv->reg_procedures, name, (hash_func) hash_djb2,
-                        (compare_func) strcmp);
-
-                if (item) {
-                    if (send_flag(connectfd, FOUND) == -1
-                        // send id to client
-                        || send_int(connectfd, item->id) == -1) {
-
-                        close(connectfd);
-                        pthread_exit(NULL);
-
-                    }
-                    // insert procedure into found hash table
-                    if (insert_data(srv->found_procedures, &item->id, (void *) item->handler, (hash_func) hash_int,
-                                    (compare_func) int_cmp, NULL, NULL) == -1) {
-                        error_print(INSERTION);
-                    };
-
-                } else {
-                    error_print(HANDLER_NOT_FOUND);
-                    if (send_flag(connectfd, NOT_FOUND) == -1) {
-                        close(connectfd);
-                        pthread_exit(NULL);
-                    }
-                }
 
-                break;
+/**
+ * Agrees on a protocol version and features with the server, noting instead if it turned the connection
+ * away. Responses to calls given up on that arrive first are dropped
+ *
+ * @param cl Client data
+ * @param features Features to ask for
+ * @return 0 on success, -1 on failure
+ */
+static int negotiate_version(rpc_client *cl, size_t features) {
 
-            case CALL:
-                // rpc_call request
-                rpc_data *data = malloc(sizeof(*data));
-                if (!data) {
-                    error_print(MEMORY_ALL0CATION);
-                    continue;
-                }
-                rpc_data *result;
-
-                uint32_t id;
-                // receive id from client
-                if (recv_int(connectfd, (int *) &id) == 0
-                    // receive data from client
-                    || recv_data(connectfd, data) == 0) {
-
-                    close(connectfd);
-                    pthread_exit(NULL);
-
-                }
-                // get procedure using procedure id
-                rpc_handler handler = (rpc_handler) get_data(srv->found_procedures, &id, (hash_func) hash_int,
-                                                             (compare_func) int_cmp);
-
-                result = handler(data);
-                // checks for data consistency
-                if (result == NULL) {
-                    if (send_flag(connectfd, INCONSISTENT) == -1) {
-                        close(connectfd);
-                        pthread_exit(NULL);
-                    }
-                    error_print(INCONSISTENT_DATA);
-                    rpc_data_free(data);
-                    continue;
-
-                } else if ((result->data2 && !result->data2_len) || (!result->data2 && result->data2_len)) {
-                    if (send_flag(connectfd, INCONSISTENT) == -1) {
-                        close(connectfd);
-                        pthread_exit(NULL);
-                    }
-                    error_print(INCONSISTENT_DATA);
-                    rpc_data_free(data);
-                    rpc_data_free(result);
-                    continue;
-                }
-
-                rpc_data_free(data);
-
-                // notify client that data is consistent
-                if (send_flag(connectfd, CONSISTENT) == -1
-                    // send the consistent data
-                    || send_data(connectfd, result) == -1) {
-
-                    close(connectfd);
-                    pthread_exit(NULL);
-
-                }
-
-                rpc_data_free(result);
+    struct response res;
 
-                break;
-        }
+    if (encode_flag(cl->out, HELLO) == -1
+        || encode_size(cl->out, PROTOCOL_FIXED, PROTOCOL_VERSION | features) == -1
+        || client_flush(cl, 0) == -1
+        || client_receive(cl, CONNECTION_ID, &res, 0) == -1) {
 
+        return -1;
 
     }
+    if (res.status == BUSY) {
+        // reported by every request, since the server has closed the connection
+        cl->rejected = 1;
+        return 0;
+    } else if (res.status != HELLO) {
+        error_print(INCONSISTENT_DATA);
+        return -1;
+    }
+    size_t version = res.version & VERSION_MASK;
+    cl->version = version < PROTOCOL_VERSION ? (int) version : PROTOCOL_VERSION;
+    cl->checksums = (res.version & features & FEATURE_CHECKSUMS) != 0;
 
+    return 0;
 }
 
 
 /**
- * Finds a procedure on the server given a name
+ * Registers a procedure to the server by name
  *
- * @param cl Client data
- * @param name Query name
- * @return A handle containing the unique procedure ID upon success, NULL on failure
+ * @param srv Server struct
+ * @param name Name procedure
+ * @param handler Actual procedure
+ * @return Procedure ID on success
  */
-rpc_handle *rpc_find(rpc_client *cl, char *name) {
+int rpc_register(rpc_server *srv, char *name, rpc_handler handler) {
 
-    if (cl == NULL || name == NULL) {
+    if (handler == NULL) {
         error_print(INVALID_ARGUMENTS);
-        return NULL;
-    } else if (!is_valid_name(name)) {
-        error_print(INVALID_NAME);
-        return NULL;
+        return -1;
     }
 
-    char found;
-    rpc_handle *handle = NULL;
+    struct handler_item handlers = {.handler = handler};
+    return register_procedure(srv, name, &handlers);
+}
 
-    // send type of request (find)
-    if (send_flag(cl->sockfd, FIND) == -1
-        // send function name size to server
-        || send_size(strlen(name), cl->sockfd) == -1
-        // send function name to server
-        || send_string(name, cl->sockfd) == -1
-        // receive whether procedure was found
-        || recv_flag(cl->sockfd, &found) <= 0) {
 
-        return NULL;
+/**
+ * Registers a procedure whose handler may finish its calls later, so that waiting on disk or another
+ * service does not hold up other requests on the connection
+ *
+ * @param srv Server struct
+ * @param name Name procedure
+ * @param handler Procedure, which must eventually call rpc_complete with the token it is given
+ * @return Procedure ID on success
+ */
+int rpc_register_async(rpc_server *srv, char *name, rpc_async_handler handler) {
 
+    if (handler == NULL) {
+        error_print(INVALID_ARGUMENTS);
+        return -1;
     }
 
-    // if data is found
-    if (found == FOUND) {
-        handle = malloc(sizeof(*handle));
-        if (!handle) {
-            error_print(MEMORY_ALL0CATION);
-            return NULL;
-        }
-        if (recv_int(cl->sockfd, (int *) &handle->id) <= 0) {
-            free(handle);
-            handle = NULL;
-            return NULL;
-        }
+    struct handler_item handlers = {.async_handler = handler};
+    return register_procedure(srv, name, &handlers);
+}
+
+
+/**
+ * Registers a procedure whose handler sends any number of messages through a sink rather than returning
+ * a single output. It is never run on the thread reading the connection, as sending waits for the client
+ * to take earlier messages
+ *
+ * @param srv Server struct
+ * @param name Name procedure
+ * @param handler Procedure, returning 0 once it has sent every message or -1 on failure
+ * @return Procedure ID on success
+ */
+int rpc_register_stream(rpc_server *srv, char *name, rpc_stream_handler handler) {
+
+    if (handler == NULL) {
+        error_print(INVALID_ARGUMENTS);
+        return -1;
     }
 
-    return handle;
+    struct handler_item handlers = {.stream_handler = handler};
+    return register_procedure(srv, name, &handlers);
 }
 
 
 /**
- * Calls a given procedure from the server given an ID
+ * Registers a procedure taking a stream of records from the client, which its handler consumes as they
+ * arrive before returning a single output. Like a streaming procedure it is never run on the thread
+ * reading the connection
  *
- * @param cl Client data
- * @param h Handle containing ID
- * @param payload Data to be send to server
- * @return Output data from the procedure on success, NULL on failure
+ * @param srv Server struct
+ * @param name Name procedure
+ * @param handler Procedure, taking records with rpc_source_next
+ * @return Procedure ID on success
  */
-rpc_data *rpc_call(rpc_client *cl, rpc_handle *h, rpc_data *payload) {
+int rpc_register_upload(rpc_server *srv, char *name, rpc_upload_handler handler) {
 
-    if (cl == NULL || h == NULL || payload == NULL) {
+    if (handler == NULL) {
         error_print(INVALID_ARGUMENTS);
-        return NULL;
+        return -1;
     }
 
-    // checks for consistent data
-    if ((payload->data2 && !payload->data2_len) || (!payload->data2 && payload->data2_len)) {
-        error_print(INCONSISTENT_DATA);
-        return NULL;
+    struct handler_item handlers = {.upload_handler = handler};
+    return register_procedure(srv, name, &handlers);
+}
+
+
+/**
+ * Registers a procedure whose calls are run in batches, so that its handler can work through many inputs
+ * in one go (with SIMD kernels, say). Calls queued or pipelined together are collected until a batch is
+ * full or the first has waited long enough, see rpc_set_batch_limits
+ *
+ * @param srv Server struct
+ * @param name Name procedure
+ * @param handler Procedure, given every call of a batch together
+ * @return Procedure ID on success
+ */
+int rpc_register_batch(rpc_server *srv, char *name, rpc_batch_handler handler) {
+
+    if (handler == NULL) {
+        error_print(INVALID_ARGUMENTS);
+        return -1;
     }
-    rpc_data *result = malloc(sizeof(*result));
-    if (!result) {
+
+    struct handler_item handlers = {.batch_handler = handler};
+    return register_procedure(srv, name, &handlers);
+}
+
+
+/**
+ * Sets how calls of a batch procedure are collected. With no wait a batch is run once the calls that
+ * arrived together have been read, otherwise its first call waits for others up to the limit. Must be
+ * called before rpc_serve_all
+ *
+ * @param srv Server struct
+ * @param name Name of the procedure
+ * @param max_calls Most calls run in one batch, 64 by default
+ * @param max_wait_us Longest a call waits for others to join its batch in microseconds, 0 (the default)
+ * to only take calls that have already arrived
+ * @return 0 on success, -1 on failure
+ */
+int rpc_set_batch_limits(rpc_server *srv, char *name, int max_calls, int max_wait_us) {
+
+    if (srv == NULL || name == NULL || max_calls < 1 || max_wait_us < 0) {
+        error_print(INVALID_ARGUMENTS);
+        return -1;
+    }
+    struct handler_item *item = (struct handler_item *) get_data(srv->reg_procedures, name,
+                                                                 (hash_func) hash_djb2, (compare_func) strcmp);
+    if (!item) {
+        error_print(HANDLER_NOT_FOUND);
+        return -1;
+    } else if (!item->batch) {
+        error_print(INVALID_ARGUMENTS);
+        return -1;
+    }
+    rpc_token **tokens = realloc(item->batch->tokens, max_calls * sizeof(*tokens));
+    if (!tokens) {
         error_print(MEMORY_ALL0CATION);
-        return NULL;
+        return -1;
     }
-    char status;
+    item->batch->tokens = tokens;
+    item->batch->max_calls = max_calls;
+    item->batch->max_wait = max_wait_us * 1000ULL;
 
+    return 0;
+}
 
-    // send type of request
-    if (send_flag(cl->sockfd, CALL) == -1
-        // send the procedure id
-        || send_int(cl->sockfd, h->id) == -1
-        // send the payload
-        || send_data(cl->sockfd, payload) == -1
-        // send the consistency of the return data
-        || recv_flag(cl->sockfd, &status) <= 0
-        || status == INCONSISTENT
-        // receive the return data if consistent
-        || recv_data(cl->sockfd, result) <= 0) {
 
-        return NULL;
+/**
+ * Sets the scheduling class of a registered procedure, taking effect for calls handed to workers. Must
+ * be called before rpc_serve_all
+ *
+ * @param srv Server struct
+ * @param name Name of the procedure
+ * @param priority Class of the procedure, RPC_PRIORITY_NORMAL by default
+ * @return 0 on success, -1 on failure
+ */
+int rpc_set_priority(rpc_server *srv, char *name, rpc_priority priority) {
 
+    if (srv == NULL || name == NULL || priority < 0 || priority >= RPC_NUM_PRIORITIES) {
+        error_print(INVALID_ARGUMENTS);
+        return -1;
     }
+    struct handler_item *item = (struct handler_item *) get_data(srv->reg_procedures, name,
+                                                                 (hash_func) hash_djb2, (compare_func) strcmp);
+    if (!item) {
+        error_print(HANDLER_NOT_FOUND);
+        return -1;
+    }
+    item->priority = priority;
 
-    return result;
+    return 0;
 }
 
 
 /**
- * Sends data to a host
+ * Coalesces concurrent identical calls of a registered procedure. A call arriving while another with the
+ * same input is being run waits for it and is answered with a copy of its output, so only suits
+ * procedures without side effects. Must be called before rpc_serve_all
  *
- * @param sockfd Socket to be sent over
- * @param data Data to be sent
- * @return 0 on success
+ * @param srv Server struct
+ * @param name Name of the procedure
+ * @param enabled 1 to coalesce calls, 0 to run every call (the default)
+ * @return 0 on success, -1 on failure
  */
-static int send_data(int sockfd, rpc_data *data) {
-
-    // send data_1 int
-    if (send_int(sockfd, data->data1) == -1
-        // send data_2_length
-        || send_size(data->data2_len, sockfd) == -1) {
+int rpc_set_single_flight(rpc_server *srv, char *name, int enabled) {
 
+    if (srv == NULL || name == NULL) {
+        error_print(INVALID_ARGUMENTS);
+        return -1;
+    }
+    struct handler_item *item = (struct handler_item *) get_data(srv->reg_procedures, name,
+                                                                 (hash_func) hash_djb2, (compare_func) strcmp);
+    if (!item) {
+        error_print(HANDLER_NOT_FOUND);
+        return -1;
+    } else if (item->stream_handler || item->upload_handler) {
+        // a stream cannot be shared
+        error_print(INVALID_ARGUMENTS);
         return -1;
-
     }
+    item->single_flight = enabled ? 1 : 0;
 
+    return 0;
+}
 
-    // send data_2
-    if (data->data2_len > 0) {
-        if (send_void(sockfd, data->data2_len, data->data2) == -1) {
-            return -1;
-        }
-    }
 
+/**
+ * Registers any kind of handler to the server by name
+ *
+ * @param srv Server struct
+ * @param name Name procedure
+ * @param handlers Item with only the handler of the procedure's kind set
+ * @return Procedure ID on success
+ */
+static int register_procedure(rpc_server *srv, char *name, struct handler_item *handlers) {
+
+    if (srv == NULL || name == NULL) {
+        error_print(INVALID_ARGUMENTS);
+        return -1;
+    } else if (!is_valid_name(name) || strlen(name) > MAX_NAME_LEN) {
+        error_print(INVALID_NAME);
+        return -1;
+    }
+    struct handler_item *item = malloc(sizeof(*item));
+    char *name_cpy = strdup(name);
+    if (!item | !name_cpy) {
+        error_print(MEMORY_ALL0CATION);
+        free(item);
+        free(name_cpy);
+        return -1;
+    }
 
-    return 0;
+    item->name = name_cpy;
+    item->handler = handlers->handler;
+    item->async_handler = handlers->async_handler;
+    item->stream_handler = handlers->stream_handler;
+    item->upload_handler = handlers->upload_handler;
+    item->batch_handler = handlers->batch_handler;
+    item->id = generate_id();
+    item->priority = RPC_PRIORITY_NORMAL;
+    item->single_flight = 0;
+    atomic_init(&item->cost, 0);
+    item->batch = NULL;
+    item->limit_index = -1;
+    memset(item->limits, 0, sizeof(item->limits));
+    if (item->batch_handler && !(item->batch = create_batch(srv, item, DEFAULT_MAX_BATCH,
+                                                            DEFAULT_BATCH_WAIT_US * 1000ULL))) {
+        error_print(MEMORY_ALL0CATION);
+        free(item);
+        free(name_cpy);
+        return -1;
+    }
+    // inserts procedure into hash table
+    if (insert_data(srv->reg_procedures, name_cpy, (void *) item, (hash_func) hash_djb2, (compare_func) strcmp,
+                    (free_func) free, NULL) == -1) {
+        free(item);
+        item = NULL;
+        free(name_cpy);
+        name_cpy = NULL;
+        return -1;
+    }
+    // procedures are indexed by id up front so that finding one never writes to shared state
+    if (insert_data(srv->id_procedures, &item->id, (void *) item, (hash_func) hash_int, (compare_func) int_cmp,
+                    NULL, NULL) == -1) {
+        error_print(INSERTION);
+        return -1;
+    }
+    if (item->batch) {
+        item->batch->next = srv->batches;
+        srv->batches = item->batch;
+    }
+    return item->id;
 
 }
 
 
 /**
- * Sends the void data to a host
+ * Accepts new connections from clients and completes requests. Each listener gets its own accept loop,
+ * the first of which runs on the calling thread. In thread-per-core mode each loop is instead a pinned
+ * event loop that owns every connection it accepts
  *
- * @param sockfd Socket to be sent over
- * @param size Size of data to be sent
- * @param data Data to be sent
- * @return Number of byte read on success
+ * @param srv Server data
  */
-static int send_void(int sockfd, size_t size, void *data) {
+void rpc_serve_all(rpc_server *srv) {
 
-    ssize_t n = send(sockfd, data, size, 0);
-    if (n < 0) {
-        error_print(NETWORK_FAIL);
-        return -1;
+    if (srv == NULL) {
+        error_print(INVALID_ARGUMENTS);
+        exit(EXIT_FAILURE);
     }
+    void *(*loop)(void *) = srv->thread_per_core ? run_core : accept_loop;
 
-    return n;
+    // handlers run apart from the threads doing I/O, so one busy connection cannot hold up a core
+    if (srv->num_workers > 0
+        && !(srv->pool = create_pool(srv->num_workers, RPC_NUM_PRIORITIES,
+                                     srv->strict_priority ? NULL : srv->priority_weights))) {
+        error_print(THREAD);
+        exit(EXIT_FAILURE);
+    }
+
+    // the remaining listeners are served by their own threads
+    for (int i = 1; i < srv->num_listeners; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, loop, &srv->listeners[i]) != 0) {
+            error_print(THREAD);
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(thread);
+    }
 
+    loop(&srv->listeners[0]);
 }
 
 
 /**
- * Sends a string over the network
+ * Accepts connections from a single listening socket, passing each to a new thread
  *
- * @param message String to be sent
- * @param sockfd Socket to be sent over
- * @return Number of bytes read on success
+ * @param arg Listener to accept from
+ * @return NULL on exit thread
  */
-static int send_string(char *message, int sockfd) {
+static void *accept_loop(void *arg) {
 
-    // Send message
-    int n = send(sockfd, message, strlen(message), 0);
-    if (n < 0) {
-        error_print(NETWORK_FAIL);
-        return -1;
+    struct listener *listener = (struct listener *) arg;
+    rpc_server *srv = listener->srv;
+
+    if (srv->pin_threads && pin_thread(listener->index) != 0) {
+        error_print(THREAD);
     }
 
-    return n;
+    // make connection
+    struct sockaddr_in6 client_addr;
+    socklen_t client_addr_size;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    while (1) {
+        // accept connection from client (takes from listen queue)
+        client_addr_size = sizeof(client_addr);
+        int connectfd = accept(listener->listenfd, (struct sockaddr *) &client_addr, &client_addr_size);
+        if (connectfd < 0) {
+            // the connection stays queued when there is nothing to accept it with, so trying again at once
+            // would only spin
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                error_print(NETWORK_FAIL);
+                struct timespec pause = {.tv_sec = 0, .tv_nsec = ACCEPT_BACKOFF_NS};
+                nanosleep(&pause, NULL);
+            } else if (errno != ECONNABORTED && errno != EINTR) {
+                error_print(NETWORK_FAIL);
+            }
+            continue;
+        }
+
+        if (!admit_connection(listener->load, connectfd)) {
+            continue;
+        }
+        struct connection *conn = create_connection(srv, connectfd, NULL, listener->load);
+        if (!conn) {
+            atomic_fetch_sub_explicit(&listener->load->connections, 1, memory_order_relaxed);
+            close(connectfd);
+            continue;
+        }
+
+        // creates new thread for each connection
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, handle_connection, conn) != 0) {
+            error_print(THREAD);
+            close_connection(conn);
+        }
+    }
+
+    return NULL;
 }
 
 
 /**
- * Sends size_t data to a host
+ * Handles rpc_find and call requests from a specific client
  *
- * @param size Data to be sent
- * @param sockfd Socket to be sent over
- * @return Number of bytes sent on success
+ * @param arg Connection to be handled
+ * @return NULL on exit thread
  */
-static int send_size(size_t size, int sockfd) {
+static void *handle_connection(void *arg) {
 
-    // use 4 bytes since 100000 fits
-    if (size > UINT32_MAX) {
-        error_print(OVERLENGTH);
-        return -1;
+    struct connection *conn = (struct connection *) arg;
+    struct load *load = conn->load;
+    int timeout_ms = conn->srv->idle_timeout_ms;
+
+    // wake up every so often to check whether the connection has gone idle
+    if (timeout_ms && !conn->loop) {
+        struct timeval tv = {.tv_sec = timeout_ms / 1000, .tv_usec = timeout_ms % 1000 * 1000};
+        setsockopt(conn->connectfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
     }
-    uint32_t size_n = htonl((uint32_t) size);
 
-    ssize_t n = send(sockfd, &size_n, sizeof(size_n), 0);
-    if (n < 0) {
-        error_print(NETWORK_FAIL);
-        return -1;
+    while(1) {
+        // wait for more requests
+        ssize_t n = conn->loop ? channel_read(conn->loop->to_server, conn->in,
+                                              timeout_ms ? now_ns() + timeout_ms * 1000000ULL : 0)
+                               : buffer_read_fd(conn->in, conn->connectfd);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (is_idle(conn, now_ns())) {
+                atomic_fetch_add_explicit(&load->idle_closed, 1, memory_order_relaxed);
+                break;
+            }
+            continue;
+        } else if (n < 0) {
+            error_print(NETWORK_FAIL);
+            break;
+        } else if (n == 0) {
+            break;
+        }
+        conn->arrival = now_ns();
+
+        if (process_input(conn) == -1) {
+            break;
+        }
+        // a client trickling in a request never completes one
+        if (is_idle(conn, conn->arrival)) {
+            atomic_fetch_add_explicit(&load->idle_closed, 1, memory_order_relaxed);
+            break;
+        }
     }
 
-    return n;
+    close_connection(conn);
+    return NULL;
 }
 
 
 /**
+ * Runs the event loop of a single core, which accepts from its own listener and serves every connection
+ * it accepts without sharing any state with other cores
  *
- * @param sockfd
- * @param data
- * @return Number of bytes sent on success
+ * @param arg Listener owned by this core
+ * @return NULL on exit thread
  */
-static int send_int(int sockfd, int data) {
+static void *run_core(void *arg) {
+
+    struct listener *listener = (struct listener *) arg;
+    rpc_server *srv = listener->srv;
+
+    if (pin_thread(listener->index) != 0) {
+        error_print(THREAD);
+    }
+    // keep this thread's allocations on its own NUMA node
+    if (srv->numa_local && syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0) != 0) {
+        error_print(THREAD);
+    }
+
+    // allocated after pinning so first-touch places the core's state locally
+    struct core *core = create_core(listener);
+    if (!core) {
+        exit(EXIT_FAILURE);
+    }
+
+    // idle connections are looked for twice per timeout, so none outlives it by more than half
+    int sweep_ms = srv->idle_timeout_ms ? (srv->idle_timeout_ms + 1) / 2 : -1;
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int n = epoll_wait(core->epollfd, events, MAX_EVENTS, sweep_ms);
+        if (n < 0) {
+            if (errno != EINTR) {
+                error_print(NETWORK_FAIL);
+            }
+            continue;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == listener) {
+                accept_connections(core);
+                continue;
+            }
+
+            struct connection *conn = (struct connection *) events[i].data.ptr;
+            int s = 0;
+            if (events[i].events & EPOLLOUT) {
+                pthread_mutex_lock(&conn->lock);
+                s = flush_connection(conn);
+                pthread_mutex_unlock(&conn->lock);
+            }
+            if (s == 0 && events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                s = service_connection(conn);
+            }
+            if (s == -1) {
+                close_connection(conn);
+            }
+        }
+
+        // every request from this pass has been answered
+        arena_reset(core->arena);
+
+        if (sweep_ms > 0) {
+            uint64_t now = now_ns();
+            if (now - core->swept >= sweep_ms * 1000000ULL) {
+                sweep_connections(core, now);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Creates the state owned by a core, including its snapshot of the registered procedures
+ *
+ * @param listener Listener owned by the core
+ * @return Core state on success, NULL on failure
+ */
+static struct core *create_core(struct listener *listener) {
+
+    struct core *core = malloc(sizeof(*core));
+    if (!core) {
+        error_print(MEMORY_ALL0CATION);
+        return NULL;
+    }
+    core->srv = listener->srv;
+    core->listener = listener;
+    core->reg_procedures = create_empty_table();
+    core->id_procedures = create_empty_table();
+    core->arena = create_arena(ARENA_BLOCK_SIZE);
+    core->epollfd = epoll_create1(0);
+    core->connections = NULL;
+    core->swept = now_ns();
+    core->batches = NULL;
+    if (!core->arena || core->epollfd < 0) {
+        error_print(MEMORY_ALL0CATION);
+        return NULL;
+    }
+
+    iterate_table(listener->srv->reg_procedures, copy_procedure, core);
+
+    // the listener is told apart from connections by its pointer
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = listener};
+    if (fcntl(listener->listenfd, F_SETFL, fcntl(listener->listenfd, F_GETFL) | O_NONBLOCK) < 0
+        || epoll_ctl(core->epollfd, EPOLL_CTL_ADD, listener->listenfd, &ev) < 0) {
+        error_print(SOCKET_CREATION);
+        return NULL;
+    }
+
+    return core;
+}
+
+
+/**
+ * Copies a registered procedure into a core's own tables
+ *
+ * @param key Name of the procedure
+ * @param data Handler item of the procedure
+ * @param arg Core to copy into
+ */
+static void copy_procedure(void *key, void *data, void *arg) {
+
+    struct core *core = (struct core *) arg;
+    struct handler_item *item = malloc(sizeof(*item));
+    char *name_cpy = strdup((char *) key);
+    if (!item || !name_cpy) {
+        error_print(MEMORY_ALL0CATION);
+        exit(EXIT_FAILURE);
+    }
+    *item = *(struct handler_item *) data;
+    item->name = name_cpy;
+    // calls are batched with those of the same core only
+    if (item->batch) {
+        if (!(item->batch = create_batch(core->srv, item, item->batch->max_calls,
+                                         item->batch->max_wait))) {
+            error_print(MEMORY_ALL0CATION);
+            exit(EXIT_FAILURE);
+        }
+        item->batch->next = core->batches;
+        core->batches = item->batch;
+    }
+
+    if (insert_data(core->reg_procedures, name_cpy, item, (hash_func) hash_djb2, (compare_func) strcmp,
+                    (free_func) free, NULL) == -1
+        || insert_data(core->id_procedures, &item->id, item, (hash_func) hash_int, (compare_func) int_cmp,
+                       NULL, NULL) == -1) {
+        error_print(INSERTION);
+    }
+}
+
+
+/**
+ * Accepts every pending connection on a core's listener and adds them to its event loop
+ *
+ * @param core Core accepting connections
+ */
+static void accept_connections(struct core *core) {
+
+    while (1) {
+        int connectfd = accept4(core->listener->listenfd, NULL, NULL, SOCK_NONBLOCK);
+        if (connectfd < 0 && errno == ECONNABORTED) {
+            // the client gave up while queued, which says nothing about the rest
+            continue;
+        } else if (connectfd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                error_print(NETWORK_FAIL);
+            }
+            return;
+        }
+
+        if (!admit_connection(core->listener->load, connectfd)) {
+            continue;
+        }
+        struct connection *conn = create_connection(core->srv, connectfd, core, core->listener->load);
+        if (!conn) {
+            atomic_fetch_sub_explicit(&core->listener->load->connections, 1, memory_order_relaxed);
+            close(connectfd);
+            continue;
+        }
+
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = conn};
+        if (epoll_ctl(core->epollfd, EPOLL_CTL_ADD, connectfd, &ev) < 0) {
+            error_print(NETWORK_FAIL);
+            close_connection(conn);
+            continue;
+        }
+        conn->events = EPOLLIN;
+
+        conn->next = core->connections;
+        if (core->connections) {
+            core->connections->prev = conn;
+        }
+        core->connections = conn;
+    }
+}
+
+
+/**
+ * Closes every connection of a core that has gone idle
+ *
+ * @param core Core owning the connections
+ * @param now Current time
+ */
+static void sweep_connections(struct core *core, uint64_t now) {
+
+    struct connection *conn = core->connections;
+    while (conn) {
+        struct connection *next = conn->next;
+        if (is_idle(conn, now)) {
+            atomic_fetch_add_explicit(&conn->load->idle_closed, 1, memory_order_relaxed);
+            close_connection(conn);
+        }
+        conn = next;
+    }
+    core->swept = now;
+}
+
+
+/**
+ * Reads and handles everything a connection of a core has sent so far
+ *
+ * @param conn Connection with input pending
+ * @return 0 on success, -1 if the connection should be closed
+ */
+static int service_connection(struct connection *conn) {
+
+    while (1) {
+        ssize_t n = buffer_read_fd(conn->in, conn->connectfd);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            error_print(NETWORK_FAIL);
+            return -1;
+        } else if (n == 0) {
+            return -1;
+        }
+        conn->arrival = now_ns();
+
+        if (process_input(conn) == -1) {
+            return -1;
+        }
+        // stop reading until the client takes the responses it already has
+        pthread_mutex_lock(&conn->lock);
+        int blocked = conn->events & EPOLLOUT;
+        pthread_mutex_unlock(&conn->lock);
+        if (blocked) {
+            return 0;
+        }
+    }
+}
+
+
+/**
+ * Creates the state of a newly accepted connection
+ *
+ * @param srv Server data
+ * @param connectfd Connected socket
+ * @param core Owning core, NULL if the connection gets its own thread
+ * @param load Load the connection has been admitted to
+ * @return Connection on success, NULL on failure
+ */
+static struct connection *create_connection(rpc_server *srv, int connectfd, struct core *core, struct load *load) {
+
+    struct connection *conn = malloc(sizeof(*conn));
+    if (!conn) {
+        error_print(MEMORY_ALL0CATION);
+        return NULL;
+    }
+    conn->srv = srv;
+    conn->connectfd = connectfd;
+    conn->core = core;
+    conn->load = load;
+    conn->events = 0;
+    conn->arrival = now_ns();
+    conn->closed = 0;
+    conn->version = PROTOCOL_FIXED;
+    conn->checksums = 0;
+    conn->frame = 0;
+    atomic_init(&conn->refs, 1);
+    atomic_init(&conn->active, conn->arrival);
+    conn->reserved = 0;
+    conn->discard = 0;
+    conn->prev = NULL;
+    conn->next = NULL;
+    conn->streams = NULL;
+    conn->uploads = NULL;
+    conn->send_credit = CONNECTION_WINDOW;
+    conn->recv_credit = CONNECTION_WINDOW;
+    conn->recv_consumed = 0;
+    conn->batching = 0;
+    conn->held = 0;
+    conn->corked = 0;
+    conn->queued_batch = 0;
+    conn->receiving = 0;
+    conn->queued = 0;
+    conn->waiting = NULL;
+    conn->waiting_last = NULL;
+    conn->capture_id = srv->capture ? atomic_fetch_add_explicit(&srv->captured_connections, 1,
+                                                                memory_order_relaxed) : 0;
+    conn->loop = NULL;
+    pthread_mutex_init(&conn->lock, NULL);
+    conn->in = create_buffer(BUFFER_SIZE);
+    conn->out = create_buffer(BUFFER_SIZE);
+    // buckets start out full, which calloc leaves them as
+    conn->buckets = srv->num_limits ? calloc(srv->num_limits, sizeof(*conn->buckets)) : NULL;
+    conn->peer = srv->limit_peers ? find_peer(srv, connectfd) : NULL;
+    if (!conn->in || !conn->out || (srv->num_limits && !conn->buckets) || (srv->limit_peers && !conn->peer)) {
+        error_print(MEMORY_ALL0CATION);
+        free_buffer(conn->in);
+        free_buffer(conn->out);
+        free(conn->buckets);
+        release_peer(srv, conn->peer);
+        free(conn);
+        return NULL;
+    }
+    // responses are coalesced before they are written, so Nagle would only delay them
+    int nodelay = 1;
+    if (connectfd >= 0) {
+        setsockopt(connectfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    }
+
+    return conn;
+}
+
+
+/**
+ * Stops serving a connection. Its socket and data are freed once no call on it remains to be completed
+ *
+ * @param conn Connection to be closed
+ */
+static void close_connection(struct connection *conn) {
+
+    pthread_mutex_lock(&conn->lock);
+    conn->closed = 1;
+    if (conn->core) {
+        epoll_ctl(conn->core->epollfd, EPOLL_CTL_DEL, conn->connectfd, NULL);
+    }
+    // streams waiting for credit or records give up
+    for (struct rpc_sink *sink = conn->streams; sink; sink = sink->next) {
+        pthread_cond_broadcast(&sink->ready);
+    }
+    for (struct rpc_source *source = conn->uploads; source; source = source->next) {
+        pthread_cond_broadcast(&source->ready);
+    }
+    pthread_mutex_unlock(&conn->lock);
+
+    // only the owning core touches its list
+    if (conn->core) {
+        if (conn->prev) {
+            conn->prev->next = conn->next;
+        } else if (conn->core->connections == conn) {
+            conn->core->connections = conn->next;
+        }
+        if (conn->next) {
+            conn->next->prev = conn->prev;
+        }
+    }
+    // the payload being received when the connection closed is never going to be handled
+    release_payload(conn, conn->reserved);
+    conn->reserved = 0;
+
+    release_connection(conn);
+}
+
+
+/**
+ * Drops a reference to a connection, freeing it along with its socket when it was the last. The socket
+ * stays open until then so that its descriptor cannot be reused under a call still completing
+ *
+ * @param conn Connection to be released
+ */
+static void release_connection(struct connection *conn) {
+
+    if (atomic_fetch_sub_explicit(&conn->refs, 1, memory_order_acq_rel) != 1) {
+        return;
+    }
+
+    if (conn->loop) {
+        release_loopback(conn->loop);
+    } else {
+        close(conn->connectfd);
+    }
+    atomic_fetch_sub_explicit(&conn->load->connections, 1, memory_order_relaxed);
+    pthread_mutex_destroy(&conn->lock);
+    free_buffer(conn->in);
+    free_buffer(conn->out);
+    free(conn->buckets);
+    release_peer(conn->srv, conn->peer);
+    free(conn);
+}
+
+
+/**
+ * Checks whether a connection has gone longer than the server's idle timeout without a request being
+ * handled, while none of its calls are outstanding
+ *
+ * @param conn Connection to be checked
+ * @param now Current time
+ * @return 1 if the connection should be closed, 0 otherwise
+ */
+static int is_idle(struct connection *conn, uint64_t now) {
+
+    int timeout_ms = conn->srv->idle_timeout_ms;
+    if (!timeout_ms || atomic_load_explicit(&conn->refs, memory_order_relaxed) > 1) {
+        return 0;
+    }
+    uint64_t active = atomic_load_explicit(&conn->active, memory_order_relaxed);
+
+    return now > active && now - active > timeout_ms * 1000000ULL;
+}
+
+
+/**
+ * Handles every complete request in a connection's input, leaving any partial request for later. The
+ * responses to the requests are held back and written together once the input runs out, or sooner if
+ * holding them any longer would delay the oldest past COALESCE_NS
+ *
+ * @param conn Connection with new input
+ * @return 0 on success, -1 if the connection should be closed
+ */
+static int process_input(struct connection *conn) {
+
+    buffer_t *in = conn->in;
+    char type;
+    int s = 1;
+
+    pthread_mutex_lock(&conn->lock);
+    conn->batching = 1;
+    pthread_mutex_unlock(&conn->lock);
+    conn->held = conn->arrival;
+
+    while (buffer_length(in) > 0) {
+        // drop what has arrived of a payload that was refused
+        if (conn->discard > 0) {
+            size_t n = buffer_length(in) < conn->discard ? buffer_length(in) : conn->discard;
+            buffer_consume(in, n);
+            conn->discard -= n;
+            continue;
+        }
+
+        // responses held back through a long pass go out before they have waited too long
+        release_held(conn, 0);
+
+        size_t start = in->start;
+        conn->frame = start;
+        // type (either find or call)
+        decode_flag(in, &type);
+
+        switch(type) {
+            // protocol negotiation
+            case HELLO:
+                s = handle_hello(conn);
+                break;
+            // rpc_find request
+            case FIND:
+                s = handle_find(conn);
+                break;
+            // rpc_call request
+            case CALL:
+                s = handle_call(conn);
+                break;
+            // a client taking a stream's messages, finishing an upload, or giving up on either
+            case CREDIT:
+            case END:
+            case CANCEL:
+                s = handle_stream_control(conn, type);
+                break;
+            // a record of an upload
+            case RECORD:
+                s = handle_record(conn);
+                break;
+            default:
+                // unknown requests are skipped, and do not count as activity
+                continue;
+        }
+
+        if (s == 0) {
+            // wait for the rest of the request
+            in->start = start;
+            break;
+        } else if (s == -1) {
+            break;
+        }
+        atomic_store_explicit(&conn->active, conn->arrival, memory_order_relaxed);
+    }
+    // batches of the calls that arrived together run before the responses held back are written, so that
+    // theirs go out with them
+    run_due_batches(conn);
+
+    // the input has run out, so everything held back goes out in one write, including a last response
+    // to a client about to be disconnected
+    pthread_mutex_lock(&conn->lock);
+    conn->batching = 0;
+    if (flush_connection(conn) == -1) {
+        s = -1;
+    }
+    cork_connection(conn, 0);
+    pthread_mutex_unlock(&conn->lock);
+    if (s == -1) {
+        return -1;
+    }
+
+    // give back the memory of a large payload once it has been handled
+    if (buffer_shrink(in, BUFFER_SIZE, MAX_IDLE_BUFFER) == -1) {
+        error_print(MEMORY_ALL0CATION);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Handles a HELLO proposing a protocol version, agreeing on the lower of the client's and the server's.
+ * The HELLO and its response always use fixed-width fields
+ *
+ * @param conn Connection the request arrived on
+ * @return 1 once handled, 0 if the request is incomplete, -1 on failure
+ */
+static int handle_hello(struct connection *conn) {
+
+    size_t proposal, version;
+    int s;
+
+    if ((s = decode_size(conn->in, PROTOCOL_FIXED, &proposal)) <= 0) {
+        return s;
+    }
+    // checksums are agreed to whenever they are asked for
+    size_t features = proposal & FEATURE_CHECKSUMS;
+    version = proposal & VERSION_MASK;
+    if (version > PROTOCOL_VERSION) {
+        version = PROTOCOL_VERSION;
+    } else if (version < PROTOCOL_FIXED) {
+        version = PROTOCOL_FIXED;
+    }
+
+    pthread_mutex_lock(&conn->lock);
+    if (encode_flag(conn->out, HELLO) == -1
+        || encode_id(conn->out, PROTOCOL_FIXED, CONNECTION_ID) == -1
+        || encode_size(conn->out, PROTOCOL_FIXED, version | features) == -1
+        || flush_connection(conn) == -1) {
+
+        pthread_mutex_unlock(&conn->lock);
+        return -1;
+
+    }
+    // everything after the HELLO uses the agreed version and features
+    conn->version = (int) version;
+    conn->checksums = (features & FEATURE_CHECKSUMS) != 0;
+    pthread_mutex_unlock(&conn->lock);
+
+    return 1;
+}
+
+
+/**
+ * Handles an rpc_find request, the type flag having already been read
+ *
+ * @param conn Connection the request arrived on
+ * @return 1 once handled, 0 if the request is incomplete, -1 on failure
+ */
+static int handle_find(struct connection *conn) {
+
+    char name[MAX_NAME_LEN + 1];
+    uint32_t call_id;
+    int s;
+
+    // reads request id
+    if ((s = decode_id(conn->in, conn->version, &call_id)) <= 0
+        // reads function name
+        || (s = decode_string(conn->in, conn->version, name)) <= 0
+        || (s = check_frame(conn, call_id)) <= 0) {
+
+        return s;
+
+    }
+
+    // finds procedure given the name, using the core's own copy where there is one
+    hash_table_t *procedures = conn->core ? conn->core->reg_procedures : conn->srv->reg_procedures;
+    struct handler_item *item = (struct handler_item *) get_data(procedures, name, (hash_func) hash_djb2,
+                                                                 (compare_func) strcmp);
+    if (conn->srv->capture) {
+        capture_request(conn, FIND, name, item ? item->id : 0, NULL);
+    }
+
+    if (!item) {
+        error_print(HANDLER_NOT_FOUND);
+        return send_status(conn, call_id, NOT_FOUND) == -1 ? -1 : 1;
+    }
+
+    pthread_mutex_lock(&conn->lock);
+    size_t frame = buffer_length(conn->out);
+    if (encode_flag(conn->out, FOUND) == -1
+        || encode_id(conn->out, conn->version, call_id) == -1
+        // send id to client
+        || encode_int(conn->out, conn->version, item->id) == -1
+        || send_response(conn, frame, NULL) == -1) {
+
+        pthread_mutex_unlock(&conn->lock);
+        return -1;
+
+    }
+    pthread_mutex_unlock(&conn->lock);
+
+    return 1;
+}
+
+
+/**
+ * Handles an rpc_call request, the type flag having already been read
+ *
+ * @param conn Connection the request arrived on
+ * @return 1 once handled, 0 if the request is incomplete, -1 on failure
+ */
+static int handle_call(struct connection *conn) {
+
+    arena_t *arena = conn->core ? conn->core->arena : NULL;
+    rpc_data *data;
+    rpc_data *result;
+    uint32_t call_id, id;
+    size_t timeout_ms;
+    int s;
+
+    // receive request id from client
+    if ((s = decode_id(conn->in, conn->version, &call_id)) <= 0
+        // receive procedure id from client
+        || (s = decode_int(conn->in, conn->version, (int *) &id)) <= 0
+        // receive the time the client is prepared to wait
+        || (s = decode_size(conn->in, conn->version, &timeout_ms)) <= 0) {
+
+        return s;
+
+    }
+
+    // get procedure using procedure id
+    hash_table_t *procedures = conn->core ? conn->core->id_procedures : conn->srv->id_procedures;
+    struct handler_item *item = (struct handler_item *) get_data(procedures, &id, (hash_func) hash_int,
+                                                                 (compare_func) int_cmp);
+
+    // input handed to a worker, an asynchronous handler or a stream outlives the core's pass, so it is
+    // never taken from the arena
+    int handoff = conn->srv->pool
+                  || (item && (item->async_handler || item->stream_handler || item->upload_handler
+                               || item->batch_handler));
+    if (handoff) {
+        arena = NULL;
+    }
+    // input that is handed off is copied out of the input buffer, small payloads into the same allocation
+    data = arena ? arena_alloc(arena, sizeof(*data))
+                 : malloc(handoff ? sizeof(struct inline_data) : sizeof(*data));
+    if (!data) {
+        error_print(MEMORY_ALL0CATION);
+        return -1;
+    }
+
+    if ((s = decode_data_header(conn->in, conn->version, data)) <= 0) {
+        if (!arena) {
+            free(data);
+        }
+        return s;
+    }
+    // a call over its rate limit, or with a payload the server will not hold, is refused before any more
+    // of it is buffered, and dropped as the rest arrives. A call already admitted is still arriving
+    char refusal = 0;
+    if (!conn->receiving) {
+        refusal = throttle_call(conn, item, data->data2_len) ? THROTTLED
+                  : reserve_payload(conn, data->data2_len);
+        conn->receiving = !refusal;
+    }
+    if (refusal) {
+        conn->discard = data->data2_len + (conn->checksums ? CHECKSUM_LEN : 0);
+        if (!arena) {
+            free(data);
+        }
+        return send_status(conn, call_id, refusal) == -1 ? -1 : 1;
+    }
+
+    // receive data from client, its payload is left where it was read until the call is handed off, and
+    // nothing is done with it unless it arrived intact
+    if ((s = decode_payload(conn->in, data)) <= 0 || (s = check_frame(conn, call_id)) <= 0) {
+        if (!arena) {
+            free(data);
+        }
+        return s;
+    }
+    // the reserved memory now belongs to the call, released along with it
+    conn->reserved = 0;
+    conn->receiving = 0;
+    if (conn->srv->capture) {
+        capture_request(conn, CALL, item ? item->name : "", id, data);
+    }
+
+    // turn the call away straight away if the server is overloaded
+    if (!admit_call(conn->load, data->data2_len)) {
+        if (!arena) {
+            free(data);
+        }
+        return send_status(conn, call_id, BUSY) == -1 ? -1 : 1;
+    }
+
+    // the client has stopped waiting, so the procedure is not run at all
+    if (timeout_ms && now_ns() > conn->arrival + timeout_ms * 1000000ULL) {
+        atomic_fetch_add_explicit(&conn->load->expired_calls, 1, memory_order_relaxed);
+        release_call(conn->load, data->data2_len);
+        if (!arena) {
+            free(data);
+        }
+        return send_status(conn, call_id, TIMEOUT) == -1 ? -1 : 1;
+    }
+
+    if (handoff) {
+        rpc_token *token = malloc(sizeof(*token));
+        if (!token || own_payload((struct inline_data *) data) == -1) {
+            error_print(MEMORY_ALL0CATION);
+            release_call(conn->load, data->data2_len);
+            free(token);
+            free(data);
+            return -1;
+        }
+        token->conn = conn;
+        token->call_id = call_id;
+        token->data = data;
+        token->item = item;
+        token->deadline = timeout_ms ? conn->arrival + timeout_ms * 1000000ULL : 0;
+        token->flight = NULL;
+        token->sink = NULL;
+        token->source = NULL;
+        token->next = NULL;
+        // an identical call already being run answers this one as well. The input is owned first, as
+        // other calls compare against it for as long as the flight lasts
+        if (item && item->single_flight && join_flight(conn, call_id, item, data, &token->flight)) {
+            rpc_data_free(data);
+            free(token);
+            return 1;
+        }
+        if ((item && item->stream_handler && !(token->sink = create_sink(conn, call_id)))
+            || (item && item->upload_handler && !(token->source = create_source(conn, call_id)))) {
+            error_print(MEMORY_ALL0CATION);
+            release_call(conn->load, data->data2_len);
+            rpc_data_free(data);
+            free(token);
+            return -1;
+        }
+        atomic_fetch_add_explicit(&conn->refs, 1, memory_order_relaxed);
+
+        // the response is sent whenever the call completes, meanwhile later requests carry on
+        if (item && item->batch_handler) {
+            queue_batch(conn, item->batch, token);
+        } else if (conn->srv->pool) {
+            submit_call(conn, token);
+        } else if (item->stream_handler || item->upload_handler) {
+            // a stream waits on the client taking its messages or sending its records, which this thread
+            // has to be free to read
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, run_stream_thread, token) != 0) {
+                error_print(THREAD);
+                rpc_complete(token, NULL);
+            } else {
+                pthread_detach(thread);
+            }
+        } else {
+            item->async_handler(data, token);
+        }
+        return 1;
+    }
+
+    struct flight *flight = NULL;
+    if (item && item->single_flight && join_flight(conn, call_id, item, data, &flight)) {
+        if (!arena) {
+            free(data);
+        }
+        return 1;
+    }
+
+    if (item) {
+        // a handler known to be slow is not left holding up the responses to the requests before it
+        uint64_t cost = atomic_load_explicit(&item->cost, memory_order_relaxed);
+        release_held(conn, cost);
+        uint64_t started = now_ns();
+        result = item->handler(data);
+        uint64_t elapsed = now_ns() - started;
+        atomic_store_explicit(&item->cost, cost + ((int64_t) (elapsed - cost) >> 3), memory_order_relaxed);
+    } else {
+        error_print(HANDLER_NOT_FOUND);
+        result = NULL;
+    }
+    finish_flight(conn->srv, flight, result);
+    release_call(conn->load, data->data2_len);
+    // the payload still belongs to the input buffer, and arena allocations are released by the core in
+    // one go
+    if (!arena) {
+        free(data);
+    }
+
+    return send_result(conn, call_id, result) == -1 ? -1 : 1;
+}
+
+
+/**
+ * Checks the checksum ending a request that has just been read, if the connection has them. A request
+ * that does not match is answered with CORRUPT, and the connection is then closed since nothing after
+ * it can be trusted to be framed correctly
+ *
+ * @param conn Connection the request arrived on
+ * @param call_id Id read from the request
+ * @return 1 if the request is intact or the connection has no checksums, 0 if the checksum has not
+ * arrived yet, -1 if the request is corrupt
+ */
+static int check_frame(struct connection *conn, uint32_t call_id) {
+
+    if (!conn->checksums) {
+        return 1;
+    }
+
+    int s = decode_checksum(conn->in, conn->frame);
+    if (s == -1) {
+        error_print(CHECKSUM);
+        atomic_fetch_add_explicit(&conn->load->corrupt_frames, 1, memory_order_relaxed);
+        send_status(conn, call_id, CORRUPT);
+    }
+
+    return s;
+}
+
+
+/**
+ * Appends a request received in full to the server's capture log
+ *
+ * @param conn Connection the request arrived on
+ * @param type FIND or CALL
+ * @param name Procedure name asked for, or that of the procedure called, "" if there is no such procedure
+ * @param proc_id Id of the procedure, 0 if a find did not match one
+ * @param data Input of a call, NULL for a find
+ */
+static void capture_request(struct connection *conn, char type, char *name, uint32_t proc_id, rpc_data *data) {
+
+    struct capture_record record;
+    memset(&record, 0, sizeof(record));
+    record.type = type;
+    record.connection = conn->capture_id;
+    record.proc_id = proc_id;
+    record.data1 = data ? data->data1 : 0;
+    record.data2_len = data ? data->data2_len : 0;
+    // a record too large for the log's buffers is dropped whole
+    size_t max = conn->srv->capture_max_payload;
+    size_t kept = max && record.data2_len > max ? max : record.data2_len;
+    record.kept = kept > UINT32_MAX ? UINT32_MAX : kept;
+    record.name_len = strlen(name);
+    capture_append(conn->srv->capture, &record, conn->arrival, name, data ? data->data2 : NULL);
+}
+
+
+/**
+ * Runs a call handed to a worker, unless its deadline passed while it was queued
+ *
+ * @param arg Token of the call
+ */
+static void run_call(void *arg) {
+
+    rpc_token *token = (rpc_token *) arg;
+
+    if (expire_call(token)) {
+        return;
+    }
+
+    if (!token->item) {
+        error_print(HANDLER_NOT_FOUND);
+        rpc_complete(token, NULL);
+    } else if (token->item->async_handler) {
+        token->item->async_handler(token->data, token);
+    } else if (token->item->stream_handler) {
+        run_stream(token);
+    } else if (token->item->upload_handler) {
+        rpc_complete(token, token->item->upload_handler(token->data, token->source));
+    } else {
+        rpc_complete(token, token->item->handler(token->data));
+    }
+}
+
+
+/**
+ * Hands a call to the workers. A connection has at most as many calls queued there as there are workers,
+ * the rest waiting in order until one of those has run, so that a connection sending calls in a tight loop
+ * cannot fill the queues ahead of every other connection
+ *
+ * @param conn Connection the call arrived on
+ * @param token Token of the call
+ */
+static void submit_call(struct connection *conn, rpc_token *token) {
+
+    rpc_server *srv = conn->srv;
+    int priority = token->item ? token->item->priority : RPC_PRIORITY_NORMAL;
+
+    // streams and uploads last as long as the client keeps them going, so they take no turn
+    if (token->sink || token->source) {
+        if (pool_submit(srv->pool, priority, run_call, token) == -1) {
+            error_print(MEMORY_ALL0CATION);
+            rpc_complete(token, NULL);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&conn->lock);
+    if (conn->queued >= srv->num_workers) {
+        if (conn->waiting_last) {
+            conn->waiting_last->next = token;
+        } else {
+            conn->waiting = token;
+        }
+        conn->waiting_last = token;
+        pthread_mutex_unlock(&conn->lock);
+        return;
+    }
+    conn->queued++;
+    pthread_mutex_unlock(&conn->lock);
+
+    // a turn holds a reference of its own, as the call may drop the last other one
+    atomic_fetch_add_explicit(&conn->refs, 1, memory_order_relaxed);
+    if (pool_submit(srv->pool, priority, run_turn, token) == -1) {
+        error_print(MEMORY_ALL0CATION);
+        rpc_complete(token, NULL);
+        pass_turn(conn);
+    }
+}
+
+
+/**
+ * Runs a call submitted in its connection's turn, then passes the turn on to the connection's next call
+ *
+ * @param arg Token of the call
+ */
+static void run_turn(void *arg) {
+
+    rpc_token *token = (rpc_token *) arg;
+    struct connection *conn = token->conn;
+
+    run_call(token);
+    pass_turn(conn);
+}
+
+
+/**
+ * Ends a turn of a connection on the workers, submitting its next waiting call at the back of the queues
+ * behind the calls of other connections
+ *
+ * @param conn Connection whose call has run
+ */
+static void pass_turn(struct connection *conn) {
+
+    while (1) {
+        pthread_mutex_lock(&conn->lock);
+        rpc_token *token = conn->waiting;
+        if (token) {
+            conn->waiting = token->next;
+            if (!conn->waiting) {
+                conn->waiting_last = NULL;
+            }
+        } else {
+            conn->queued--;
+        }
+        pthread_mutex_unlock(&conn->lock);
+        if (!token) {
+            break;
+        }
+
+        // the turn and its reference go to the next call
+        token->next = NULL;
+        if (pool_submit(conn->srv->pool, token->item ? token->item->priority : RPC_PRIORITY_NORMAL, run_turn,
+                        token) == 0) {
+            return;
+        }
+        error_print(MEMORY_ALL0CATION);
+        rpc_complete(token, NULL);
+    }
+    release_connection(conn);
+}
+
+
+/**
+ * Answers a call handed off whose deadline passed while it was queued, unless other calls are waiting on
+ * it, freeing its token
+ *
+ * @param token Token of the call
+ * @return 1 if the call was answered, 0 if it is still to be run
+ */
+static int expire_call(rpc_token *token) {
+
+    struct connection *conn = token->conn;
+
+    // a call that others are waiting on is run regardless
+    if (!token->deadline || now_ns() <= token->deadline || !abandon_flight(conn->srv, token->flight)) {
+        return 0;
+    }
+    atomic_fetch_add_explicit(&conn->load->expired_calls, 1, memory_order_relaxed);
+    atomic_store_explicit(&conn->active, now_ns(), memory_order_relaxed);
+    release_call(conn->load, token->data->data2_len);
+    rpc_data_free(token->data);
+    free_sink(token->sink);
+    free_source(token->source);
+    send_status(conn, token->call_id, TIMEOUT);
+    release_connection(conn);
+    free(token);
+
+    return 1;
+}
+
+
+/**
+ * Creates an empty batch for a batch procedure
+ *
+ * @param srv Server the procedure is registered to
+ * @param item Procedure whose calls are collected
+ * @param max_calls Most calls in a batch
+ * @param max_wait Longest the first call of a batch waits for others in nanoseconds
+ * @return Batch on success, NULL on failure
+ */
+static struct batch *create_batch(rpc_server *srv, struct handler_item *item, int max_calls,
+                                  uint64_t max_wait) {
+
+    struct batch *batch = malloc(sizeof(*batch));
+    rpc_token **tokens = malloc(max_calls * sizeof(*tokens));
+    if (!batch || !tokens) {
+        free(batch);
+        free(tokens);
+        return NULL;
+    }
+    batch->srv = srv;
+    batch->item = item;
+    batch->max_calls = max_calls;
+    batch->max_wait = max_wait;
+    pthread_mutex_init(&batch->lock, NULL);
+    // waits are measured on the same clock as deadlines
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&batch->ready, &attr);
+    pthread_condattr_destroy(&attr);
+    batch->timer = 0;
+    batch->tokens = tokens;
+    batch->count = 0;
+    batch->started = 0;
+    batch->next = NULL;
+
+    return batch;
+}
+
+
+/**
+ * Adds a call to its procedure's batch, running the batch if that fills it. Otherwise the batch is run
+ * at the end of the pass, or once its first call has waited long enough if it has a wait
+ *
+ * @param conn Connection the call arrived on
+ * @param batch Batch of the call's procedure
+ * @param token Token of the call
+ */
+static void queue_batch(struct connection *conn, struct batch *batch, rpc_token *token) {
+
+    struct batch_run *run = NULL;
+
+    pthread_mutex_lock(&batch->lock);
+    if (batch->count == 0) {
+        batch->started = now_ns();
+    }
+    batch->tokens[batch->count++] = token;
+    if (batch->count == batch->max_calls) {
+        run = take_batch(batch);
+    } else if (batch->count == 1 && batch->max_wait > 0) {
+        // the thread running batches on time is only started once one is needed
+        if (!batch->timer) {
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, run_batch_timer, batch) != 0) {
+                error_print(THREAD);
+                run = take_batch(batch);
+            } else {
+                pthread_detach(thread);
+                batch->timer = 1;
+            }
+        }
+        pthread_cond_signal(&batch->ready);
+    }
+    pthread_mutex_unlock(&batch->lock);
+
+    if (batch->max_wait == 0) {
+        conn->queued_batch = 1;
+    }
+    if (run) {
+        dispatch_batch(conn->srv, run);
+    }
+}
+
+
+/**
+ * Takes every call of a batch to be run, leaving it empty. Must be called with the batch's lock held
+ *
+ * @param batch Batch to be taken from
+ * @return Calls to be run, NULL on failure, in which case they stay queued until the batch is next run
+ */
+static struct batch_run *take_batch(struct batch *batch) {
+
+    int n = batch->count;
+    struct batch_run *run = malloc(sizeof(*run) + n * (sizeof(*run->tokens) + 2 * sizeof(*run->in)));
+    if (!run) {
+        error_print(MEMORY_ALL0CATION);
+        return NULL;
+    }
+    run->item = batch->item;
+    run->count = n;
+    // the arrays follow the run in the same allocation
+    run->tokens = (rpc_token **) (run + 1);
+    run->in = (rpc_data **) (run->tokens + n);
+    run->out = run->in + n;
+    memcpy(run->tokens, batch->tokens, n * sizeof(*run->tokens));
+    batch->count = 0;
+
+    return run;
+}
+
+
+/**
+ * Runs a batch on a worker if there are any, otherwise on the calling thread
+ *
+ * @param srv Server the batch belongs to
+ * @param run Calls to be run
+ */
+static void dispatch_batch(rpc_server *srv, struct batch_run *run) {
+
+    if (srv->pool && pool_submit(srv->pool, run->item->priority, run_batch, run) == 0) {
+        return;
+    }
+    run_batch(run);
+}
+
+
+/**
+ * Runs the calls of a batch together and answers each of them, apart from those whose deadline passed
+ * while they were queued
+ *
+ * @param arg Calls to be run
+ */
+static void run_batch(void *arg) {
+
+    struct batch_run *run = (struct batch_run *) arg;
+
+    int n = 0;
+    for (int i = 0; i < run->count; i++) {
+        if (expire_call(run->tokens[i])) {
+            continue;
+        }
+        run->tokens[n] = run->tokens[i];
+        run->in[n] = run->tokens[n]->data;
+        run->out[n] = NULL;
+        n++;
+    }
+    if (n > 0) {
+        run->item->batch_handler(run->in, run->out, n);
+    }
+    for (int i = 0; i < n; i++) {
+        rpc_complete(run->tokens[i], run->out[i]);
+    }
+    free(run);
+}
+
+
+/**
+ * Runs the batches of a procedure with a wait once their first call has waited long enough, for as long
+ * as the process lives
+ *
+ * @param arg Batch to be run
+ * @return NULL on exit thread
+ */
+static void *run_batch_timer(void *arg) {
+
+    struct batch *batch = (struct batch *) arg;
+
+    pthread_mutex_lock(&batch->lock);
+    while (1) {
+        if (batch->count == 0) {
+            pthread_cond_wait(&batch->ready, &batch->lock);
+            continue;
+        }
+        // the batch may have filled and a new one started meanwhile, so the wait is worked out each time
+        uint64_t due = batch->started + batch->max_wait;
+        if (now_ns() < due) {
+            struct timespec ts = {.tv_sec = due / 1000000000ULL, .tv_nsec = due % 1000000000ULL};
+            pthread_cond_timedwait(&batch->ready, &batch->lock, &ts);
+            continue;
+        }
+        struct batch_run *run = take_batch(batch);
+        pthread_mutex_unlock(&batch->lock);
+        if (run) {
+            dispatch_batch(batch->srv, run);
+        }
+        pthread_mutex_lock(&batch->lock);
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Runs the batches without a wait that calls were queued on during a connection's pass, now that the
+ * calls which arrived together have all been read
+ *
+ * @param conn Connection whose pass has ended
+ */
+static void run_due_batches(struct connection *conn) {
+
+    if (!conn->queued_batch) {
+        return;
+    }
+    conn->queued_batch = 0;
+
+    struct batch *batch = conn->core ? conn->core->batches : conn->srv->batches;
+    for (; batch; batch = batch->next) {
+        if (batch->max_wait > 0) {
+            continue;
+        }
+        pthread_mutex_lock(&batch->lock);
+        struct batch_run *run = batch->count > 0 ? take_batch(batch) : NULL;
+        pthread_mutex_unlock(&batch->lock);
+        if (run) {
+            dispatch_batch(conn->srv, run);
+        }
+    }
+}
+
+
+/**
+ * Completes a call passed to an asynchronous handler, sending its output to the client. Both the token
+ * and the call's input are freed, the output is freed once sent
+ *
+ * @param token Token given to the handler
+ * @param result Output of the procedure, NULL if it failed
+ */
+void rpc_complete(rpc_token *token, rpc_data *result) {
+
+    if (token == NULL) {
+        error_print(INVALID_ARGUMENTS);
+        return;
+    }
+    struct connection *conn = token->conn;
+
+    finish_flight(conn->srv, token->flight, result);
+    free_sink(token->sink);
+    free_source(token->source);
+    release_call(conn->load, token->data->data2_len);
+    rpc_data_free(token->data);
+    // a failure to send is noticed by the thread reading the connection
+    send_result(conn, token->call_id, result);
+    atomic_store_explicit(&conn->active, now_ns(), memory_order_relaxed);
+
+    release_connection(conn);
+    free(token);
+}
+
+
+/**
+ * Runs a streaming call on a thread of its own, for servers without workers
+ *
+ * @param arg Token of the call
+ * @return NULL on exit thread
+ */
+static void *run_stream_thread(void *arg) {
+
+    run_call(arg);
+    return NULL;
+}
+
+
+/**
+ * Runs a streaming call, ending the stream once its handler returns
+ *
+ * @param token Token of the call
+ */
+static void run_stream(rpc_token *token) {
+
+    struct connection *conn = token->conn;
+
+    int s = token->item->stream_handler(token->data, token->sink);
+    free_sink(token->sink);
+    release_call(conn->load, token->data->data2_len);
+    rpc_data_free(token->data);
+    // a failure to send is noticed by the thread reading the connection
+    send_status(conn, token->call_id, s == 0 ? END : INCONSISTENT);
+    atomic_store_explicit(&conn->active, now_ns(), memory_order_relaxed);
+
+    release_connection(conn);
+    free(token);
+}
+
+
+/**
+ * Sends a message of a streaming call, first waiting until the client has room for it both in the
+ * stream's window and in the connection's, so that one stream cannot use up the connection's buffers
+ *
+ * @param sink Sink given to the handler
+ * @param message Message to be sent, freed once sent
+ * @return 0 on success, -1 on failure or once the client has given up on the stream
+ */
+int rpc_sink_send(rpc_sink *sink, rpc_data *message) {
+
+    if (sink == NULL || message == NULL) {
+        error_print(INVALID_ARGUMENTS);
+        rpc_data_free(message);
+        return -1;
+    } else if ((message->data2 && !message->data2_len) || (!message->data2 && message->data2_len)) {
+        error_print(INCONSISTENT_DATA);
+        rpc_data_free(message);
+        return -1;
+    }
+    struct connection *conn = sink->conn;
+    long cost = (long) (message->data2_len + FRAME_COST);
+
+    pthread_mutex_lock(&conn->lock);
+    while ((sink->credit <= 0 || conn->send_credit <= 0) && !sink->cancelled && !conn->closed) {
+        pthread_cond_wait(&sink->ready, &conn->lock);
+    }
+    int s = -1;
+    if (!sink->cancelled && !conn->closed) {
+        sink->credit -= cost;
+        conn->send_credit -= cost;
+        size_t frame = buffer_length(conn->out);
+        if (encode_flag(conn->out, MESSAGE) != -1
+            && encode_id(conn->out, conn->version, sink->call_id) != -1
+            && encode_data(conn->out, conn->version, message) != -1
+            && send_response(conn, frame, message) != -1) {
+
+            s = 0;
+
+        }
+    }
+    pthread_mutex_unlock(&conn->lock);
+
+    rpc_data_free(message);
+    return s;
+}
+
+
+/**
+ * Handles credit handed back for a stream's messages, the end of an upload's records, or the client
+ * giving up on either. Each may arrive after the call has finished, and is then ignored
+ *
+ * @param conn Connection the request arrived on
+ * @param type CREDIT, END or CANCEL
+ * @return 1 once handled, 0 if the request is incomplete, -1 on failure
+ */
+static int handle_stream_control(struct connection *conn, char type) {
+
+    uint32_t call_id;
+    size_t credit = 0;
+    int s;
+
+    if ((s = decode_id(conn->in, conn->version, &call_id)) <= 0
+        || (type == CREDIT && (s = decode_size(conn->in, conn->version, &credit)) <= 0)
+        || (s = check_frame(conn, call_id)) <= 0) {
+        return s;
+    }
+
+    pthread_mutex_lock(&conn->lock);
+    // credit for the connection lets every stream carry on
+    if (type == CREDIT && call_id == CONNECTION_ID) {
+        conn->send_credit += (long) credit;
+        for (struct rpc_sink *sink = conn->streams; sink; sink = sink->next) {
+            pthread_cond_broadcast(&sink->ready);
+        }
+    }
+    for (struct rpc_sink *sink = conn->streams; sink && type != END; sink = sink->next) {
+        if (sink->call_id == call_id) {
+            if (type == CREDIT) {
+                sink->credit += (long) credit;
+            } else {
+                sink->cancelled = 1;
+            }
+            pthread_cond_broadcast(&sink->ready);
+            break;
+        }
+    }
+    for (struct rpc_source *source = conn->uploads; source && type != CREDIT; source = source->next) {
+        if (source->call_id == call_id) {
+            source->ended = 1;
+            pthread_cond_broadcast(&source->ready);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&conn->lock);
+
+    return 1;
+}
+
+
+/**
+ * Handles a record of an upload, queueing it for the handler. A record for an upload that has finished
+ * is dropped
+ *
+ * @param conn Connection the request arrived on
+ * @return 1 once handled, 0 if the request is incomplete, -1 on failure (including a client sending
+ * records it has no credit for)
+ */
+static int handle_record(struct connection *conn) {
+
+    uint32_t call_id;
+    rpc_data data;
+    int s;
+
+    if ((s = decode_id(conn->in, conn->version, &call_id)) <= 0
+        || (s = decode_data_header(conn->in, conn->version, &data)) <= 0) {
+        return s;
+    }
+    long cost = (long) (data.data2_len + FRAME_COST);
+    // a record is held until the handler takes it, so it has to fit both windows and the server's payload
+    // limits before any of it is buffered. Records are not answered one by one, so one that does not
+    // closes the connection rather than leaving a gap in the upload
+    if (!conn->receiving) {
+        pthread_mutex_lock(&conn->lock);
+        struct rpc_source *source = conn->uploads;
+        while (source && source->call_id != call_id) {
+            source = source->next;
+        }
+        int over = cost > conn->recv_credit || (source && cost > source->credit);
+        pthread_mutex_unlock(&conn->lock);
+        if (over || reserve_payload(conn, data.data2_len)) {
+            return -1;
+        }
+        conn->receiving = 1;
+    }
+    if ((s = decode_payload(conn->in, &data)) <= 0 || (s = check_frame(conn, call_id)) <= 0) {
+        return s;
+    }
+    // the record is read by the handler's thread, so it is copied out of the input buffer
+    struct record *record = malloc(sizeof(*record));
+    if (!record) {
+        error_print(MEMORY_ALL0CATION);
+        return -1;
+    }
+    record->data.data = data;
+    record->next = NULL;
+    if (own_payload(&record->data) == -1) {
+        error_print(MEMORY_ALL0CATION);
+        free(record);
+        return -1;
+    }
+    // the reserved memory now belongs to the record, released once the handler takes it
+    conn->reserved = 0;
+    conn->receiving = 0;
+
+    // the windows only grew while the payload arrived, though the upload may since have finished
+    pthread_mutex_lock(&conn->lock);
+    struct rpc_source *source = conn->uploads;
+    while (source && source->call_id != call_id) {
+        source = source->next;
+    }
+    conn->recv_credit -= cost;
+    if (source && !source->ended) {
+        source->credit -= cost;
+        if (source->last) {
+            source->last->next = record;
+        } else {
+            source->first = record;
+        }
+        source->last = record;
+        pthread_cond_broadcast(&source->ready);
+        record = NULL;
+    } else {
+        // a dropped record's share of the connection's window is handed straight back
+        connection_credit(conn, (size_t) cost);
+        release_payload(conn, data.data2_len);
+    }
+    pthread_mutex_unlock(&conn->lock);
+
+    if (record) {
+        rpc_data_free(&record->data.data);
+    }
+    return 1;
+}
+
+
+/**
+ * Waits for the next record of an upload, handing back credit to the client as records are taken
+ *
+ * @param source Source given to the handler
+ * @return Next record, to be freed by the handler with rpc_data_free, NULL once the client has sent its
+ * last record or given up
+ */
+rpc_data *rpc_source_next(rpc_source *source) {
+
+    if (source == NULL) {
+        error_print(INVALID_ARGUMENTS);
+        return NULL;
+    }
+    struct connection *conn = source->conn;
+    struct record *record;
+
+    pthread_mutex_lock(&conn->lock);
+    while (!source->first && !source->ended && !conn->closed) {
+        pthread_cond_wait(&source->ready, &conn->lock);
+    }
+    if ((record = source->first)) {
+        source->first = record->next;
+        if (!source->first) {
+            source->last = NULL;
+        }
+        size_t cost = record->data.data.data2_len + FRAME_COST;
+        size_t frame = buffer_length(conn->out);
+        // the handler holds the record from now on
+        release_payload(conn, record->data.data.data2_len);
+        source->consumed += cost;
+        // a failure to send is noticed by the thread reading the connection
+        if (source->consumed >= STREAM_WINDOW / 2 && !source->ended && !conn->closed
+            && encode_flag(conn->out, CREDIT) != -1
+            && encode_id(conn->out, conn->version, source->call_id) != -1
+            && encode_size(conn->out, conn->version, source->consumed) != -1) {
+
+            send_response(conn, frame, NULL);
+            source->credit += (long) source->consumed;
+            source->consumed = 0;
+
+        }
+        connection_credit(conn, cost);
+    }
+    pthread_mutex_unlock(&conn->lock);
+
+    return record ? &record->data.data : NULL;
+}
+
+
+/**
+ * Counts bytes of records taken or dropped against the connection's window, handing credit back to the
+ * client once half of it has been. The connection's lock must be held
+ *
+ * @param conn Connection the records arrived on
+ * @param bytes Bytes taken, including FRAME_COST for each record
+ */
+static void connection_credit(struct connection *conn, size_t bytes) {
+
+    size_t frame = buffer_length(conn->out);
+    conn->recv_consumed += bytes;
+    // a failure to send is noticed by the thread reading the connection
+    if (conn->recv_consumed >= CONNECTION_WINDOW / 2 && !conn->closed
+        && encode_flag(conn->out, CREDIT) != -1
+        && encode_id(conn->out, conn->version, CONNECTION_ID) != -1
+        && encode_size(conn->out, conn->version, conn->recv_consumed) != -1) {
+
+        send_response(conn, frame, NULL);
+        conn->recv_credit += (long) conn->recv_consumed;
+        conn->recv_consumed = 0;
+
+    }
+}
+
+
+/**
+ * Creates the sink of a streaming call, adding it to the connection's streams so that credit for it can
+ * be found
+ *
+ * @param conn Connection the call arrived on
+ * @param call_id Id of the call
+ * @return Newly created sink, NULL on failure
+ */
+static struct rpc_sink *create_sink(struct connection *conn, uint32_t call_id) {
+
+    struct rpc_sink *sink = malloc(sizeof(*sink));
+    if (!sink) {
+        return NULL;
+    }
+    sink->conn = conn;
+    sink->call_id = call_id;
+    sink->credit = STREAM_WINDOW;
+    sink->cancelled = 0;
+    pthread_cond_init(&sink->ready, NULL);
+
+    pthread_mutex_lock(&conn->lock);
+    sink->next = conn->streams;
+    conn->streams = sink;
+    pthread_mutex_unlock(&conn->lock);
+
+    return sink;
+}
+
+
+/**
+ * Creates the source of an upload, adding it to the connection's uploads so that its records can be
+ * queued before the handler starts
+ *
+ * @param conn Connection the call arrived on
+ * @param call_id Id of the call
+ * @return Newly created source, NULL on failure
+ */
+static struct rpc_source *create_source(struct connection *conn, uint32_t call_id) {
+
+    struct rpc_source *source = malloc(sizeof(*source));
+    if (!source) {
+        return NULL;
+    }
+    source->conn = conn;
+    source->call_id = call_id;
+    source->first = NULL;
+    source->last = NULL;
+    source->credit = STREAM_WINDOW;
+    source->consumed = 0;
+    source->ended = 0;
+    pthread_cond_init(&source->ready, NULL);
+
+    pthread_mutex_lock(&conn->lock);
+    source->next = conn->uploads;
+    conn->uploads = source;
+    pthread_mutex_unlock(&conn->lock);
+
+    return source;
+}
+
+
+/**
+ * Removes a source from its connection's uploads and frees it along with any records not taken, whose
+ * share of the connection's window is handed back
+ *
+ * @param source Source to be freed, or NULL
+ */
+static void free_source(struct rpc_source *source) {
+
+    if (!source) {
+        return;
+    }
+    struct connection *conn = source->conn;
+
+    pthread_mutex_lock(&conn->lock);
+    struct rpc_source **link = &conn->uploads;
+    while (*link != source) {
+        link = &(*link)->next;
+    }
+    *link = source->next;
+    while (source->first) {
+        struct record *record = source->first;
+        source->first = record->next;
+        connection_credit(conn, record->data.data.data2_len + FRAME_COST);
+        release_payload(conn, record->data.data.data2_len);
+        rpc_data_free(&record->data.data);
+    }
+    pthread_mutex_unlock(&conn->lock);
+
+    pthread_cond_destroy(&source->ready);
+    free(source);
+}
+
+
+/**
+ * Removes a sink from its connection's streams and frees it
+ *
+ * @param sink Sink to be freed, or NULL
+ */
+static void free_sink(struct rpc_sink *sink) {
+
+    if (!sink) {
+        return;
+    }
+    struct connection *conn = sink->conn;
+
+    pthread_mutex_lock(&conn->lock);
+    struct rpc_sink **link = &conn->streams;
+    while (*link != sink) {
+        link = &(*link)->next;
+    }
+    *link = sink->next;
+    pthread_mutex_unlock(&conn->lock);
+
+    pthread_cond_destroy(&sink->ready);
+    free(sink);
+}
+
+
+/**
+ * Looks for a single-flight call with the same procedure and input being run, and waits on it if there
+ * is one. Otherwise the call starts a flight of its own, unless there is no memory for it
+ *
+ * @param conn Connection the call arrived on
+ * @param call_id Id of the call
+ * @param item Procedure of the call
+ * @param data Input of the call, which must outlive the flight if one is started
+ * @param flight Buffer to store the flight started by the call, NULL if none was
+ * @return 1 if the call is waiting on another, 0 if it is to be run
+ */
+static int join_flight(struct connection *conn, uint32_t call_id, struct handler_item *item, rpc_data *data,
+                       struct flight **flight) {
+
+    rpc_server *srv = conn->srv;
+    uint64_t hash = hash_call(item->id, data);
+    struct flight **bucket = &srv->flights[hash % FLIGHT_BUCKETS];
+    struct flight *running;
+
+    pthread_mutex_lock(&srv->flights_lock);
+    for (running = *bucket; running; running = running->next) {
+        if (running->hash == hash && running->proc_id == item->id && running->data->data1 == data->data1
+            && running->data->data2_len == data->data2_len
+            && (data->data2_len == 0 || memcmp(running->data->data2, data->data2, data->data2_len) == 0)) {
+            break;
+        }
+    }
+
+    if (running) {
+        // the call keeps its admission until it is answered
+        struct waiter *waiter = malloc(sizeof(*waiter));
+        if (waiter) {
+            waiter->conn = conn;
+            waiter->call_id = call_id;
+            waiter->bytes = data->data2_len;
+            waiter->next = running->waiters;
+            running->waiters = waiter;
+            atomic_fetch_add_explicit(&conn->refs, 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&conn->load->coalesced_calls, 1, memory_order_relaxed);
+            pthread_mutex_unlock(&srv->flights_lock);
+            return 1;
+        }
+    } else if ((running = malloc(sizeof(*running)))) {
+        running->proc_id = item->id;
+        running->hash = hash;
+        running->data = data;
+        running->waiters = NULL;
+        running->next = *bucket;
+        *bucket = running;
+        *flight = running;
+    }
+    pthread_mutex_unlock(&srv->flights_lock);
+
+    return 0;
+}
+
+
+/**
+ * Ends a flight whose call is not going to be run, unless other calls are already waiting on it
+ *
+ * @param srv Server running the call
+ * @param flight Flight started by the call, or NULL
+ * @return 1 if the call may be dropped, 0 if it must still be run
+ */
+static int abandon_flight(rpc_server *srv, struct flight *flight) {
+
+    if (!flight) {
+        return 1;
+    }
+
+    pthread_mutex_lock(&srv->flights_lock);
+    if (flight->waiters) {
+        pthread_mutex_unlock(&srv->flights_lock);
+        return 0;
+    }
+    struct flight **link = &srv->flights[flight->hash % FLIGHT_BUCKETS];
+    while (*link != flight) {
+        link = &(*link)->next;
+    }
+    *link = flight->next;
+    pthread_mutex_unlock(&srv->flights_lock);
+
+    free(flight);
+    return 1;
+}
+
+
+/**
+ * Ends a flight once its call has been run, answering every call waiting on it with a copy of the
+ * output. Must be called before the output is sent and the input is freed
+ *
+ * @param srv Server running the call
+ * @param flight Flight started by the call, or NULL
+ * @param result Output of the call, NULL if it failed
+ */
+static void finish_flight(rpc_server *srv, struct flight *flight, rpc_data *result) {
+
+    if (!flight) {
+        return;
+    }
+
+    // no call joins once the flight is unlinked, so the waiters can be answered without the lock
+    pthread_mutex_lock(&srv->flights_lock);
+    struct flight **link = &srv->flights[flight->hash % FLIGHT_BUCKETS];
+    while (*link != flight) {
+        link = &(*link)->next;
+    }
+    *link = flight->next;
+    pthread_mutex_unlock(&srv->flights_lock);
+
+    struct waiter *waiter = flight->waiters;
+    while (waiter) {
+        struct waiter *next = waiter->next;
+        struct connection *conn = waiter->conn;
+        release_call(conn->load, waiter->bytes);
+        // a failure to send is noticed by the thread reading the connection
+        send_result(conn, waiter->call_id, copy_result(result));
+        atomic_store_explicit(&conn->active, now_ns(), memory_order_relaxed);
+        release_connection(conn);
+        free(waiter);
+        waiter = next;
+    }
+    free(flight);
+}
+
+
+/**
+ * Hashes a call's procedure and input with FNV-1a
+ *
+ * @param id Procedure id
+ * @param data Input of the call
+ * @return Hash of the call
+ */
+static uint64_t hash_call(uint32_t id, rpc_data *data) {
+
+    uint64_t hash = 14695981039346656037ULL;
+    hash = (hash ^ id) * 1099511628211ULL;
+    hash = (hash ^ (uint32_t) data->data1) * 1099511628211ULL;
+    const unsigned char *bytes = data->data2;
+    for (size_t i = 0; i < data->data2_len; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+
+/**
+ * Copies the output of a procedure for another call. Segments are joined into one buffer, while a file
+ * region is shared through a descriptor of its own
+ *
+ * @param result Output to be copied, or NULL
+ * @return Copy of the output, NULL if there is none, it is inconsistent or the copy failed
+ */
+static rpc_data *copy_result(rpc_data *result) {
+
+    if (result == NULL || (result->data2 && !result->data2_len) || (!result->data2 && result->data2_len)) {
+        return NULL;
+    }
+    if (result->data2 == &file_payload) {
+        struct file_data *file = (struct file_data *) result;
+        // sendfile is given the offset, so the descriptors share nothing that matters
+        int fd = dup(file->fd);
+        return fd == -1 ? NULL : rpc_data_from_file(result->data1, fd, file->offset, result->data2_len);
+    }
+
+    rpc_data *copy = malloc(sizeof(*copy));
+    void *bytes = result->data2_len ? malloc(result->data2_len) : NULL;
+    if (!copy || (result->data2_len && !bytes)) {
+        error_print(MEMORY_ALL0CATION);
+        free(copy);
+        free(bytes);
+        return NULL;
+    }
+    const struct iovec *iov;
+    struct iovec single;
+    int iovcnt = payload_segments(result, &iov, &single);
+    size_t offset = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy((char *) bytes + offset, iov[i].iov_base, iov[i].iov_len);
+        offset += iov[i].iov_len;
+    }
+    copy->data1 = result->data1;
+    copy->data2_len = result->data2_len;
+    copy->data2 = bytes;
+
+    return copy;
+}
+
+
+/**
+ * Sends the output of a procedure to the client, or INCONSISTENT if there is none or it is inconsistent
+ *
+ * @param conn Connection the call arrived on
+ * @param call_id Id of the call
+ * @param result Output of the procedure, freed once sent
+ * @return 0 on success, -1 on failure
+ */
+static int send_result(struct connection *conn, uint32_t call_id, rpc_data *result) {
+
+    // checks for data consistency
+    if (result == NULL || (result->data2 && !result->data2_len) || (!result->data2 && result->data2_len)) {
+        error_print(INCONSISTENT_DATA);
+        rpc_data_free(result);
+        return send_status(conn, call_id, INCONSISTENT);
+    }
+
+    pthread_mutex_lock(&conn->lock);
+    size_t frame = buffer_length(conn->out);
+    int s = 0;
+    if (!conn->closed) {
+        // notify client that data is consistent
+        if (encode_flag(conn->out, CONSISTENT) == -1
+            || encode_id(conn->out, conn->version, call_id) == -1
+            // send the consistent data
+            || encode_data(conn->out, conn->version, result) == -1
+            || send_response(conn, frame, result) == -1) {
+
+            s = -1;
+
+        }
+    }
+    pthread_mutex_unlock(&conn->lock);
+
+    rpc_data_free(result);
+    return s;
+}
+
+
+/**
+ * Sends a response made up of only a status flag
+ *
+ * @param conn Connection the request arrived on
+ * @param call_id Id of the request
+ * @param status Flag to be sent
+ * @return 0 on success, -1 on failure
+ */
+static int send_status(struct connection *conn, uint32_t call_id, char status) {
+
+    pthread_mutex_lock(&conn->lock);
+    size_t frame = buffer_length(conn->out);
+    int s = 0;
+    if (!conn->closed) {
+        if (encode_flag(conn->out, status) == -1
+            || encode_id(conn->out, conn->version, call_id) == -1
+            || send_response(conn, frame, NULL) == -1) {
+
+            s = -1;
+
+        }
+    }
+    pthread_mutex_unlock(&conn->lock);
+
+    return s;
+}
+
+
+/**
+ * Sends a frame that has just been staged, along with any payload encode_data left in place and the
+ * frame's checksum if the connection has them. While the connection's input is being handled the frame
+ * is held back to go out with the others, unless COALESCE_BYTES are already waiting or the payload has
+ * to be sent from where it is. The connection's lock must be held
+ *
+ * @param conn Connection the frame is for
+ * @param frame Number of bytes staged ahead of the frame
+ * @param data Data whose header was just staged, NULL if the frame has none
+ * @return 0 on success, -1 on failure
+ */
+static int send_response(struct connection *conn, size_t frame, rpc_data *data) {
+
+    int gather = data && (data->data2 == &file_payload || data->data2_len >= GATHER_MIN);
+    int hold = conn->batching && !gather && buffer_length(conn->out) < COALESCE_BYTES;
+    // worked out before any of the frame is sent
+    uint32_t crc = conn->checksums ? frame_checksum(conn->out, frame, data) : 0;
+
+    // more responses are on their way, so a partly filled segment waits for them
+    if (conn->batching && !hold) {
+        cork_connection(conn, 1);
+    }
+    if ((gather && send_data(conn->out, conn->connectfd, data) == -1)
+        || (conn->checksums && encode_checksum(conn->out, crc) == -1)) {
+        return -1;
+    }
+
+    return hold ? 0 : flush_connection(conn);
+}
+
+
+/**
+ * Sends the responses held back while a connection's input is handled if the oldest would otherwise
+ * wait longer than COALESCE_NS, counting the time the next request is expected to take. Called only by
+ * the thread reading the connection, which notices any failure to send once the input has been handled
+ *
+ * @param conn Connection whose input is being handled
+ * @param expected Time the next request is expected to take, in nanoseconds
+ */
+static void release_held(struct connection *conn, uint64_t expected) {
+
+    uint64_t now = now_ns();
+    if (now - conn->held + expected <= COALESCE_NS) {
+        return;
+    }
+
+    pthread_mutex_lock(&conn->lock);
+    flush_connection(conn);
+    cork_connection(conn, 0);
+    pthread_mutex_unlock(&conn->lock);
+    conn->held = now;
+}
+
+
+/**
+ * Sends a connection's pending output. Connections owned by a core send what the socket takes and
+ * wait for it to become writable again for the rest. The connection's lock must be held
+ *
+ * @param conn Connection with pending output
+ * @return 0 on success, -1 on failure
+ */
+static int flush_connection(struct connection *conn) {
+
+    if (conn->loop) {
+        if (channel_write(conn->loop->to_client, conn->out, 0) == -1) {
+            error_print(NETWORK_FAIL);
+            return -1;
+        }
+        return 0;
+    }
+
+    while (buffer_length(conn->out) > 0) {
+        ssize_t n = buffer_write_fd(conn->out, conn->connectfd);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (conn->core && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                set_events(conn, EPOLLOUT);
+                return 0;
+            }
+            error_print(NETWORK_FAIL);
+            return -1;
+        }
+    }
+
+    if (conn->core && conn->events != EPOLLIN) {
+        set_events(conn, EPOLLIN);
+    }
+
+    return 0;
+}
+
+
+/**
+ * Corks or uncorks a connection's socket, uncorking sends any partly filled segment straight away. The
+ * connection's lock must be held
+ *
+ * @param conn Connection to be corked or uncorked
+ * @param cork 1 to cork, 0 to uncork
+ */
+static void cork_connection(struct connection *conn, int cork) {
+
+    if (conn->corked != cork && !conn->loop
+        && setsockopt(conn->connectfd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork)) == 0) {
+
+        conn->corked = cork;
+
+    }
+}
+
+
+/**
+ * Changes which events a core waits for on a connection. The connection's lock must be held
+ *
+ * @param conn Connection owned by a core
+ * @param events Epoll events to wait for
+ */
+static void set_events(struct connection *conn, uint32_t events) {
+
+    struct epoll_event ev = {.events = events, .data.ptr = conn};
+    if (epoll_ctl(conn->core->epollfd, EPOLL_CTL_MOD, conn->connectfd, &ev) == 0) {
+        conn->events = events;
+    }
+}
+
+
+/**
+ * Sets up the counts of a load along with its share of the admission limits
+ *
+ * @param load Load to be initialised
+ * @param opts Server options containing the limits
+ * @param share Number of loads the limits are split between
+ * @param payload_memory Server-wide count of payload bytes held
+ */
+static void init_load(struct load *load, rpc_server_opts *opts, int share, atomic_size_t *payload_memory) {
+
+    atomic_init(&load->connections, 0);
+    atomic_init(&load->inflight, 0);
+    atomic_init(&load->queued_bytes, 0);
+    atomic_init(&load->shed_calls, 0);
+    atomic_init(&load->shed_connections, 0);
+    atomic_init(&load->expired_calls, 0);
+    atomic_init(&load->rejected_payloads, 0);
+    atomic_init(&load->idle_closed, 0);
+    atomic_init(&load->coalesced_calls, 0);
+    atomic_init(&load->corrupt_frames, 0);
+    atomic_init(&load->throttled_calls, 0);
+    load->payload_memory = payload_memory;
+    // rounded up so that a limit is never split down to nothing
+    load->max_connections = (opts->max_connections + share - 1) / share;
+    load->max_inflight = (opts->max_inflight + share - 1) / share;
+    load->max_queued_bytes = (opts->max_queued_bytes + share - 1) / share;
+}
+
+
+/**
+ * Admits a newly accepted connection, or tells the client the server is busy and closes it
+ *
+ * @param load Load the connection would join
+ * @param connectfd Accepted socket, -1 for a client in the same process which is told by the caller
+ * @return 1 if admitted, 0 if turned away
+ */
+static int admit_connection(struct load *load, int connectfd) {
+
+    int connections = atomic_fetch_add_explicit(&load->connections, 1, memory_order_relaxed) + 1;
+    if (load->max_connections && connections > load->max_connections) {
+        atomic_fetch_sub_explicit(&load->connections, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&load->shed_connections, 1, memory_order_relaxed);
+
+        if (connectfd < 0) {
+            return 0;
+        }
+        // the client reads this in place of the response to its first request
+        char msg[1 + sizeof(uint32_t)] = {BUSY};
+        uint32_t id_n = htonl(CONNECTION_ID);
+        memcpy(msg + 1, &id_n, sizeof(id_n));
+        send(connectfd, msg, sizeof(msg), MSG_NOSIGNAL | MSG_DONTWAIT);
+        close(connectfd);
+        return 0;
+    }
+
+    return 1;
+}
+
+
+/**
+ * Admits a call unless doing so would go over the limits of its load
+ *
+ * @param load Load the call would join
+ * @param bytes Size of the call's payload
+ * @return 1 if admitted, 0 if it should be answered with BUSY
+ */
+static int admit_call(struct load *load, size_t bytes) {
+
+    int inflight = atomic_fetch_add_explicit(&load->inflight, 1, memory_order_relaxed) + 1;
+    size_t queued = atomic_fetch_add_explicit(&load->queued_bytes, bytes, memory_order_relaxed) + bytes;
+
+    if ((load->max_inflight && inflight > load->max_inflight)
+        || (load->max_queued_bytes && queued > load->max_queued_bytes)) {
+
+        release_call(load, bytes);
+        atomic_fetch_add_explicit(&load->shed_calls, 1, memory_order_relaxed);
+        return 0;
+
+    }
+
+    return 1;
+}
+
+
+/**
+ * Releases a call admitted by admit_call once it has been answered or turned away, along with the
+ * memory reserved for its payload
+ *
+ * @param load Load the call joined
+ * @param bytes Size of the call's payload
+ */
+static void release_call(struct load *load, size_t bytes) {
+
+    atomic_fetch_sub_explicit(&load->inflight, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&load->queued_bytes, bytes, memory_order_relaxed);
+    atomic_fetch_sub_explicit(load->payload_memory, bytes, memory_order_relaxed);
+}
+
+
+/**
+ * Reserves memory for the payload of a call or upload record being received, within the server's limits.
+ * The reservation is held by the connection until the payload has arrived, then by the call or record
+ *
+ * @param conn Connection the payload is arriving on
+ * @param bytes Size of the payload
+ * @return 0 if reserved, otherwise the status the call should be answered with
+ */
+static char reserve_payload(struct connection *conn, size_t bytes) {
+
+    rpc_server *srv = conn->srv;
+
+    if (srv->max_payload && bytes > srv->max_payload) {
+        atomic_fetch_add_explicit(&conn->load->rejected_payloads, 1, memory_order_relaxed);
+        return TOO_LARGE;
+    }
+    size_t held = atomic_fetch_add_explicit(&srv->payload_memory, bytes, memory_order_relaxed) + bytes;
+    if (srv->max_payload_memory && held > srv->max_payload_memory) {
+        atomic_fetch_sub_explicit(&srv->payload_memory, bytes, memory_order_relaxed);
+        atomic_fetch_add_explicit(&conn->load->rejected_payloads, 1, memory_order_relaxed);
+        return BUSY;
+    }
+    conn->reserved = bytes;
+
+    return 0;
+}
+
+
+/**
+ * Gives back memory reserved by reserve_payload for a payload the server no longer holds
+ *
+ * @param conn Connection the payload arrived on
+ * @param bytes Size of the payload
+ */
+static void release_payload(struct connection *conn, size_t bytes) {
+
+    atomic_fetch_sub_explicit(conn->load->payload_memory, bytes, memory_order_relaxed);
+}
+
+
+/**
+ * Limits the rate of a registered procedure's calls, for each connection or for each peer address. Calls
+ * over the limit are answered with THROTTLED before their payload is read, so one client calling in a
+ * tight loop cannot take over the handlers. Must be called before rpc_serve_all
+ *
+ * @param srv Server struct
+ * @param name Name of the procedure
+ * @param scope Whether the limit applies to each connection or to each peer address
+ * @param limit Rates and bursts allowed, NULL to remove the limit
+ * @return 0 on success, -1 on failure
+ */
+int rpc_set_rate_limit(rpc_server *srv, char *name, rpc_limit_scope scope, const rpc_rate_limit *limit) {
+
+    if (srv == NULL || name == NULL || scope < 0 || scope >= RPC_NUM_LIMIT_SCOPES
+        || (limit && (limit->calls_per_sec < 0 || limit->call_burst < 0))) {
+        error_print(INVALID_ARGUMENTS);
+        return -1;
+    }
+    struct handler_item *item = (struct handler_item *) get_data(srv->reg_procedures, name,
+                                                                 (hash_func) hash_djb2, (compare_func) strcmp);
+    if (!item) {
+        error_print(HANDLER_NOT_FOUND);
+        return -1;
+    }
+    rpc_rate_limit *own = &item->limits[scope];
+    if (!limit) {
+        memset(own, 0, sizeof(*own));
+        return 0;
+    }
+    *own = *limit;
+    if (own->call_burst == 0) {
+        own->call_burst = own->calls_per_sec;
+    }
+    if (own->byte_burst == 0) {
+        own->byte_burst = own->bytes_per_sec;
+    }
+    if (item->limit_index < 0) {
+        item->limit_index = srv->num_limits++;
+    }
+
+    if (scope == RPC_LIMIT_PEER) {
+        srv->limit_peers = 1;
+        // a peer is forgotten once its buckets would have refilled anyway
+        uint64_t linger = 0;
+        if (own->calls_per_sec) {
+            linger = (uint64_t) (own->call_burst * 1e9 / own->calls_per_sec);
+        }
+        if (own->bytes_per_sec && own->byte_burst * 1e9 / own->bytes_per_sec > linger) {
+            linger = (uint64_t) (own->byte_burst * 1e9 / own->bytes_per_sec);
+        }
+        if (linger > srv->peer_linger) {
+            srv->peer_linger = linger;
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * Checks a call against its procedure's rate limits on its connection and its peer address, taking it from
+ * both allowances if neither has run out
+ *
+ * @param conn Connection the call is arriving on
+ * @param item Procedure called, NULL if there is none
+ * @param bytes Size of the call's payload
+ * @return 1 if the call is over a limit, 0 if it is admitted
+ */
+static int throttle_call(struct connection *conn, struct handler_item *item, size_t bytes) {
+
+    if (!item || item->limit_index < 0) {
+        return 0;
+    }
+    uint64_t now = now_ns();
+    struct bucket *own = &conn->buckets[item->limit_index];
+    const rpc_rate_limit *peer_limit = &item->limits[RPC_LIMIT_PEER];
+
+    int admitted = refill_bucket(own, &item->limits[RPC_LIMIT_CONNECTION], now);
+    if (admitted && conn->peer && (peer_limit->calls_per_sec || peer_limit->bytes_per_sec)) {
+        pthread_mutex_lock(&conn->srv->peers_lock);
+        struct bucket *shared = &conn->peer->buckets[item->limit_index];
+        admitted = refill_bucket(shared, peer_limit, now);
+        if (admitted) {
+            charge_bucket(shared, bytes);
+        }
+        pthread_mutex_unlock(&conn->srv->peers_lock);
+    }
+    if (!admitted) {
+        atomic_fetch_add_explicit(&conn->load->throttled_calls, 1, memory_order_relaxed);
+        return 1;
+    }
+    charge_bucket(own, bytes);
+
+    return 0;
+}
+
+
+/**
+ * Refills a bucket for the time since it was last refilled
+ *
+ * @param bucket Bucket to be refilled
+ * @param limit Rates and bursts of the bucket
+ * @param now Current time
+ * @return 1 if a call may be taken from it, 0 if it has run out
+ */
+static int refill_bucket(struct bucket *bucket, const rpc_rate_limit *limit, uint64_t now) {
+
+    if (bucket->updated == 0) {
+        bucket->calls = limit->call_burst;
+        bucket->bytes = limit->byte_burst;
+    } else {
+        double elapsed = (now - bucket->updated) / 1e9;
+        bucket->calls += elapsed * limit->calls_per_sec;
+        if (bucket->calls > limit->call_burst) {
+            bucket->calls = limit->call_burst;
+        }
+        bucket->bytes += elapsed * limit->bytes_per_sec;
+        if (bucket->bytes > limit->byte_burst) {
+            bucket->bytes = limit->byte_burst;
+        }
+    }
+    bucket->updated = now;
+
+    // a payload may take more bytes than are left, leaving the bucket owing them until it refills
+    return (!limit->calls_per_sec || bucket->calls >= 1) && (!limit->bytes_per_sec || bucket->bytes > 0);
+}
+
+
+/**
+ * Takes a call from a bucket
+ *
+ * @param bucket Bucket to be taken from
+ * @param bytes Size of the call's payload
+ */
+static void charge_bucket(struct bucket *bucket, size_t bytes) {
+
+    bucket->calls -= 1;
+    bucket->bytes -= (double) bytes;
+}
+
+
+/**
+ * Finds the buckets shared by the connections from a connection's peer address, creating them for a new
+ * peer. Peers without connections whose buckets would have refilled are forgotten along the way
+ *
+ * @param srv Server the connection was accepted by
+ * @param connectfd Socket of the connection, -1 for a client in the same process, all of which share the
+ * unspecified address
+ * @return Peer holding a reference for the connection, NULL on failure
+ */
+static struct peer *find_peer(rpc_server *srv, int connectfd) {
+
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    struct in6_addr key;
+    memset(&key, 0, sizeof(key));
+    if (getpeername(connectfd, (struct sockaddr *) &addr, &len) == 0) {
+        if (addr.ss_family == AF_INET6) {
+            key = ((struct sockaddr_in6 *) &addr)->sin6_addr;
+        } else if (addr.ss_family == AF_INET) {
+            // an IPv4 address is kept in its IPv6-mapped form, as IPv6 sockets report it
+            key.s6_addr[10] = 0xff;
+            key.s6_addr[11] = 0xff;
+            memcpy(&key.s6_addr[12], &((struct sockaddr_in *) &addr)->sin_addr, 4);
+        }
+    }
+    struct peer **link = &srv->peers[crc32c(0, &key, sizeof(key)) % PEER_BUCKETS];
+    uint64_t now = now_ns();
+
+    pthread_mutex_lock(&srv->peers_lock);
+    struct peer *found = NULL;
+    while (*link) {
+        struct peer *peer = *link;
+        int same = memcmp(&peer->addr, &key, sizeof(key)) == 0;
+        if (!same && peer->refs == 0 && now - peer->released > srv->peer_linger) {
+            *link = peer->next;
+            free(peer);
+            continue;
+        }
+        if (same) {
+            found = peer;
+        }
+        link = &peer->next;
+    }
+    if (!found && (found = calloc(1, sizeof(*found) + srv->num_limits * sizeof(*found->buckets)))) {
+        found->addr = key;
+        *link = found;
+    }
+    if (found) {
+        found->refs++;
+    }
+    pthread_mutex_unlock(&srv->peers_lock);
+
+    return found;
+}
+
+
+/**
+ * Drops a connection's reference to its peer, which is remembered for a while afterwards so that
+ * reconnecting does not refill its buckets
+ *
+ * @param srv Server the connection was accepted by
+ * @param peer Peer of the connection, or NULL
+ */
+static void release_peer(rpc_server *srv, struct peer *peer) {
+
+    if (peer == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&srv->peers_lock);
+    peer->refs--;
+    peer->released = now_ns();
+    pthread_mutex_unlock(&srv->peers_lock);
+}
+
+
+/**
+ * Reads the server's load counters, summed across cores
+ *
+ * @param srv Server data
+ * @param stats Buffer to be filled
+ */
+void rpc_get_stats(rpc_server *srv, rpc_server_stats *stats) {
+
+    if (srv == NULL || stats == NULL) {
+        error_print(INVALID_ARGUMENTS);
+        return;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < srv->num_loads; i++) {
+        struct load *load = &srv->loads[i];
+        stats->connections += atomic_load_explicit(&load->connections, memory_order_relaxed);
+        stats->inflight += atomic_load_explicit(&load->inflight, memory_order_relaxed);
+        stats->queued_bytes += atomic_load_explicit(&load->queued_bytes, memory_order_relaxed);
+        stats->shed_calls += atomic_load_explicit(&load->shed_calls, memory_order_relaxed);
+        stats->shed_connections += atomic_load_explicit(&load->shed_connections, memory_order_relaxed);
+        stats->expired_calls += atomic_load_explicit(&load->expired_calls, memory_order_relaxed);
+        stats->rejected_payloads += atomic_load_explicit(&load->rejected_payloads, memory_order_relaxed);
+        stats->idle_closed += atomic_load_explicit(&load->idle_closed, memory_order_relaxed);
+        stats->coalesced_calls += atomic_load_explicit(&load->coalesced_calls, memory_order_relaxed);
+        stats->corrupt_frames += atomic_load_explicit(&load->corrupt_frames, memory_order_relaxed);
+        stats->throttled_calls += atomic_load_explicit(&load->throttled_calls, memory_order_relaxed);
+    }
+    stats->payload_memory = atomic_load_explicit(&srv->payload_memory, memory_order_relaxed);
+    stats->capture_dropped = srv->capture ? capture_dropped(srv->capture) : 0;
+}
+
+
+/**
+ * Finds a procedure on the server given a name
+ *
+ * @param cl Client data
+ * @param name Query name
+ * @return A handle containing the unique procedure ID upon success, NULL on failure
+ */
+rpc_handle *rpc_find(rpc_client *cl, char *name) {
+
+    if (cl == NULL || name == NULL) {
+        error_print(INVALID_ARGUMENTS);
+        return NULL;
+    } else if (!is_valid_name(name) || strlen(name) > MAX_NAME_LEN) {
+        error_print(INVALID_NAME);
+        return NULL;
+    }
+
+    struct response res;
+    rpc_handle *handle = NULL;
+    uint32_t call_id = next_call_id(cl);
+    cl->status = RPC_ERROR;
+
+    if (cl->rejected) {
+        cl->status = RPC_BUSY;
+        return NULL;
+    } else if (cl->stream) {
+        error_print(INVALID_ARGUMENTS);
+        return NULL;
+    }
+
+    // send type of request (find)
+    size_t frame = buffer_length(cl->out);
+    if (encode_flag(cl->out, FIND) == -1
+        || encode_id(cl->out, cl->version, call_id) == -1
+        // send function name to server
+        || encode_string(cl->out, cl->version, name) == -1
+        || (cl->checksums && encode_checksum(cl->out, frame_checksum(cl->out, frame, NULL)) == -1)
+        || client_flush(cl, 0) == -1
+        // receive whether procedure was found, along with its id if so
+        || client_receive(cl, call_id, &res, 0) == -1) {
+
+        return NULL;
+
+    }
+    if (res.status == BUSY || res.status == CORRUPT) {
+        cl->status = res.status == BUSY ? RPC_BUSY : RPC_CORRUPT;
+        return NULL;
+    } else if (res.status != FOUND) {
+        cl->status = RPC_NOT_FOUND;
+        return NULL;
+    }
+
+    // if data is found
+    handle = malloc(sizeof(*handle));
+    if (!handle) {
+        error_print(MEMORY_ALL0CATION);
+        return NULL;
+    }
+    handle->id = res.proc_id;
+    handle->name = NULL;
+    handle->ids = NULL;
+    handle->latencies = NULL;
+    cl->status = RPC_OK;
+
+    return handle;
+}
+
+
+/**
+ * Calls a given procedure from the server given an ID
+ *
+ * @param cl Client data
+ * @param h Handle containing ID
+ * @param payload Data to be send to server
+ * @return Output data from the procedure on success, NULL on failure
+ */
+rpc_data *rpc_call(rpc_client *cl, rpc_handle *h, rpc_data *payload) {
+
+    return take_result(cl, call_procedure(cl, h, payload, 0));
+}
+
+
+/**
+ * Calls a given procedure like rpc_call, but gives up once a deadline has passed. The deadline is sent
+ * along with the call so the server drops it without running the procedure if it expires while queued
+ *
+ * @param cl Client data
+ * @param h Handle containing ID
+ * @param payload Data to be send to server
+ * @param timeout_ms Milliseconds from now until the deadline, 0 for none
+ * @return Output data from the procedure on success, NULL on failure (RPC_TIMEOUT once the deadline passes)
+ */
+rpc_data *rpc_call_with_deadline(rpc_client *cl, rpc_handle *h, rpc_data *payload, int timeout_ms) {
+
+    if (timeout_ms < 0) {
+        error_print(INVALID_ARGUMENTS);
+        return NULL;
+    }
+
+    return take_result(cl, call_procedure(cl, h, payload, timeout_ms));
+}
+
+
+/**
+ * Calls a given procedure like rpc_call, but decodes the output into memory provided by the caller so
+ * that nothing is allocated
+ *
+ * @param cl Client data
+ * @param h Handle containing ID
+ * @param payload Data to be send to server
+ * @param out Set to the output, its data2 pointing into out_buf (NULL if empty)
+ * @param out_buf Buffer for the output's data2
+ * @param out_cap Size of out_buf
+ * @return 0 on success, -1 on failure (RPC_TOO_SMALL if out_buf cannot hold data2, whose size is then
+ * given by out->data2_len)
+ */
+int rpc_call_into(rpc_client *cl, rpc_handle *h, rpc_data *payload, rpc_data *out, void *out_buf,
+                  size_t out_cap) {
+
+    if (out == NULL || (out_cap > 0 && out_buf == NULL)) {
+        error_print(INVALID_ARGUMENTS);
+        return -1;
+    }
+    rpc_data *result = call_procedure(cl, h, payload, 0);
+    if (!result) {
+        return -1;
+    }
+
+    out->data1 = result->data1;
+    out->data2_len = result->data2_len;
+    out->data2 = NULL;
+    if (result->data2_len > out_cap) {
+        cl->status = RPC_TOO_SMALL;
+        return -1;
+    } else if (result->data2_len > 0) {
+        memcpy(out_buf, result->data2, result->data2_len);
+        out->data2 = out_buf;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Calls a streaming procedure, whose messages are then taken one at a time with rpc_stream_next
+ *
+ * @param cl Client data
+ * @param h Handle containing ID
+ * @param payload Data to be send to server
+ * @return Stream on success, NULL on failure
+ */
+rpc_stream *rpc_stream_call(rpc_client *cl, rpc_handle *h, rpc_data *payload) {
+
+    return open_stream(cl, h, payload, 0);
+}
+
+
+/**
+ * Calls an upload procedure, whose records are then sent one at a time with rpc_stream_send
+ *
+ * @param cl Client data
+ * @param h Handle containing ID
+ * @param payload Data to be send to server, given to the handler as its input
+ * @return Stream on success, NULL on failure
+ */
+rpc_stream *rpc_stream_open(rpc_client *cl, rpc_handle *h, rpc_data *payload) {
+
+    return open_stream(cl, h, payload, 1);
+}
+
+
+/**
+ * Starts a streaming call of either direction
+ *
+ * @param cl Client data
+ * @param h Handle containing ID
+ * @param payload Data to be send to server
+ * @param upload 1 if the client sends records, 0 if it takes messages
+ * @return Stream on success, NULL on failure
+ */
+static rpc_stream *open_stream(rpc_client *cl, rpc_handle *h, rpc_data *payload, int upload) {
+
+    if (cl == NULL || h == NULL || payload == NULL) {
+        error_print(INVALID_ARGUMENTS);
+        return NULL;
+    }
+    cl->status = RPC_ERROR;
+
+    // checks for consistent data
+    if ((payload->data2 && !payload->data2_len) || (!payload->data2 && payload->data2_len)) {
+        error_print(INCONSISTENT_DATA);
+        return NULL;
+    }
+    rpc_stream *stream = malloc(sizeof(*stream));
+    if (!stream) {
+        error_print(MEMORY_ALL0CATION);
+        return NULL;
+    }
+    if (send_call(cl, h, payload, 0, &stream->call_id) == -1) {
+        free(stream);
+        return NULL;
+    }
+    stream->client = cl;
+    stream->upload = upload;
+    stream->consumed = 0;
+    stream->credit = STREAM_WINDOW;
+    stream->done = 0;
+    stream->result = NULL;
+    stream->status = RPC_OK;
+    cl->stream = stream;
+    cl->status = RPC_OK;
+
+    return stream;
+}
+
+
+/**
+ * Waits for the next message of a stream. Credit for more messages is handed back as they are taken, so
+ * the server never has more than a window of them outstanding, for the stream or the connection
+ *
+ * @param stream Stream to be read
+ * @return Next message on success, NULL once the stream has ended (status RPC_OK) or on failure
+ */
+rpc_data *rpc_stream_next(rpc_stream *stream) {
+
+    if (stream == NULL || stream->upload) {
+        error_print(INVALID_ARGUMENTS);
+        return NULL;
+    } else if (stream->done) {
+        return NULL;
+    }
+    rpc_client *cl = stream->client;
+    struct response *res = &cl->response;
+    cl->status = RPC_ERROR;
+
+    if (client_receive(cl, stream->call_id, res, 0) == -1) {
+        stream->done = 1;
+        return NULL;
+    } else if (res->status == END) {
+        stream->done = 1;
+        cl->status = RPC_OK;
+        return NULL;
+    } else if (res->status != MESSAGE) {
+        stream->done = 1;
+        return call_output(cl);
+    }
+
+    // the message is copied before credit is handed back, as the server may then send more
+    cl->status = RPC_OK;
+    rpc_data *message = take_result(cl, &res->data);
+    if (!message) {
+        return NULL;
+    }
+    size_t cost = message->data2_len + FRAME_COST;
+    int s = 0;
+    stream->consumed += cost;
+    if (stream->consumed >= STREAM_WINDOW / 2) {
+        s = send_control(cl, CREDIT, stream->call_id, stream->consumed, 0);
+        stream->consumed = 0;
+    }
+    if (s == -1 || client_consumed(cl, cost, 0) == -1) {
+        stream->done = 1;
+        cl->status = RPC_ERROR;
+        rpc_data_free(message);
+        return NULL;
+    }
+
+    return message;
+}
+
+
+/**
+ * Sends a record of an upload, first waiting until the server has room for all of it in both the upload's
+ * window and the connection's
+ *
+ * @param stream Upload to be sent on
+ * @param record Record to be sent
+ * @return 0 on success, -1 on failure (RPC_TOO_LARGE for a record costing over MAX_RECORD_COST, or once the
+ * server has answered early, the answer then being given by rpc_stream_close_and_recv)
+ */
+int rpc_stream_send(rpc_stream *stream, rpc_data *record) {
+
+    if (stream == NULL || record == NULL || !stream->upload || stream->done) {
+        error_print(INVALID_ARGUMENTS);
+        return -1;
+    }
+    rpc_client *cl = stream->client;
+    cl->status = RPC_ERROR;
+
+    // checks for consistent data
+    if ((record->data2 && !record->data2_len) || (!record->data2 && record->data2_len)) {
+        error_print(INCONSISTENT_DATA);
+        return -1;
+    }
+    long cost = (long) (record->data2_len + FRAME_COST);
+    if (cost > MAX_RECORD_COST) {
+        cl->status = RPC_TOO_LARGE;
+        return -1;
+    }
+    while (stream->credit < cost || cl->send_credit < cost) {
+        if (await_credit(stream) == -1) {
+            return -1;
+        }
+    }
+
+    size_t frame = buffer_length(cl->out);
+    if (encode_flag(cl->out, RECORD) == -1
+        || encode_id(cl->out, cl->version, stream->call_id) == -1
+        || encode_data(cl->out, cl->version, record) == -1
+        || client_send(cl, frame, record, 0) == -1) {
+
+        stream->done = 1;
+        return -1;
+
+    }
+    stream->credit -= cost;
+    cl->send_credit -= cost;
+    cl->status = RPC_OK;
+
+    return 0;
+}
+
+
+/**
+ * Ends an upload and waits for the server's answer
+ *
+ * @param stream Upload to be closed, freed along with it
+ * @return Output data from the procedure on success, NULL on failure
+ */
+rpc_data *rpc_stream_close_and_recv(rpc_stream *stream) {
+
+    if (stream == NULL || !stream->upload) {
+        error_print(INVALID_ARGUMENTS);
+        return NULL;
+    }
+    rpc_client *cl = stream->client;
+    cl->status = RPC_ERROR;
+
+    if (!stream->done && send_control(cl, END, stream->call_id, 0, 0) == 0) {
+        // credit still on its way is skipped
+        while (await_credit(stream) == 0);
+    }
+    rpc_data *result = stream->result;
+    cl->status = stream->result || stream->status != RPC_OK ? stream->status : RPC_ERROR;
+    cl->stream = NULL;
+    free(stream);
+
+    return result;
+}
+
+
+/**
+ * Closes a stream without waiting for the rest of it, telling the server to give up on it if it has not
+ * ended. Messages or an answer already sent are dropped by the client, which may then make other
+ * requests
+ *
+ * @param stream Stream to be closed
+ */
+void rpc_stream_close(rpc_stream *stream) {
+
+    if (stream == NULL) {
+        return;
+    }
+    // a failure to send is noticed by the client's next request
+    if (!stream->done) {
+        send_control(stream->client, CANCEL, stream->call_id, 0, 0);
+    }
+    stream->client->stream = NULL;
+    rpc_data_free(stream->result);
+    free(stream);
+}
+
+
+/**
+ * Waits for credit to send more of an upload's records, for the upload or the connection. The server's
+ * answer may arrive instead, which is kept for rpc_stream_close_and_recv and ends the upload
+ *
+ * @param stream Upload being sent
+ * @return 0 once credit has arrived, -1 once the upload has ended or on failure
+ */
+static int await_credit(rpc_stream *stream) {
+
+    rpc_client *cl = stream->client;
+
+    if (client_receive(cl, stream->call_id, &cl->response, 0) == -1) {
+        stream->done = 1;
+        stream->status = RPC_ERROR;
+        return -1;
+    } else if (cl->response.status == CREDIT) {
+        // the connection's credit has already been counted
+        if (cl->response.call_id == stream->call_id) {
+            stream->credit += (long) cl->response.credit;
+        }
+        return 0;
+    }
+
+    stream->done = 1;
+    stream->result = take_result(cl, call_output(cl));
+    stream->status = cl->status;
+    cl->status = RPC_ERROR;
+    return -1;
+}
+
+
+/**
+ * Sends credit for a stream's messages or the connection's, the end of an upload's records, or tells the
+ * server to give up on a stream
+ *
+ * @param cl Client data
+ * @param type CREDIT, END or CANCEL
+ * @param call_id Id of the stream, CONNECTION_ID for credit for the connection
+ * @param credit Bytes the server may send on top of those outstanding, for CREDIT
+ * @param deadline Time to give up waiting, 0 for none
+ * @return 0 on success, -1 on failure
+ */
+static int send_control(rpc_client *cl, char type, uint32_t call_id, size_t credit, uint64_t deadline) {
+
+    size_t frame = buffer_length(cl->out);
+    if (encode_flag(cl->out, type) == -1
+        || encode_id(cl->out, cl->version, call_id) == -1
+        || (type == CREDIT && encode_size(cl->out, cl->version, credit) == -1)
+        || (cl->checksums && encode_checksum(cl->out, frame_checksum(cl->out, frame, NULL)) == -1)) {
+        return -1;
+    }
+
+    return client_flush(cl, deadline);
+}
+
+
+/**
+ * Counts bytes of messages taken or dropped against the connection's window, handing credit back to the
+ * server once half of it has been
+ *
+ * @param cl Client data
+ * @param bytes Bytes taken, including FRAME_COST for each message
+ * @param deadline Time to give up waiting, 0 for none
+ * @return 0 on success, -1 on failure
+ */
+static int client_consumed(rpc_client *cl, size_t bytes, uint64_t deadline) {
+
+    cl->recv_consumed += bytes;
+    if (cl->recv_consumed < CONNECTION_WINDOW / 2) {
+        return 0;
+    } else if (send_control(cl, CREDIT, CONNECTION_ID, cl->recv_consumed, deadline) == -1) {
+        return -1;
+    }
+    cl->recv_consumed = 0;
+
+    return 0;
+}
+
+
+/**
+ * Copies the output of a call out of the client's input buffer for the caller to keep
+ *
+ * @param cl Client data
+ * @param result Output decoded in place, NULL if the call failed
+ * @return Output data owned by the caller on success, NULL on failure
+ */
+static rpc_data *take_result(rpc_client *cl, rpc_data *result) {
+
+    if (!result) {
+        return NULL;
+    }
+    struct inline_data *copy = malloc(sizeof(*copy));
+    if (!copy) {
+        error_print(MEMORY_ALL0CATION);
+        cl->status = RPC_ERROR;
+        return NULL;
+    }
+    copy->data = *result;
+    if (own_payload(copy) == -1) {
+        error_print(MEMORY_ALL0CATION);
+        cl->status = RPC_ERROR;
+        free(copy);
+        return NULL;
+    }
+
+    return &copy->data;
+}
+
+
+/**
+ * Sends a call to the server and waits for its output, until an optional deadline
+ *
+ * @param cl Client data
+ * @param h Handle containing ID
+ * @param payload Data to be send to server
+ * @param timeout_ms Milliseconds until the deadline, 0 for none
+ * @return Output data from the procedure on success, still in the client's input buffer and valid until
+ * its next request, NULL on failure
+ */
+static rpc_data *call_procedure(rpc_client *cl, rpc_handle *h, rpc_data *payload, int timeout_ms) {
+
+    if (cl == NULL || h == NULL || payload == NULL) {
+        error_print(INVALID_ARGUMENTS);
+        return NULL;
+    }
+    cl->status = RPC_ERROR;
+
+    // checks for consistent data
+    if ((payload->data2 && !payload->data2_len) || (!payload->data2 && payload->data2_len)) {
+        error_print(INCONSISTENT_DATA);
+        return NULL;
+    }
+    uint64_t deadline = timeout_ms ? now_ns() + timeout_ms * 1000000ULL : 0;
+    uint32_t call_id;
+
+    // receive the consistency of the return data, followed by the data itself if consistent
+    if (send_call(cl, h, payload, deadline, &call_id) == -1
+        || client_receive(cl, call_id, &cl->response, deadline) == -1) {
+        // anything unsent goes out ahead of the next request, whose response is told apart by its id
+        if (cl->status == RPC_ERROR && errno == ETIMEDOUT) {
+            cl->status = RPC_TIMEOUT;
+        }
+        return NULL;
+    }
+
+    return call_output(cl);
+}
+
+
+/**
+ * Sends a call to the server without waiting for its output
+ *
+ * @param cl Client data
+ * @param h Handle containing ID
+ * @param payload Data to be send to server
+ * @param deadline Time the server has until, 0 for none
+ * @param call_id Set to the id of the call
+ * @return 0 on success, -1 on failure (errno is ETIMEDOUT if the deadline passed)
+ */
+static int send_call(rpc_client *cl, rpc_handle *h, rpc_data *payload, uint64_t deadline, uint32_t *call_id) {
+
+    if (cl->rejected) {
+        cl->status = RPC_BUSY;
+        return -1;
+    } else if (cl->stream) {
+        error_print(INVALID_ARGUMENTS);
+        return -1;
+    }
+    *call_id = next_call_id(cl);
+    // the server is told how long it has rather than when, as the clocks may differ
+    uint64_t now = now_ns();
+    size_t timeout_ms = deadline ? (deadline > now ? (deadline - now + 999999) / 1000000 : 1) : 0;
+
+    // send type of request
+    size_t frame = buffer_length(cl->out);
+    if (encode_flag(cl->out, CALL) == -1
+        || encode_id(cl->out, cl->version, *call_id) == -1
+        // send the procedure id
+        || encode_int(cl->out, cl->version, h->id) == -1
+        // send how long the server has to answer
+        || encode_size(cl->out, cl->version, timeout_ms) == -1
+        // send the payload
+        || encode_data(cl->out, cl->version, payload) == -1) {
+
+        return -1;
+
+    }
+
+    return client_send(cl, frame, payload, deadline);
+}
+
+
+/**
+ * Gives the output of the client's latest response, setting the status from it
+ *
+ * @param cl Client data
+ * @return Output data from the procedure on success, still in the client's input buffer and valid until
+ * its next request, NULL on failure
+ */
+static rpc_data *call_output(rpc_client *cl) {
+
+    struct response *res = &cl->response;
+
+    if (res->status != CONSISTENT) {
+        cl->status = res->status == BUSY ? RPC_BUSY : res->status == TIMEOUT ? RPC_TIMEOUT
+                     : res->status == TOO_LARGE ? RPC_TOO_LARGE : res->status == CORRUPT ? RPC_CORRUPT
+                     : res->status == THROTTLED ? RPC_THROTTLED : RPC_INCONSISTENT;
+        return NULL;
+    }
+    cl->status = RPC_OK;
+
+    return &res->data;
+}
+
+
+/**
+ * Takes the id for the client's next request, never the id reserved for the connection
+ *
+ * @param cl Client data
+ * @return Request id
+ */
+static uint32_t next_call_id(rpc_client *cl) {
+
+    if (cl->next_id == CONNECTION_ID) {
+        cl->next_id++;
+    }
+
+    return cl->next_id++;
+}
+
+
+/**
+ * Reads a response from the server, being its status and request id followed by a body depending on
+ * the status. A response whose checksum does not match is read as CORRUPT
+ *
+ * @param buf Buffer to be read from
+ * @param version Protocol version of the connection
+ * @param checksums Whether responses end with a checksum, which a HELLO never does
+ * @param res Buffer to store the response
+ * @return 1 on success, 0 if the response has not fully arrived, -1 on failure
+ */
+static int decode_response(buffer_t *buf, int version, int checksums, struct response *res) {
+
+    size_t start = buf->start;
+    int s;
+
+    if ((s = decode_flag(buf, &res->status)) > 0
+        && (s = decode_id(buf, res->status == HELLO ? PROTOCOL_FIXED : version, &res->call_id)) > 0) {
+        if (res->status == FOUND) {
+            s = decode_int(buf, version, (int *) &res->proc_id);
+        } else if (res->status == CONSISTENT || res->status == MESSAGE) {
+            s = decode_data(buf, version, &res->data);
+        } else if (res->status == HELLO) {
+            s = decode_size(buf, PROTOCOL_FIXED, &res->version);
+        } else if (res->status == CREDIT) {
+            s = decode_size(buf, version, &res->credit);
+        }
+    }
+    if (s > 0 && checksums && res->status != HELLO && (s = decode_checksum(buf, start)) == -1) {
+        error_print(CHECKSUM);
+        res->status = CORRUPT;
+        s = 1;
+    }
+    if (s == 0) {
+        buf->start = start;
+    }
+
+    return s;
+}
+
+
+/**
+ * Waits for the response to a request, dropping responses to calls the client gave up on
+ *
+ * @param cl Client data
+ * @param call_id Id of the request
+ * @param res Buffer to store the response
+ * @param deadline Time to give up waiting, 0 for none
+ * @return 0 on success, -1 on failure (errno is ETIMEDOUT if the deadline passed)
+ */
+static int client_receive(rpc_client *cl, uint32_t call_id, struct response *res, uint64_t deadline) {
+
+    while (1) {
+        int s = decode_response(cl->in, cl->version, cl->checksums, res);
+        if (s < 0) {
+            return -1;
+        } else if (s == 0) {
+            if (client_fill(cl, deadline) <= 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        if (res->status == CREDIT && res->call_id == CONNECTION_ID) {
+            // room to send more records, which only an upload waits on
+            cl->send_credit += (long) res->credit;
+            if (cl->stream && cl->stream->upload) {
+                return 0;
+            }
+            continue;
+        }
+        // anything else is the response to a call that was given up on, whose messages still count
+        // against the connection's window. The id of a corrupt response cannot be trusted
+        if (res->call_id == call_id || res->call_id == CONNECTION_ID || res->status == CORRUPT) {
+            return 0;
+        } else if (res->status == MESSAGE
+                   && client_consumed(cl, res->data.data2_len + FRAME_COST, deadline) == -1) {
+            return -1;
+        }
+    }
+}
+
+
+/**
+ * Reports the outcome of the client's most recent rpc_find or rpc_call, telling apart a server that is
+ * busy from other failures
+ *
+ * @param cl Client data
+ * @return Status of the last request
+ */
+rpc_status rpc_get_status(rpc_client *cl) {
+
+    if (cl == NULL) {
+        return RPC_ERROR;
+    }
+
+    return cl->status;
+}
+
+
+/**
+ * Sends a staged request along with its payload and checksum, waiting for room in the socket rather
+ * than reading a file region into memory
+ *
+ * @param cl Client data
+ * @param frame Number of bytes staged ahead of the request
+ * @param payload Payload whose header was just staged
+ * @param deadline Time to give up waiting, 0 for none
+ * @return 0 on success, -1 on failure (errno is ETIMEDOUT if the deadline passed)
+ */
+static int client_send(rpc_client *cl, size_t frame, rpc_data *payload, uint64_t deadline) {
+
+    // worked out before any of the request is sent
+    uint32_t crc = cl->checksums ? frame_checksum(cl->out, frame, payload) : 0;
+
+    // without a socket a file region is read in like any other payload
+    if (payload->data2 != &file_payload || cl->loop) {
+        if (send_data(cl->out, cl->sockfd, payload) == -1
+            || (cl->checksums && encode_checksum(cl->out, crc) == -1)) {
+            return -1;
+        }
+        return client_flush(cl, deadline);
+    }
+
+    struct file_data *file = (struct file_data *) payload;
+    struct pollfd pfd = {.fd = cl->sockfd, .events = POLLOUT};
+    off_t offset = file->offset;
+    size_t len = payload->data2_len;
+
+    while (1) {
+        if (buffer_send_file(cl->out, cl->sockfd, file->fd, &offset, &len) == -1) {
+            error_print(NETWORK_FAIL);
+            return -1;
+        } else if (len == 0) {
+            if (!cl->checksums) {
+                return 0;
+            }
+            return encode_checksum(cl->out, crc) == -1 ? -1 : client_flush(cl, deadline);
+        }
+
+        // wait for room in the socket
+        uint64_t now = now_ns();
+        if (deadline && now >= deadline) {
+            // the rest of the request still has to go out ahead of the next one
+            if (buffer_read_file(cl->out, file->fd, offset, len) == -1
+                || (cl->checksums && encode_checksum(cl->out, crc) == -1)) {
+                error_print(NETWORK_FAIL);
+                return -1;
+            }
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        poll(&pfd, 1, deadline ? (int) ((deadline - now + 999999) / 1000000) : -1);
+    }
+}
+
+
+/**
+ * Sends everything the client has staged to the server
+ *
+ * @param cl Client data
+ * @param deadline Time to give up waiting, 0 for none
+ * @return 0 on success, -1 on failure (errno is ETIMEDOUT if the deadline passed)
+ */
+static int client_flush(rpc_client *cl, uint64_t deadline) {
+
+    struct pollfd pfd = {.fd = cl->sockfd, .events = POLLOUT};
+
+    if (cl->loop) {
+        if (channel_write(cl->loop->to_server, cl->out, deadline) == -1) {
+            if (errno == EAGAIN) {
+                errno = ETIMEDOUT;
+            } else if (errno == EPIPE) {
+                // the server end has been released
+                error_print(CONNECTION_LOST);
+            } else {
+                error_print(NETWORK_FAIL);
+            }
+            return -1;
+        }
+        return 0;
+    }
+
+    while (buffer_length(cl->out) > 0) {
+        if (buffer_write_fd(cl->out, cl->sockfd) >= 0 || errno == EINTR) {
+            continue;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            error_print(NETWORK_FAIL);
+            return -1;
+        }
+
+        // wait for room in the socket
+        uint64_t now = now_ns();
+        if (deadline && now >= deadline) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        poll(&pfd, 1, deadline ? (int) ((deadline - now + 999999) / 1000000) : -1);
+    }
+
+    return 0;
+}
+
+
+/**
+ * Waits for more data from the server
+ *
+ * @param cl Client data
+ * @param deadline Time to give up waiting, 0 for none
+ * @return Number of bytes read on success, 0 if the connection was lost, -1 on failure (errno is
+ * ETIMEDOUT if the deadline passed)
+ */
+static int client_fill(rpc_client *cl, uint64_t deadline) {
+
+    struct pollfd pfd = {.fd = cl->sockfd, .events = POLLIN};
+    ssize_t n;
+
+    if (cl->loop && (n = channel_read(cl->loop->to_client, cl->in, deadline)) < 0) {
+        if (errno == EAGAIN) {
+            errno = ETIMEDOUT;
+        } else {
+            error_print(NETWORK_FAIL);
+        }
+        return -1;
+    }
+    while (!cl->loop && (n = buffer_read_fd(cl->in, cl->sockfd)) < 0) {
+        if (errno == EINTR) {
+            continue;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            error_print(NETWORK_FAIL);
+            return -1;
+        }
+
+        // wait for the server to send more
+        uint64_t now = now_ns();
+        if (deadline && now >= deadline) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        poll(&pfd, 1, deadline ? (int) ((deadline - now + 999999) / 1000000) : -1);
+    }
+
+    if (n == 0) {
+        error_print(CONNECTION_LOST);
+    }
+
+    return n;
+}
+
+
+/**
+ * Reads the monotonic clock
+ *
+ * @return Current time in nanoseconds
+ */
+static uint64_t now_ns() {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/**
+ * Stages data to be sent to a host. Payloads of GATHER_MIN bytes or more, and file regions, are left
+ * where they are for send_data to send
+ *
+ * @param buf Buffer to be written to
+ * @param version Protocol version of the connection
+ * @param data Data to be sent
+ * @return 0 on success
+ */
+static int encode_data(buffer_t *buf, int version, rpc_data *data) {
+
+    struct iovec single;
+    const struct iovec *iov;
+    int count = payload_segments(data, &iov, &single);
+
+    // send data_1 int
+    if (encode_int(buf, version, data->data1) == -1
+        // send data_2_length
+        || encode_size(buf, version, data->data2_len) == -1) {
+
+        return -1;
+
+    }
+
+    // send data_2, small payloads are cheaper to copy than to gather
+    if (data->data2 != &file_payload && data->data2_len > 0 && data->data2_len < GATHER_MIN) {
+        for (int i = 0; i < count; i++) {
+            if (buffer_append(buf, iov[i].iov_base, iov[i].iov_len) == -1) {
+                error_print(MEMORY_ALL0CATION);
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+
+}
+
+
+/**
+ * Sends whatever is staged followed by a payload that encode_data left in place, gathering its segments
+ * into one sendmsg or sending a file region with sendfile. Anything the socket does not take is staged
+ * for the next flush, as is the whole payload of a connection without a socket
+ *
+ * @param buf Buffer holding the staged output
+ * @param fd Socket to be sent over, -1 for a connection in the same process
+ * @param data Data whose header was just staged
+ * @return 0 on success, -1 on failure
+ */
+static int send_data(buffer_t *buf, int fd, rpc_data *data) {
+
+    struct iovec single;
+    const struct iovec *iov;
+
+    if (fd < 0 && data->data2 == &file_payload) {
+        struct file_data *file = (struct file_data *) data;
+        if (buffer_read_file(buf, file->fd, file->offset, data->data2_len) == -1) {
+            error_print(NETWORK_FAIL);
+            return -1;
+        }
+        return 0;
+    } else if (fd < 0) {
+        if (data->data2_len < GATHER_MIN) {
+            return 0;
+        }
+        int count = payload_segments(data, &iov, &single);
+        for (int i = 0; i < count; i++) {
+            if (buffer_append(buf, iov[i].iov_base, iov[i].iov_len) == -1) {
+                error_print(MEMORY_ALL0CATION);
+                return -1;
+            }
+        }
+        return 0;
+    } else if (data->data2 == &file_payload) {
+        struct file_data *file = (struct file_data *) data;
+        off_t offset = file->offset;
+        size_t len = data->data2_len;
+        if (buffer_send_file(buf, fd, file->fd, &offset, &len) == -1
+            || (len > 0 && buffer_read_file(buf, file->fd, offset, len) == -1)) {
+
+            error_print(NETWORK_FAIL);
+            return -1;
+
+        }
+        return 0;
+    } else if (data->data2_len < GATHER_MIN) {
+        return 0;
+    }
+    int count = payload_segments(data, &iov, &single);
+    if (buffer_send_iov(buf, fd, iov, count) == -1) {
+        error_print(NETWORK_FAIL);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Works out the CRC32C of a frame being staged, including a payload that encode_data left in place
+ *
+ * @param buf Buffer the frame is staged in
+ * @param frame Number of bytes staged ahead of the frame
+ * @param data Data whose header was just staged, NULL if the frame has none
+ * @return Checksum of the frame
+ */
+static uint32_t frame_checksum(buffer_t *buf, size_t frame, rpc_data *data) {
+
+    uint32_t crc = crc32c(0, buf->data + buf->start + frame, buffer_length(buf) - frame);
+    if (!data || (data->data2 != &file_payload && data->data2_len < GATHER_MIN)) {
+        return crc;
+    }
+
+    if (data->data2 == &file_payload) {
+        // the file is read for its checksum, and still sent with sendfile
+        struct file_data *file = (struct file_data *) data;
+        char chunk[BUFFER_SIZE];
+        off_t offset = file->offset;
+        size_t left = data->data2_len;
+        while (left > 0) {
+            ssize_t n = pread(file->fd, chunk, left < sizeof(chunk) ? left : sizeof(chunk), offset);
+            if (n <= 0) {
+                // sending the region fails the same way
+                break;
+            }
+            crc = crc32c(crc, chunk, n);
+            offset += n;
+            left -= n;
+        }
+        return crc;
+    }
+    struct iovec single;
+    const struct iovec *iov;
+    int count = payload_segments(data, &iov, &single);
+    for (int i = 0; i < count; i++) {
+        crc = crc32c(crc, iov[i].iov_base, iov[i].iov_len);
+    }
+
+    return crc;
+}
+
+
+/**
+ * Adds the checksum that ends a frame
+ *
+ * @param buf Buffer to be written to
+ * @param crc Checksum of the frame
+ * @return 0 on success, -1 on failure
+ */
+static int encode_checksum(buffer_t *buf, uint32_t crc) {
+
+    uint32_t crc_n = htonl(crc);
+    if (buffer_append(buf, &crc_n, sizeof(crc_n)) == -1) {
+        error_print(MEMORY_ALL0CATION);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Reads the checksum ending a frame that has just been read and compares it with the frame's own
+ *
+ * @param buf Buffer the frame was read from
+ * @param frame Where the frame starts in the buffer
+ * @return 1 if they match, 0 if the checksum has not arrived yet, -1 if they do not match
+ */
+static int decode_checksum(buffer_t *buf, size_t frame) {
+
+    uint32_t crc_n;
+    if (buffer_length(buf) < sizeof(crc_n)) {
+        return 0;
+    }
+    uint32_t crc = crc32c(0, buf->data + frame, buf->start - frame);
+    memcpy(&crc_n, buf->data + buf->start, sizeof(crc_n));
+    buffer_consume(buf, sizeof(crc_n));
+
+    return ntohl(crc_n) == crc ? 1 : -1;
+}
+
+
+/**
+ * Reads data received from a host once it has all arrived. The payload is not copied, data2 points into
+ * the buffer until it is next read into (see own_payload)
+ *
+ * @param buf Buffer to be read from
+ * @param version Protocol version of the connection
+ * @param data RPC_data buffer to be read into
+ * @return 1 on success, 0 if the data has not fully arrived, -1 on failure
+ */
+static int decode_data(buffer_t *buf, int version, rpc_data *data) {
+
+    int s = decode_data_header(buf, version, data);
+    if (s <= 0) {
+        return s;
+    }
+
+    return decode_payload(buf, data);
+}
+
+
+/**
+ * Reads the fields of data received from a host that precede its payload, so the payload's size is known
+ * before any of it is waited for
+ *
+ * @param buf Buffer to be read from
+ * @param version Protocol version of the connection
+ * @param data RPC_data buffer to be read into
+ * @return 1 on success, 0 if the fields have not fully arrived, -1 on failure
+ */
+static int decode_data_header(buffer_t *buf, int version, rpc_data *data) {
+
+    int s;
+    // receiving data_1 int
+    s = decode_int(buf, version, &data->data1);
+    if (s <= 0) {
+        return s;
+    }
+
+    // receiving data_2 length
+    return decode_size(buf, version, &data->data2_len);
+}
+
+
+/**
+ * Reads the payload of data whose header has been read, leaving it where it is in the buffer
+ *
+ * @param buf Buffer to be read from
+ * @param data RPC_data whose header has been read
+ * @return 1 on success, 0 if the payload has not fully arrived
+ */
+static int decode_payload(buffer_t *buf, rpc_data *data) {
+
+    // receiving data_2
+    if (data->data2_len > 0) {
+        if (buffer_length(buf) < data->data2_len) {
+            return 0;
+        }
+        data->data2 = buf->data + buf->start;
+        buffer_consume(buf, data->data2_len);
+    } else {
+        data->data2 = NULL;
+    }
+
+    return 1;
+}
+
+
+/**
+ * Copies a payload decoded in place out of the buffer so that it outlives it, into the data's own inline
+ * storage if it fits and its own allocation otherwise
+ *
+ * @param owned Data whose payload is to be copied
+ * @return 0 on success, -1 on failure
+ */
+static int own_payload(struct inline_data *owned) {
+
+    rpc_data *data = &owned->data;
+    if (data->data2_len == 0) {
+        return 0;
+    }
+    if (data->data2_len <= INLINE_PAYLOAD) {
+        memcpy(owned->bytes, data->data2, data->data2_len);
+        data->data2 = owned->bytes;
+        return 0;
+    }
+    void *data2 = malloc(data->data2_len);
+    if (!data2) {
+        return -1;
+    }
+    memcpy(data2, data->data2, data->data2_len);
+    data->data2 = data2;
+
+    return 0;
+}
+
+
+/**
+ * Stages a string to be sent, preceded by its length
+ *
+ * @param buf Buffer to be written to
+ * @param version Protocol version of the connection
+ * @param str String to be sent
+ * @return 0 on success
+ */
+static int encode_string(buffer_t *buf, int version, char *str) {
+
+    size_t size = strlen(str);
+    if (encode_size(buf, version, size) == -1) {
+        return -1;
+    }
+    if (buffer_append(buf, str, size) == -1) {
+        error_print(MEMORY_ALL0CATION);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Reads a string, preceded by its length, that was received from a host
+ *
+ * @param buf Buffer to be read from
+ * @param version Protocol version of the connection
+ * @param str Buffer of MAX_NAME_LEN + 1 to store read string
+ * @return 1 on success, 0 if the string has not fully arrived, -1 on failure
+ */
+static int decode_string(buffer_t *buf, int version, char *str) {
+
+    size_t size;
+    int s = decode_size(buf, version, &size);
+    if (s <= 0) {
+        return s;
+    }
+    if (size > MAX_NAME_LEN) {
+        error_print(OVERLENGTH);
+        return -1;
+    }
+    if (buffer_length(buf) < size) {
+        return 0;
+    }
+
+    memcpy(str, buf->data + buf->start, size);
+    str[size] = '\0';
+    buffer_consume(buf, size);
+
+    return 1;
+}
+
+
+/**
+ * Stages size_t data to be sent
+ *
+ * @param buf Buffer to be written to
+ * @param version Protocol version of the connection
+ * @param size Data to be sent
+ * @return 0 on success
+ */
+static int encode_size(buffer_t *buf, int version, size_t size) {
+
+    // use 4 bytes since 100000 fits
+    if (size > UINT32_MAX) {
+        error_print(OVERLENGTH);
+        return -1;
+    }
+    if (version >= PROTOCOL_COMPACT) {
+        return encode_varint(buf, size);
+    }
+    uint32_t size_n = htonl((uint32_t) size);
+
+    if (buffer_append(buf, &size_n, sizeof(size_n)) == -1) {
+        error_print(MEMORY_ALL0CATION);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Reads size_t data received from a host
+ *
+ * @param buf Buffer to be read from
+ * @param version Protocol version of the connection
+ * @param size Buffer to be read into
+ * @return 1 on success, 0 if the data has not fully arrived, -1 on failure
+ */
+static int decode_size(buffer_t *buf, int version, size_t *size) {
+
+    uint32_t host_size;
+    if (version >= PROTOCOL_COMPACT) {
+        uint64_t value;
+        int s = decode_varint(buf, &value);
+        if (s <= 0) {
+            return s;
+        } else if (value > UINT32_MAX) {
+            error_print(OVERLENGTH);
+            return -1;
+        }
+        host_size = (uint32_t) value;
+    } else {
+        uint32_t message_size;
+        if (buffer_length(buf) < sizeof(message_size)) {
+            return 0;
+        }
+        memcpy(&message_size, buf->data + buf->start, sizeof(message_size));
+        buffer_consume(buf, sizeof(message_size));
+        host_size = ntohl(message_size);
+    }
+
+    // check if the valid received 32-bit data will fit within the size_t size of this host
+    if (host_size > SIZE_MAX) {
+        error_print(OVERLENGTH);
+        return -1;
+    }
+
+    *size = (size_t) host_size;
+
+    return 1;
+}
+
+
+/**
+ * Stages a request id to be sent
+ *
+ * @param buf Buffer to be written to
+ * @param version Protocol version of the connection
+ * @param id Id to be sent
+ * @return 0 on success
+ */
+static int encode_id(buffer_t *buf, int version, uint32_t id) {
+
+    if (version >= PROTOCOL_COMPACT) {
+        return encode_varint(buf, id);
+    }
+    uint32_t id_n = htonl(id);
+    if (buffer_append(buf, &id_n, sizeof(id_n)) == -1) {
+        error_print(MEMORY_ALL0CATION);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Reads a request id received from a host
+ *
+ * @param buf Buffer to be read from
+ * @param version Protocol version of the connection
+ * @param id Buffer to store read id
+ * @return 1 on success, 0 if the data has not fully arrived, -1 on failure
+ */
+static int decode_id(buffer_t *buf, int version, uint32_t *id) {
+
+    if (version >= PROTOCOL_COMPACT) {
+        uint64_t value;
+        int s = decode_varint(buf, &value);
+        if (s <= 0) {
+            return s;
+        } else if (value > UINT32_MAX) {
+            error_print(OVERLENGTH);
+            return -1;
+        }
+        *id = (uint32_t) value;
+        return 1;
+    }
+    uint32_t id_n;
+    if (buffer_length(buf) < sizeof(id_n)) {
+        return 0;
+    }
+    memcpy(&id_n, buf->data + buf->start, sizeof(id_n));
+    buffer_consume(buf, sizeof(id_n));
+    *id = ntohl(id_n);
+
+    return 1;
+}
+
+
+/**
+ * Stages an integer to be sent, always as 64 bits (zigzag encoded as a varint in compact headers)
+ *
+ * @param buf Buffer to be written to
+ * @param version Protocol version of the connection
+ * @param data Integer to be sent
+ * @return 0 on success
+ */
+static int encode_int(buffer_t *buf, int version, int data) {
+
+    if (version >= PROTOCOL_COMPACT) {
+        // small magnitudes of either sign become small varints
+        int64_t wide = data;
+        return encode_varint(buf, ((uint64_t) wide << 1) ^ (uint64_t) (wide >> 63));
+    }
+    uint64_t data_n = (uint64_t) htonll((int64_t) data);
+    if (buffer_append(buf, &data_n, sizeof(data_n)) == -1) {
+        error_print(MEMORY_ALL0CATION);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Reads an integer received from a host
+ *
+ * @param buf Buffer to be read from
+ * @param version Protocol version of the connection
+ * @param num Buffer to store read int
+ * @return 1 on success, 0 if the data has not fully arrived, -1 on failure
+ */
+static int decode_int(buffer_t *buf, int version, int *num) {
+
+    int64_t host_data;
+    if (version >= PROTOCOL_COMPACT) {
+        uint64_t value;
+        int s = decode_varint(buf, &value);
+        if (s <= 0) {
+            return s;
+        }
+        host_data = (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+    } else {
+        uint64_t data;
+        if (buffer_length(buf) < sizeof(data)) {
+            return 0;
+        }
+        memcpy(&data, buf->data + buf->start, sizeof(data));
+        buffer_consume(buf, sizeof(data));
+        host_data = (int64_t) ntohll(data);
+    }
+
+    // check if the valid received 64-bit data will fit within the int size of this host
+    if (host_data > INT_MAX || host_data < INT_MIN) {
+        error_print(OVERLENGTH);
+        return -1;
+    }
+
+    *num = (int) host_data;
+
+    return 1;
+}
+
+
+/**
+ * Stages an unsigned value as a LEB128 varint, 7 bits per byte with the top bit marking that more follow
+ *
+ * @param buf Buffer to be written to
+ * @param value Value to be sent
+ * @return 0 on success
+ */
+static int encode_varint(buffer_t *buf, uint64_t value) {
+
+    unsigned char bytes[MAX_VARINT_LEN];
+    size_t len = 0;
+
+    do {
+        bytes[len] = value & 0x7f;
+        value >>= 7;
+        if (value) {
+            bytes[len] |= 0x80;
+        }
+        len++;
+    } while (value);
+
+    if (buffer_append(buf, bytes, len) == -1) {
+        error_print(MEMORY_ALL0CATION);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Reads a LEB128 varint received from a host
+ *
+ * @param buf Buffer to be read from
+ * @param value Buffer to store read value
+ * @return 1 on success, 0 if the varint has not fully arrived, -1 if it is too long or overflows 64 bits
+ */
+static int decode_varint(buffer_t *buf, uint64_t *value) {
+
+    uint64_t result = 0;
+    size_t available = buffer_length(buf);
+
+    for (size_t i = 0; i < MAX_VARINT_LEN; i++) {
+        if (i == available) {
+            return 0;
+        }
+        unsigned char byte = (unsigned char) buf->data[buf->start + i];
+        // the last byte holds only the top bit
+        if (i == MAX_VARINT_LEN - 1 && byte > 1) {
+            break;
+        }
+        result |= (uint64_t) (byte & 0x7f) << (7 * i);
+        if (!(byte & 0x80)) {
+            buffer_consume(buf, i + 1);
+            *value = result;
+            return 1;
+        }
+    }
+
+    error_print(OVERLENGTH);
+    return -1;
+}
+
+
+/**
+ * Reads a character flag received from a host
+ *
+ * @param buf Buffer to be read from
+ * @param flag Buffer to read character
+ * @return 1 on success, 0 if nothing has arrived
+ */
+static int decode_flag(buffer_t *buf, char *flag) {
+
+    if (buffer_length(buf) < 1) {
+        return 0;
+    }
+    *flag = buf->data[buf->start];
+    buffer_consume(buf, 1);
+
+    return 1;
+}
+
+
+/**
+ * Stages a flag character to be sent
+ *
+ * @param buf Buffer to be written to
+ * @param flag Flag to send
+ * @return 0 on success
+ */
+static int encode_flag(buffer_t *buf, char flag) {
+
+    if (buffer_append(buf, &flag, sizeof(flag)) == -1) {
+        error_print(MEMORY_ALL0CATION);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Hash function for strings written by Daniel J. Bernstein
+ * Was taken from: https://theartincode.stanis.me/008-djb2/
+ *
+ * @param str String to be hashed
+ * @return Hash value
+ */
+static uint32_t hash_djb2(char* str) {
+
+    uint32_t hash = 5381;
+    int c;
+    while ((c = *str++)) {
+        hash = ((hash << 5) + hash) + c;
+    }
+    return hash;
+}
+
+
+/**
+ * Simply returns the inputted value
+ *
+ * @param num Number to be used as index
+ * @return Inputted number
+ */
+static uint32_t hash_int(uint32_t* num) {
+
+    return *num;
+}
+
+
+/**
+ * Generates a unique ID that is used as procedure ID's. Uses time and a counter to ensure uniqueness
+ *
+ * @return Generated ID
+ */
+static uint32_t generate_id() {
+
+    static uint32_t counter = 0;
+    time_t curr_time = time(NULL);
+    return (uint32_t) curr_time + counter++;
+}
+
+
+/**
+ * Integer comparison function that can be used for the hash table
+ *
+ * @param a First integer
+ * @param b Second integer
+ * @return Value depending on comparison
+ */
+int int_cmp(uint32_t *a, uint32_t *b) {
+
+    if (*a < *b) {
+        return -1;
+    } else if (*a > *b) {
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+
+/**
+ * Counts the cores this process may run on
+ *
+ * @return Number of cores, at least 1
+ */
+static int count_cpus() {
+
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0) {
+        return 1;
+    }
+
+    return CPU_COUNT(&allowed);
+}
+
+
+/**
+ * Pins the calling thread to a core, chosen by index from the cores this process may run on
+ *
+ * @param index Index of the thread, wraps around the available cores
+ * @return 0 on success
+ */
+static int pin_thread(int index) {
+
+    cpu_set_t allowed, target;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return -1;
+    }
+
+    int num_cpus = CPU_COUNT(&allowed);
+    if (num_cpus == 0) {
+        return -1;
+    }
+    index %= num_cpus;
+
+    // find the index-th allowed core
+    CPU_ZERO(&target);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && index-- == 0) {
+            CPU_SET(cpu, &target);
+            break;
+        }
+    }
+
+    return pthread_setaffinity_np(pthread_self(), sizeof(target), &target);
+}
+
+
+/**
+ * Checks if a given character is valid for a procedure name
+ *
+ * @param c Character to be checked
+ * @return Result of check
+ */
+static int is_valid_char(char c) {
+
+    return (c >= 32 && c <= 126);
+}
+
+
+/**
+ * Checks if a given name has all valid characters
+ *
+ * @param name Name to be checked
+ * @return Result of check
+ */
+static int is_valid_name(char *name) {
+
+    for (int i = 0; name[i] != '\0'; i++) {
+        // Check if the character is valid
+        if (!is_valid_char(name[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/**
+ * Prints an error message given an error code
+ *
+ * @param code Error code
+ */
+static void error_print(enum error_codes code) {
+
+    fprintf(stderr, "Error: %s\n", error_messages[code]);
+}
+
+
+/**
+ * Closes client socket and data
+ *
+ * @param cl Client to be closed
+ */
+void rpc_close_client(rpc_client *cl) {
+
+    if (cl) {
+        if (cl->loop) {
+            release_loopback(cl->loop);
+        } else {
+            close(cl->sockfd);
+        }
+        free_buffer(cl->in);
+        free_buffer(cl->out);
+        free(cl);
+        cl = NULL;
+    }
+
+}
+
+
+/**
+ * Fills cluster options with their default values (least outstanding, ejecting after 3 failures for 1s,
+ * hedging at the 95th percentile)
+ *
+ * @param opts Options to be initialised
+ */
+void rpc_cluster_opts_init(rpc_cluster_opts *opts) {
+
+    if (opts == NULL) {
+        return;
+    }
+    memset(opts, 0, sizeof(*opts));
+    opts->balance = RPC_BALANCE_LEAST_OUTSTANDING;
+    opts->eject_failures = DEFAULT_EJECT_FAILURES;
+    opts->eject_ms = DEFAULT_EJECT_MS;
+    opts->hedge_percentile = DEFAULT_HEDGE_PERCENTILE;
+}
+
+
+/**
+ * Initialises a client that balances calls across several servers, keeping connections to each. Every
+ * cluster function may be used from several threads at once
+ *
+ * @param addrs Address of each server
+ * @param ports Port number of each server
+ * @param num_servers Number of servers
+ * @param opts Cluster options, NULL for defaults
+ * @return Cluster data, NULL on failure
+ */
+rpc_cluster *rpc_init_cluster(char **addrs, int *ports, int num_servers, rpc_cluster_opts *opts) {
+
+    rpc_cluster_opts defaults;
+
+    if (opts == NULL) {
+        rpc_cluster_opts_init(&defaults);
+        opts = &defaults;
+    }
+    if (addrs == NULL || ports == NULL || num_servers < 1 || opts->eject_failures < 1 || opts->eject_ms < 0
+        || opts->hedge_percentile < 1 || opts->hedge_percentile > 99
+        || (opts->balance != RPC_BALANCE_LEAST_OUTSTANDING && opts->balance != RPC_BALANCE_P2C)) {
+        error_print(INVALID_ARGUMENTS);
+        return NULL;
+    }
+
+    struct rpc_cluster *cluster = malloc(sizeof(*cluster));
+    struct endpoint *endpoints = calloc(num_servers, sizeof(*endpoints));
+    if (!cluster || !endpoints) {
+        error_print(MEMORY_ALL0CATION);
+        free(cluster);
+        free(endpoints);
+        return NULL;
+    }
+    cluster->num_endpoints = num_servers;
+    cluster->endpoints = endpoints;
+    cluster->balance = opts->balance;
+    cluster->eject_failures = opts->eject_failures;
+    cluster->eject_ms = opts->eject_ms;
+    cluster->hedge_percentile = opts->hedge_percentile;
+    atomic_init(&cluster->next, 0);
+
+    // connections are only made once calls need them
+    for (int i = 0; i < num_servers; i++) {
+        struct endpoint *ep = &endpoints[i];
+        ep->addr = addrs[i] ? strdup(addrs[i]) : NULL;
+        ep->port = ports[i];
+        pthread_mutex_init(&ep->lock, NULL);
+        ep->idle = NULL;
+        ep->num_idle = 0;
+        ep->max_idle = 0;
+        atomic_init(&ep->outstanding, 0);
+        atomic_init(&ep->state, ENDPOINT_HEALTHY);
+        atomic_init(&ep->failures, 0);
+        atomic_init(&ep->ejections, 0);
+        atomic_init(&ep->ejected_until, 0);
+        atomic_init(&ep->generation, 1);
+        if (!ep->addr) {
+            error_print(addrs[i] ? MEMORY_ALL0CATION : INVALID_ARGUMENTS);
+            cluster->num_endpoints = i + 1;
+            rpc_close_cluster(cluster);
+            return NULL;
+        }
+    }
+
+    return cluster;
+}
+
+
+/**
+ * Finds a procedure on one of the cluster's servers given a name. Its id on each of the other servers is
+ * found on first use there
+ *
+ * @param cl Cluster data
+ * @param name Query name
+ * @return A handle usable only with this cluster, freed with free, NULL on failure
+ */
+rpc_handle *rpc_cluster_find(rpc_cluster *cl, char *name) {
+
+    if (cl == NULL || name == NULL) {
+        error_print(INVALID_ARGUMENTS);
+        return NULL;
+    } else if (!is_valid_name(name) || strlen(name) > MAX_NAME_LEN) {
+        error_print(INVALID_NAME);
+        return NULL;
+    }
+
+    // one allocation holding the latencies, ids and name, so the handle is freed like any other
+    size_t ids_size = cl->num_endpoints * sizeof(atomic_ullong);
+    rpc_handle *handle = malloc(sizeof(*handle) + sizeof(struct latencies) + ids_size + strlen(name) + 1);
+    if (!handle) {
+        error_print(MEMORY_ALL0CATION);
+        return NULL;
+    }
+    handle->id = 0;
+    handle->latencies = (struct latencies *) (handle + 1);
+    handle->ids = (atomic_ullong *) (handle->latencies + 1);
+    handle->name = (char *) handle->ids + ids_size;
+    strcpy(handle->name, name);
+    for (int i = 0; i < cl->num_endpoints; i++) {
+        atomic_init(&handle->ids[i], 0);
+    }
+    atomic_init(&handle->latencies->count, 0);
+    atomic_init(&handle->latencies->hedge_delay, 0);
+    for (int i = 0; i < LATENCY_SAMPLES; i++) {
+        atomic_init(&handle->latencies->samples[i], 0);
+    }
+
+    if (cluster_call(cl, handle, NULL, 0, 0, NULL, NULL) == -1) {
+        free(handle);
+        return NULL;
+    }
+
+    return handle;
+}
+
+
+/**
+ * Calls a given procedure on whichever server the cluster's balancing picks. A server that cannot be
+ * connected to is ejected and the call goes to another, other failures are not retried
+ *
+ * @param cl Cluster data
+ * @param h Handle from rpc_cluster_find
+ * @param payload Data to be send to server
+ * @param timeout_ms Milliseconds from now until the deadline, 0 for none
+ * @param status Set to the outcome of the call, may be NULL
+ * @return Output data from the procedure on success, NULL on failure
+ */
+rpc_data *rpc_cluster_call(rpc_cluster *cl, rpc_handle *h, rpc_data *payload, int timeout_ms,
+                           rpc_status *status) {
+
+    if (status) {
+        *status = RPC_ERROR;
+    }
+    if (cl == NULL || h == NULL || h->ids == NULL || payload == NULL || timeout_ms < 0) {
+        error_print(INVALID_ARGUMENTS);
+        return NULL;
+    }
+    // checked here so that a bad payload is not held against the server
+    if ((payload->data2 && !payload->data2_len) || (!payload->data2 && payload->data2_len)) {
+        error_print(INCONSISTENT_DATA);
+        return NULL;
+    }
+
+    rpc_data *result = NULL;
+    cluster_call(cl, h, payload, timeout_ms, 0, &result, status);
+
+    return result;
+}
+
+
+/**
+ * Calls a given idempotent procedure like rpc_cluster_call, but sends a second copy of the call to
+ * another server if the first has not answered once the hedge percentile of the procedure's recent
+ * latencies has passed. The first answer is used and the other is dropped when it arrives
+ *
+ * @param cl Cluster data
+ * @param h Handle from rpc_cluster_find
+ * @param payload Data to be send to server
+ * @param timeout_ms Milliseconds from now until the deadline, 0 for none
+ * @param status Set to the outcome of the call, may be NULL
+ * @return Output data from the procedure on success, NULL on failure
+ */
+rpc_data *rpc_cluster_call_hedged(rpc_cluster *cl, rpc_handle *h, rpc_data *payload, int timeout_ms,
+                                  rpc_status *status) {
+
+    if (status) {
+        *status = RPC_ERROR;
+    }
+    if (cl == NULL || h == NULL || h->ids == NULL || payload == NULL || timeout_ms < 0) {
+        error_print(INVALID_ARGUMENTS);
+        return NULL;
+    }
+    if ((payload->data2 && !payload->data2_len) || (!payload->data2 && payload->data2_len)) {
+        error_print(INCONSISTENT_DATA);
+        return NULL;
+    }
+
+    rpc_data *result = NULL;
+    cluster_call(cl, h, payload, timeout_ms, 1, &result, status);
+
+    return result;
+}
+
+
+/**
+ * Sends a call, or only finds its procedure, on a server picked by the cluster's balancing, hedging it
+ * with a second copy if asked to
+ *
+ * @param cl Cluster data
+ * @param h Handle from rpc_cluster_find
+ * @param payload Data to be send to server, NULL to only find the procedure
+ * @param timeout_ms Milliseconds from now until the deadline, 0 for none
+ * @param hedge Whether a second copy may be sent once the first is slower than usual
+ * @param result Set to the output data from the procedure, NULL when only finding
+ * @param status Set to the outcome of the call, may be NULL
+ * @return 0 on success, -1 on failure
+ */
+static int cluster_call(rpc_cluster *cl, rpc_handle *h, rpc_data *payload, int timeout_ms, int hedge,
+                        rpc_data **result, rpc_status *status) {
+
+    uint64_t start = now_ns();
+    uint64_t deadline = timeout_ms ? start + timeout_ms * 1000000ULL : 0;
+    struct leg legs[2];
+    int num_legs = 1, winner = 0;
+    rpc_status s;
+
+    if (start_leg(cl, h, payload, deadline, NULL, &legs[0], &s) == -1) {
+        if (status) {
+            *status = s;
+        }
+        return -1;
+    }
+
+    if (payload) {
+        uint64_t delay = hedge ? atomic_load_explicit(&h->latencies->hedge_delay, memory_order_relaxed) : 0;
+        uint64_t until = delay && (!deadline || start + delay < deadline) ? start + delay : deadline;
+
+        winner = await_legs(legs, 1, until);
+        // the first copy is slower than usual, so a second goes to another server and the first answer wins
+        if (winner == -1 && until != deadline && !legs[0].failed) {
+            if (start_leg(cl, h, payload, deadline, legs[0].ep, &legs[1], &s) == 0) {
+                num_legs = 2;
+            }
+            winner = await_legs(legs, num_legs, deadline);
+        }
+    }
 
-    // checks that the data is within the storage bounds
-    if (data <= INT64_MIN || data >= INT64_MAX) {
-        error_print(OVERLENGTH);
-        return -1;
+    s = legs[0].failed && (num_legs == 1 || legs[1].failed) ? RPC_ERROR : RPC_TIMEOUT;
+    for (int i = 0; i < num_legs; i++) {
+        rpc_client *client = legs[i].client;
+        if (i == winner) {
+            if (payload) {
+                *result = take_result(client, call_output(client));
+            }
+            s = client->status;
+        } else if (!legs[i].failed) {
+            // the copy that lost is cancelled by closing its connection, which would otherwise hold up the
+            // next call on it until the server got round to answering
+            client->status = RPC_TIMEOUT;
+            legs[i].abandoned = 1;
+        }
+        finish_leg(cl, &legs[i]);
     }
-    uint64_t data_n = (uint64_t) htonll(data);
-    ssize_t n = send(sockfd, &data_n, sizeof(data_n), 0);
-    if (n < 0) {
-        error_print(NETWORK_FAIL);
-        return -1;
+    if (payload && s == RPC_OK) {
+        record_latency(cl, h, now_ns() - start);
     }
 
-    return n;
+    if (status) {
+        *status = s;
+    }
+    return s == RPC_OK ? 0 : -1;
 }
 
 
 /**
- * Receives a string from a host given its size
+ * Starts a copy of a call on a server picked by the cluster's balancing. Servers that cannot be connected
+ * to are passed over, since nothing has been sent to them
  *
- * @param size Size of string
- * @param buffer Buffer to store read string
- * @param sockfd Socket to be read over
- * @return Number of bytes read on success
+ * @param cl Cluster data
+ * @param h Handle from rpc_cluster_find
+ * @param payload Data to be send to server, NULL to only find the procedure
+ * @param deadline Time to give up, 0 for none
+ * @param avoid Server to pass over unless it is the only one, NULL for none
+ * @param leg Set to the copy started
+ * @param status Set to the outcome on failure
+ * @return 0 on success, -1 on failure
  */
-static int recv_string(size_t size, char *buffer, int sockfd) {
-
-    size_t bytes_received = 0;
-    while (1) {
-        ssize_t n = recv(sockfd, buffer + bytes_received, size - bytes_received, 0);
-
-        if (n < 0) {
-            error_print(NETWORK_FAIL);
-            return -1;
-        } else if (n == 0) {
-            error_print(CONNECTION_LOST);
-            return n;
-        } else {
-            bytes_received += (size_t) n;
-            if (bytes_received == size) {
-                break;
+static int start_leg(rpc_cluster *cl, rpc_handle *h, rpc_data *payload, uint64_t deadline, struct endpoint *avoid,
+                     struct leg *leg, rpc_status *status) {
+
+    *status = RPC_ERROR;
+
+    for (int attempt = 0; attempt < cl->num_endpoints; attempt++) {
+        struct endpoint *ep = pick_endpoint(cl, avoid);
+        rpc_client *client = checkout_client(ep, status);
+        if (!client) {
+            if (*status == RPC_ERROR) {
+                eject_endpoint(cl, ep);
+            } else {
+                record_outcome(cl, ep, *status);
             }
+            atomic_fetch_sub_explicit(&ep->outstanding, 1, memory_order_relaxed);
+            continue;
         }
 
-    }
-    buffer[bytes_received] = '\0';
+        leg->ep = ep;
+        leg->client = client;
+        leg->failed = 0;
+        leg->abandoned = 0;
+        struct rpc_handle handle = {.id = 0, .name = NULL, .ids = NULL, .latencies = NULL};
+        if (resolve_id(cl, ep, client, h, &handle.id) == 0
+            && (!payload || send_call(client, &handle, payload, deadline, &leg->call_id) == 0)) {
+            return 0;
+        }
 
-    return bytes_received;
+        if (client->status == RPC_ERROR && errno == ETIMEDOUT) {
+            client->status = RPC_TIMEOUT;
+        }
+        *status = client->status;
+        finish_leg(cl, leg);
+        return -1;
+    }
 
+    return -1;
 }
 
 
 /**
- * Receives size_t data from a host
+ * Waits for the response to any copy of a call, until a given time. Copies whose connection fails are
+ * marked as failed
  *
- * @param sockfd Socket to be read over
- * @param size Buffer to be read into
- * @return Number of bytes read on success
+ * @param legs Copies of the call
+ * @param num_legs Number of copies
+ * @param until Time to stop waiting, 0 for never
+ * @return Index of the copy answered, -1 if none was before the time or every copy failed
  */
-static int recv_size(int sockfd, size_t *size) {
+static int await_legs(struct leg *legs, int num_legs, uint64_t until) {
 
-    uint32_t message_size = 0;
-    size_t bytes_received = 0;
-    size_t s_size = sizeof(uint32_t);
-    uint32_t host_size;
-    while (1) {
-        ssize_t n = recv(sockfd, &message_size + bytes_received, s_size - bytes_received, 0);
+    struct pollfd pfds[2];
 
-        if (n < 0) {
-            error_print(NETWORK_FAIL);
-            return -1;
-        } else if (n == 0) {
-            error_print(CONNECTION_LOST);
-            return n;
-        } else {
-            bytes_received += (size_t) n;
-            if (bytes_received == s_size) {
-                break;
+    while (1) {
+        int waiting = 0;
+        for (int i = 0; i < num_legs; i++) {
+            if (legs[i].failed) {
+                continue;
             }
+            int s = client_take_response(legs[i].client, legs[i].call_id, &legs[i].client->response);
+            if (s == 1) {
+                return i;
+            } else if (s == -1) {
+                legs[i].failed = 1;
+                legs[i].client->status = RPC_ERROR;
+                continue;
+            }
+            pfds[waiting].fd = legs[i].client->sockfd;
+            pfds[waiting].events = POLLIN;
+            waiting++;
         }
 
+        uint64_t now = now_ns();
+        if (waiting == 0 || (until && now >= until)) {
+            return -1;
+        }
+        poll(pfds, waiting, until ? (int) ((until - now + 999999) / 1000000) : -1);
     }
+}
 
-    // check if the valid received 32-bit data will fit within the size_t size of this host
-    host_size = ntohl(message_size);
-    if (host_size > SIZE_MAX) {
-        error_print(OVERLENGTH);
-        return -1;
-    }
 
-    *size = (size_t) host_size;
+/**
+ * Gives back the connection of a copy of a call, or closes it if the copy was abandoned, recording the
+ * outcome against its server
+ *
+ * @param cl Cluster data
+ * @param leg Copy of the call
+ */
+static void finish_leg(rpc_cluster *cl, struct leg *leg) {
 
-    return bytes_received;
+    rpc_status status = leg->client->status;
 
+    if (leg->abandoned) {
+        rpc_close_client(leg->client);
+    } else {
+        checkin_client(leg->ep, leg->client);
+    }
+    record_outcome(cl, leg->ep, status);
+    atomic_fetch_sub_explicit(&leg->ep->outstanding, 1, memory_order_relaxed);
 }
 
 
 /**
- * Receives data from a host
+ * Reads whatever the server has sent without waiting, decoding the response to a call if it has all
+ * arrived. Responses to other calls are dropped
  *
- * @param sockfd Socket to be read over
- * @param buffer RPC_data buffer to be read into
- * @return
+ * @param cl Client data
+ * @param call_id Id of the call
+ * @param res Buffer to store the response
+ * @return 1 once the response has arrived, 0 if it has not yet, -1 on failure
  */
-static int recv_data(int sockfd, rpc_data *buffer) {
-
-    int s;
-    // receiving data_1 int
-    s = recv_int(sockfd, &buffer->data1);
-    if (s <= 0) {
-        return s;
-    }
+static int client_take_response(rpc_client *cl, uint32_t call_id, struct response *res) {
 
-    // receiving data_2 length
-    s = recv_size(sockfd, &buffer->data2_len);
-    if (s <= 0) {
-        return s;
-    }
-
-    // receiving data_2
-    if (buffer->data2_len > 0) {
-        buffer->data2 = malloc(buffer->data2_len);
-        if (!buffer->data2) {
-            error_print(MEMORY_ALL0CATION);
+    while (1) {
+        int s = decode_response(cl->in, cl->version, cl->checksums, res);
+        if (s < 0) {
             return -1;
+        } else if (s == 1) {
+            if (res->call_id == call_id || res->call_id == CONNECTION_ID || res->status == CORRUPT) {
+                return 1;
+            }
+            continue;
         }
 
-        s = recv_void(sockfd, buffer->data2_len, buffer->data2);
-        if (s <= 0) {
-            return s;
+        ssize_t n = buffer_read_fd(cl->in, cl->sockfd);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        } else if (n <= 0) {
+            error_print(n == 0 ? CONNECTION_LOST : NETWORK_FAIL);
+            return -1;
         }
-    } else {
-        buffer->data2 = NULL;
     }
+}
 
 
+/**
+ * Records how long a call to a cluster's procedure took, working out the delay before hedging its calls
+ * again every so often
+ *
+ * @param cl Cluster data
+ * @param h Handle of the procedure
+ * @param latency Nanoseconds the call took
+ */
+static void record_latency(rpc_cluster *cl, rpc_handle *h, uint64_t latency) {
+
+    struct latencies *latencies = h->latencies;
+    unsigned int count = atomic_fetch_add_explicit(&latencies->count, 1, memory_order_relaxed) + 1;
+    uint64_t us = latency / 1000;
+    atomic_store_explicit(&latencies->samples[(count - 1) % LATENCY_SAMPLES],
+                          us > UINT_MAX ? UINT_MAX : (unsigned int) us, memory_order_relaxed);
+    if (count % HEDGE_SAMPLES != 0) {
+        return;
+    }
 
-    return 1;
+    unsigned int samples[LATENCY_SAMPLES];
+    int n = count < LATENCY_SAMPLES ? (int) count : LATENCY_SAMPLES;
+    for (int i = 0; i < n; i++) {
+        samples[i] = atomic_load_explicit(&latencies->samples[i], memory_order_relaxed);
+    }
+    qsort(samples, n, sizeof(*samples), compare_latency);
+    atomic_store_explicit(&latencies->hedge_delay, samples[(n - 1) * cl->hedge_percentile / 100] * 1000ULL,
+                          memory_order_relaxed);
 }
 
 
 /**
- * Receives the void pointed to data from rpc_data from a host
+ * Latency comparison function for sorting
  *
- * @param sockfd Socket to be read over
- * @param size Size of this void pointed to data
- * @param data Buffer to read data into
- * @return Number of bytes read on success
+ * @param a First latency
+ * @param b Second latency
+ * @return Value depending on comparison
  */
-static int recv_void(int sockfd, size_t size, void *data) {
-
-    size_t bytes_received = 0;
-    while(1) {
-        ssize_t n = recv(sockfd, data + bytes_received, size - bytes_received, 0);
-        if (n < 0) {
-            error_print(NETWORK_FAIL);
-            return -1;
-        } else if (n == 0) {
-            error_print(CONNECTION_LOST);
-            return n;
-        } else {
-            bytes_received += (size_t) n;
-            if (bytes_received == size) {
-                break;
-            }
-        }
-    }
+static int compare_latency(const void *a, const void *b) {
 
+    unsigned int x = *(const unsigned int *) a, y = *(const unsigned int *) b;
 
-    return bytes_received;
+    return x < y ? -1 : x > y;
 }
 
 
 /**
- * Receives an integer from a host
+ * Picks the server for a call by the cluster's policy among those not ejected, counting the call as
+ * outstanding on it. An ejected server that has sat out long enough is picked to be probed, and when
+ * every server is ejected the least loaded is picked regardless
  *
- * @param sockfd Socket to be read over
- * @param num Buffer to store read int
- * @return Number of bytes read on success
+ * @param cl Cluster data
+ * @param avoid Server to pass over unless it is the only one, NULL for none
+ * @return Server picked
  */
-static int recv_int(int sockfd, int *num) {
+static struct endpoint *pick_endpoint(rpc_cluster *cl, struct endpoint *avoid) {
 
-    size_t bytes_received = 0;
-    size_t int64_size = sizeof(uint64_t);
-    uint64_t data;
-    uint64_t host_data;
-    while (1) {
-        ssize_t n = recv(sockfd, &data + bytes_received, int64_size - bytes_received, 0);
+    static __thread unsigned int seed;
+    uint64_t now = now_ns();
+    int n = cl->num_endpoints;
+    struct endpoint *best = NULL;
 
-        if (n < 0) {
-            error_print(NETWORK_FAIL);
-            return -1;
-        } else if (n == 0) {
-            error_print(CONNECTION_LOST);
-            return n;
-        } else {
-            bytes_received += (size_t) n;
-            if (bytes_received == int64_size) {
+    if (cl->balance == RPC_BALANCE_P2C && n > 1) {
+        if (!seed) {
+            seed = (unsigned int) now ^ (unsigned int) (uintptr_t) &seed;
+        }
+        int i = rand_r(&seed) % n;
+        int j = (i + 1 + rand_r(&seed) % (n - 1)) % n;
+        struct endpoint *a = &cl->endpoints[i], *b = &cl->endpoints[j];
+        int usable_a = a == avoid ? 0 : claim_endpoint(a, now);
+        int usable_b = usable_a == 2 || b == avoid ? 0 : claim_endpoint(b, now);
+
+        if (usable_a == 2) {
+            best = a;
+        } else if (usable_b == 2) {
+            best = b;
+        } else if (usable_a && usable_b) {
+            best = atomic_load_explicit(&a->outstanding, memory_order_relaxed)
+                   <= atomic_load_explicit(&b->outstanding, memory_order_relaxed) ? a : b;
+        } else if (usable_a || usable_b) {
+            best = usable_a ? a : b;
+        }
+    }
+
+    // least outstanding, which P2C also falls back on when both of its choices are ejected
+    int start = atomic_fetch_add_explicit(&cl->next, 1, memory_order_relaxed) % n;
+    if (!best) {
+        for (int i = 0; i < n; i++) {
+            struct endpoint *ep = &cl->endpoints[(start + i) % n];
+            int usable = ep == avoid ? 0 : claim_endpoint(ep, now);
+            if (usable == 2) {
+                best = ep;
                 break;
             }
+            if (usable && (!best || atomic_load_explicit(&ep->outstanding, memory_order_relaxed)
+                                    < atomic_load_explicit(&best->outstanding, memory_order_relaxed))) {
+                best = ep;
+            }
         }
-
     }
-    // check if the valid received 64-bit data will fit within the int size of this host
-    host_data = ntohll(data);
-    if ((int64_t) host_data > INT_MAX || (int64_t) host_data < INT_MIN) {
-        error_print(OVERLENGTH);
-        return -1;
+    // every server is ejected
+    if (!best) {
+        for (int i = 0; i < n; i++) {
+            struct endpoint *ep = &cl->endpoints[(start + i) % n];
+            if (ep == avoid && n > 1) {
+                continue;
+            }
+            if (!best || atomic_load_explicit(&ep->outstanding, memory_order_relaxed)
+                         < atomic_load_explicit(&best->outstanding, memory_order_relaxed)) {
+                best = ep;
+            }
+        }
     }
 
-    *num = (int) host_data;
-
-    return bytes_received;
+    atomic_fetch_add_explicit(&best->outstanding, 1, memory_order_relaxed);
+    return best;
 }
 
 
 /**
- * Receives a character flag from a host
+ * Checks whether a server may be given a call, claiming the probe of an ejected server that has sat out
+ * long enough
  *
- * @param sockfd Socket to be read over
- * @param data Buffer to read character
- * @return Number of bytes read on success
+ * @param ep Server to be checked
+ * @param now Current time
+ * @return 1 if healthy, 2 if the caller is to probe it, 0 otherwise
  */
-static int recv_flag(int sockfd, char *data) {
-
-    ssize_t n = recv(sockfd, data, sizeof(*data), 0);
+static int claim_endpoint(struct endpoint *ep, uint64_t now) {
 
-    if (n < 0) {
-        error_print(NETWORK_FAIL);
-        return -1;
-    } else if (n == 0) {
-        return n;
+    int state = atomic_load(&ep->state);
+    if (state == ENDPOINT_HEALTHY) {
+        return 1;
+    } else if (state == ENDPOINT_EJECTED && now >= atomic_load(&ep->ejected_until)
+               && atomic_compare_exchange_strong(&ep->state, &state, ENDPOINT_PROBING)) {
+        return 2;
     }
 
-    return n;
+    return 0;
 }
 
 
 /**
- * Sends flag character to a host
+ * Takes a connection to a server that no call is using, connecting anew if there is none
  *
- * @param sockfd Socket to be sent over
- * @param data Flag to send
- * @return Number of bytes sent on success
+ * @param ep Server to connect to
+ * @param status Set to RPC_ERROR if it cannot be connected to, RPC_BUSY if it turned the connection away
+ * @return Connection on success, NULL on failure
  */
-static int send_flag(int sockfd, char data) {
+static rpc_client *checkout_client(struct endpoint *ep, rpc_status *status) {
 
-    ssize_t n = send(sockfd, &data, sizeof(data), 0);
-    if (n < 0) {
-        error_print(NETWORK_FAIL);
-        return -1;
+    rpc_client *client = NULL;
+
+    pthread_mutex_lock(&ep->lock);
+    if (ep->num_idle > 0) {
+        client = ep->idle[--ep->num_idle];
+    }
+    pthread_mutex_unlock(&ep->lock);
+    if (client) {
+        return client;
     }
 
-    return n;
+    client = rpc_init_client(ep->addr, ep->port);
+    if (!client) {
+        *status = RPC_ERROR;
+        return NULL;
+    } else if (client->rejected) {
+        rpc_close_client(client);
+        *status = RPC_BUSY;
+        return NULL;
+    }
+
+    return client;
 }
 
 
 /**
- * Hash function for strings written by Daniel J. Bernstein
- * Was taken from: https://theartincode.stanis.me/008-djb2/
+ * Gives back a connection once a call is done with it, closing it if it failed
  *
- * @param str String to be hashed
- * @return Hash value
+ * @param ep Server the connection is to
+ * @param client Connection to be given back
  */
-static uint32_t hash_djb2(char* str) {
+static void checkin_client(struct endpoint *ep, rpc_client *client) {
+
+    // what is left on a failed connection cannot be trusted, and neither can the ids found on it. The
+    // server has likely gone away, so its other idle connections are dropped rather than failing a call each
+    if (client->status == RPC_ERROR || client->rejected) {
+        rpc_close_client(client);
+        atomic_fetch_add(&ep->generation, 1);
+        pthread_mutex_lock(&ep->lock);
+        while (ep->num_idle > 0) {
+            rpc_close_client(ep->idle[--ep->num_idle]);
+        }
+        pthread_mutex_unlock(&ep->lock);
+        return;
+    }
 
-    uint32_t hash = 5381;
-    int c;
-    while ((c = *str++)) {
-        hash = ((hash << 5) + hash) + c;
+    pthread_mutex_lock(&ep->lock);
+    if (ep->num_idle == ep->max_idle) {
+        int max_idle = ep->max_idle ? ep->max_idle * 2 : 4;
+        rpc_client **idle = realloc(ep->idle, max_idle * sizeof(*idle));
+        if (!idle) {
+            pthread_mutex_unlock(&ep->lock);
+            rpc_close_client(client);
+            return;
+        }
+        ep->idle = idle;
+        ep->max_idle = max_idle;
     }
-    return hash;
+    ep->idle[ep->num_idle++] = client;
+    pthread_mutex_unlock(&ep->lock);
 }
 
 
 /**
- * Simply returns the inputted value
+ * Gets the id of a handle's procedure on a server, finding it over the given connection the first time
+ * or after the server may have restarted
  *
- * @param num Number to be used as index
- * @return Inputted number
+ * @param cl Cluster data
+ * @param ep Server the procedure is to be called on
+ * @param client Connection to the server
+ * @param h Handle from rpc_cluster_find
+ * @param id Set to the procedure's id on the server
+ * @return 0 on success, -1 on failure (with the connection's status set)
  */
-static uint32_t hash_int(uint32_t* num) {
+static int resolve_id(rpc_cluster *cl, struct endpoint *ep, rpc_client *client, rpc_handle *h, uint32_t *id) {
 
-    return *num;
+    atomic_ullong *cached = &h->ids[ep - cl->endpoints];
+    uint64_t generation = atomic_load(&ep->generation);
+    uint64_t tagged = atomic_load_explicit(cached, memory_order_relaxed);
+
+    if (tagged >> 32 == generation) {
+        *id = (uint32_t) tagged;
+        client->status = RPC_OK;
+        return 0;
+    }
+
+    rpc_handle *found = rpc_find(client, h->name);
+    if (!found) {
+        return -1;
+    }
+    *id = found->id;
+    atomic_store_explicit(cached, generation << 32 | found->id, memory_order_relaxed);
+    free(found);
+
+    return 0;
 }
 
 
 /**
- * Generates a unique ID that is used as procedure ID's. Uses time and a counter to ensure uniqueness
+ * Updates the health of a server with the outcome of a call, ejecting it once it has failed too many in
+ * a row and bringing it back once it answers
  *
- * @return Generated ID
+ * @param cl Cluster data
+ * @param ep Server the call went to
+ * @param status Outcome of the call
  */
-static uint32_t generate_id() {
+static void record_outcome(rpc_cluster *cl, struct endpoint *ep, rpc_status status) {
 
-    static uint32_t counter = 0;
-    time_t curr_time = time(NULL);
-    return (uint32_t) curr_time + counter++;
+    // a call given up on says nothing about the server, unless it was the probe meant to bring it back
+    if (status == RPC_TIMEOUT) {
+        if (atomic_load(&ep->state) == ENDPOINT_PROBING) {
+            eject_endpoint(cl, ep);
+        }
+        return;
+    }
+    // any other answer shows the server is up
+    if (status != RPC_ERROR && status != RPC_BUSY) {
+        atomic_store(&ep->failures, 0);
+        if (atomic_load(&ep->state) != ENDPOINT_HEALTHY) {
+            atomic_store(&ep->ejections, 0);
+            atomic_store(&ep->state, ENDPOINT_HEALTHY);
+        }
+        return;
+    }
+
+    if (atomic_load(&ep->state) == ENDPOINT_PROBING
+        || atomic_fetch_add(&ep->failures, 1) + 1 >= cl->eject_failures) {
+        eject_endpoint(cl, ep);
+    }
 }
 
 
 /**
- * Integer comparison function that can be used for the hash table
+ * Ejects a server, for twice as long as last time if it has not answered since
  *
- * @param a First integer
- * @param b Second integer
- * @return Value depending on comparison
+ * @param cl Cluster data
+ * @param ep Server to be ejected
  */
-int int_cmp(uint32_t *a, uint32_t *b) {
+static void eject_endpoint(rpc_cluster *cl, struct endpoint *ep) {
 
-    if (*a < *b) {
-        return -1;
-    } else if (*a > *b) {
-        return 1;
-    } else {
-        return 0;
+    pthread_mutex_lock(&ep->lock);
+    if (atomic_load(&ep->state) != ENDPOINT_EJECTED) {
+        int shift = atomic_fetch_add(&ep->ejections, 1);
+        if (shift > MAX_EJECT_SHIFT) {
+            shift = MAX_EJECT_SHIFT;
+        }
+        // the end is set first so that a server seen as ejected is never probed early
+        atomic_store(&ep->ejected_until, now_ns() + ((uint64_t) cl->eject_ms * 1000000ULL << shift));
+        atomic_store(&ep->state, ENDPOINT_EJECTED);
+        atomic_store(&ep->failures, 0);
     }
+    pthread_mutex_unlock(&ep->lock);
 }
 
 
 /**
- * Checks if a given character is valid for a procedure name
+ * Closes every connection of a cluster and frees its data. No call may be in progress
  *
- * @param c Character to be checked
- * @return Result of check
+ * @param cl Cluster to be closed
  */
-static int is_valid_char(char c) {
+void rpc_close_cluster(rpc_cluster *cl) {
 
-    return (c >= 32 && c <= 126);
+    if (cl == NULL) {
+        return;
+    }
+    for (int i = 0; i < cl->num_endpoints; i++) {
+        struct endpoint *ep = &cl->endpoints[i];
+        for (int j = 0; j < ep->num_idle; j++) {
+            rpc_close_client(ep->idle[j]);
+        }
+        free(ep->idle);
+        free(ep->addr);
+        pthread_mutex_destroy(&ep->lock);
+    }
+    free(cl->endpoints);
+    free(cl);
 }
 
 
 /**
- * Checks if a given name has all valid characters
+ * Frees an RPC data struct
  *
- * @param name Name to be checked
- * @return Result of check
+ * @param data Data to be freed
  */
-static int is_valid_name(char *name) {
+void rpc_data_free(rpc_data *data) {
 
-    for (int i = 0; name[i] != '\0'; i++) {
-        // Check if the character is valid
-        if (!is_valid_char(name[i])) {
-            return 0;
-        }
+    if (data == NULL) {
+        return;
     }
-    return 1;
+    // the segments of a gathered payload belong to the caller, while a file region owns its descriptor.
+    // A small payload received is stored along with the data, so it goes with it
+    if (data->data2 == &file_payload) {
+        close(((struct file_data *) data)->fd);
+    } else if (data->data2 != NULL && data->data2 != &iov_payload
+               && data->data2 != ((struct inline_data *) data)->bytes) {
+        free(data->data2);
+    }
+    free(data);
+    data = NULL;
 }
 
 
 /**
- * Prints an error message given an error code
+ * Creates a payload made up of several buffers, sent with a single writev instead of being joined
+ * into one data2 first
  *
- * @param code Error code
+ * @param data1 Integer part of the payload
+ * @param iov Buffers making up data2, in order
+ * @param iovcnt Number of buffers
+ * @return Payload on success, NULL on failure
  */
-static void error_print(enum error_codes code) {
+rpc_data *rpc_data_from_iov(int data1, const struct iovec *iov, int iovcnt) {
 
-    fprintf(stderr, "Error: %s\n", error_messages[code]);
+    if (iovcnt < 0 || (iovcnt > 0 && iov == NULL)) {
+        error_print(INVALID_ARGUMENTS);
+        return NULL;
+    }
+    struct iov_data *payload = malloc(sizeof(*payload) + iovcnt * sizeof(*iov));
+    if (!payload) {
+        error_print(MEMORY_ALL0CATION);
+        return NULL;
+    }
+    payload->data.data1 = data1;
+    payload->data.data2_len = 0;
+    payload->iovcnt = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len == 0) {
+            continue;
+        }
+        payload->iov[payload->iovcnt++] = iov[i];
+        payload->data.data2_len += iov[i].iov_len;
+    }
+    // an empty payload is an ordinary one
+    payload->data.data2 = payload->data.data2_len ? &iov_payload : NULL;
+
+    return &payload->data;
 }
 
 
 /**
- * Closes client socket and data
+ * Creates a payload referring to a region of a file, sent with sendfile so that it is never read into
+ * user space
  *
- * @param cl Client to be closed
+ * @param data1 Integer part of the payload
+ * @param fd File holding data2, closed by rpc_data_free
+ * @param offset Offset of data2 in the file
+ * @param len Length of data2
+ * @return Payload on success, NULL on failure (fd is still closed)
  */
-void rpc_close_client(rpc_client *cl) {
+rpc_data *rpc_data_from_file(int data1, int fd, off_t offset, size_t len) {
+
+    struct stat st;
+    if (fd < 0 || offset < 0 || fstat(fd, &st) == -1
+        // the region has to exist since its length is sent ahead of it
+        || (S_ISREG(st.st_mode) && (offset > st.st_size || len > (size_t) (st.st_size - offset)))) {
+
+        error_print(INVALID_ARGUMENTS);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
 
-    if (cl) {
-        close(cl->sockfd);
-        free(cl);
-        cl = NULL;
     }
+    struct file_data *payload = malloc(sizeof(*payload));
+    if (!payload) {
+        error_print(MEMORY_ALL0CATION);
+        close(fd);
+        return NULL;
+    }
+    payload->data.data1 = data1;
+    payload->data.data2_len = len;
+    payload->data.data2 = &file_payload;
+    payload->fd = fd;
+    payload->offset = offset;
 
+    return &payload->data;
 }
 
 
 /**
- * Frees an RPC data struct
+ * Lists the segments making up a payload's data2, being a single one unless it was made by
+ * rpc_data_from_iov
  *
- * @param data Data to be freed
+ * @param data Payload to be read
+ * @param iov Array to store up to max_segments segments
+ * @param max_segments Size of the array
+ * @return Number of segments in the payload, which may be more than max_segments, -1 on failure
+ * (including for file regions)
  */
-void rpc_data_free(rpc_data *data) {
+int rpc_data_segments(rpc_data *data, struct iovec *iov, int max_segments) {
 
-    if (data == NULL) {
-        return;
+    if (data == NULL || data->data2 == &file_payload || (max_segments > 0 && iov == NULL)) {
+        error_print(INVALID_ARGUMENTS);
+        return -1;
     }
-    if (data->data2 != NULL) {
-        free(data->data2);
+    struct iovec single;
+    const struct iovec *segments;
+    int count = payload_segments(data, &segments, &single);
+    for (int i = 0; i < count && i < max_segments; i++) {
+        iov[i] = segments[i];
     }
-    free(data);
-    data = NULL;
+
+    return count;
 }
 
 
+/**
+ * Finds the segments of a payload without copying them
+ *
+ * @param data Payload to be read
+ * @param iov Set to the payload's segments
+ * @param single Storage for the segment of an ordinary payload
+ * @return Number of segments
+ */
+static int payload_segments(rpc_data *data, const struct iovec **iov, struct iovec *single) {
+
+    if (data->data2 == &iov_payload) {
+        struct iov_data *payload = (struct iov_data *) data;
+        *iov = payload->iov;
+        return payload->iovcnt;
+    }
+    single->iov_base = data->data2;
+    single->iov_len = data->data2_len;
+    *iov = single;
 
+    return data->data2_len > 0 ? 1 : 0;
+}
@@ -8,11 +8,15 @@
 #define RPC_H
 
 #include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 /* Server state */
 typedef struct rpc_server rpc_server;
 /* Client state */
 typedef struct rpc_client rpc_client;
+/* State of a client balancing calls across several servers */
+typedef struct rpc_cluster rpc_cluster;
 
 /* The payload for requests/responses */
 typedef struct {
@@ -21,6 +25,115 @@ typedef struct {
     void *data2;
 } rpc_data;
 
+/* Scheduling class of a procedure, see rpc_set_priority */
+typedef enum {
+    RPC_PRIORITY_CONTROL = 0, /* Latency-critical calls such as health checks */
+    RPC_PRIORITY_NORMAL,      /* Default for every procedure */
+    RPC_PRIORITY_BULK,        /* Batch work that may wait behind everything else */
+    RPC_NUM_PRIORITIES
+} rpc_priority;
+
+/* Server options, see rpc_init_server_opts */
+typedef struct {
+    int listeners;   /* Number of SO_REUSEPORT listening sockets, each served by its own accept thread */
+    int backlog;     /* Length of the connection queue of each listening socket */
+    int pin_threads; /* Pins each accept thread to its own core when non-zero */
+    int thread_per_core; /* Serves each listener from a pinned event loop that owns its connections and a
+                          * snapshot of the registered procedures, listeners of 0 then means one per core */
+    int numa_local;  /* Keeps each core's memory on its own NUMA node in thread-per-core mode */
+    /* Admission limits, 0 for none. Work above a limit is answered with BUSY straight away. In
+     * thread-per-core mode each core enforces its share of a limit on its own */
+    int max_connections;     /* Open connections */
+    int max_inflight;        /* Calls admitted but not yet answered */
+    size_t max_queued_bytes; /* Payload bytes of calls admitted but not yet answered */
+    int workers; /* Handler threads that decoded calls are handed to, stealing work from each other when
+                  * idle. 0 runs each handler on the thread that read its call */
+    /* How workers choose between the queued calls of each priority. With strict_priority set a lower
+     * class only runs once nothing of a higher class is queued, otherwise each class gets a turn of up to
+     * its weight in calls */
+    int strict_priority;
+    int priority_weights[RPC_NUM_PRIORITIES];
+    /* Bounds on what a slow or hostile client can hold on to, 0 for none */
+    int idle_timeout_ms; /* Closes a connection that has gone this long without a complete request while
+                          * none of its calls are outstanding, so trickling in bytes does not keep it open */
+    size_t max_payload;  /* Largest payload a call may announce, larger ones are answered with TOO_LARGE */
+    size_t max_payload_memory; /* Payload bytes of calls being received or handled across the whole server.
+                                * A call announcing more than is left is answered with BUSY before any of
+                                * its payload is buffered */
+    const char *capture_path; /* Appends every find and call received to a log at this path, which
+                               * rpc-replay plays back, NULL for none. Requests are left out rather than
+                               * held up when the log cannot be written fast enough */
+    size_t capture_max_payload; /* Leading payload bytes kept of each call captured, 0 for all of them */
+} rpc_server_opts;
+
+/* Where a procedure's rate limit applies, see rpc_set_rate_limit */
+typedef enum {
+    RPC_LIMIT_CONNECTION = 0, /* Each connection has its own allowance */
+    RPC_LIMIT_PEER,           /* Every connection from the same address shares one allowance */
+    RPC_NUM_LIMIT_SCOPES
+} rpc_limit_scope;
+
+/* Token bucket limits on the calls of a procedure. Allowances refill continuously at their rate up to their
+ * burst, and a call arriving once either has run out is answered with THROTTLED */
+typedef struct {
+    int calls_per_sec;    /* Calls admitted per second, 0 for no limit */
+    int call_burst;       /* Calls that may be admitted at once after a quiet spell, calls_per_sec if 0 */
+    size_t bytes_per_sec; /* Payload bytes admitted per second, 0 for no limit. A call is admitted while any
+                           * allowance is left, so a payload larger than the burst is still taken */
+    size_t byte_burst;    /* Payload bytes that may be admitted at once, bytes_per_sec if 0 */
+} rpc_rate_limit;
+
+/* Counters describing a server's current load and what it has turned away */
+typedef struct {
+    int connections;
+    int inflight;
+    size_t queued_bytes;
+    unsigned long shed_calls;
+    unsigned long shed_connections;
+    unsigned long expired_calls;
+    size_t payload_memory;           /* Payload bytes currently held, counted against max_payload_memory */
+    unsigned long rejected_payloads; /* Calls refused for the size of their payload */
+    unsigned long idle_closed;       /* Connections closed by the idle timeout */
+    unsigned long coalesced_calls;   /* Calls answered with the output of an identical one, see
+                                      * rpc_set_single_flight */
+    unsigned long corrupt_frames;    /* Requests whose checksum did not match, see rpc_set_checksums */
+    unsigned long throttled_calls;   /* Calls over a procedure's rate limit, see rpc_set_rate_limit */
+    unsigned long capture_dropped;   /* Requests left out of the capture log, see capture_path */
+} rpc_server_stats;
+
+/* Outcome of a client's most recent request */
+typedef enum {
+    RPC_OK = 0,
+    RPC_ERROR,        /* Invalid arguments or a local/network failure */
+    RPC_NOT_FOUND,    /* The procedure is not registered on the server */
+    RPC_INCONSISTENT, /* The procedure failed or produced inconsistent data */
+    RPC_BUSY,         /* The server is overloaded, back off or retry elsewhere */
+    RPC_TIMEOUT,      /* The call's deadline passed before it was answered */
+    RPC_TOO_SMALL,    /* The output did not fit the buffer given to rpc_call_into */
+    RPC_TOO_LARGE,    /* The payload was larger than the server accepts */
+    RPC_CORRUPT,      /* The request or its response failed its checksum, see rpc_set_checksums */
+    RPC_THROTTLED     /* The client went over the procedure's rate limit, back off before retrying */
+} rpc_status;
+
+/* How a cluster picks the server for each call */
+typedef enum {
+    RPC_BALANCE_LEAST_OUTSTANDING = 0, /* The server with the fewest calls in progress */
+    RPC_BALANCE_P2C                    /* The less loaded of two servers picked at random */
+} rpc_balance;
+
+/* Cluster options, see rpc_init_cluster */
+typedef struct {
+    rpc_balance balance;
+    /* A server failing this many calls in a row (network failures or BUSY) is ejected, and gets no calls
+     * until it has sat out eject_ms. A single call then probes it, bringing it back on success and
+     * ejecting it again for twice as long on failure */
+    int eject_failures;
+    int eject_ms;
+    /* Percentile of a procedure's recent latencies after which rpc_cluster_call_hedged sends a second
+     * copy of a call, from 1 to 99 */
+    int hedge_percentile;
+} rpc_cluster_opts;
+
 /* Handle for remote function */
 typedef struct rpc_handle rpc_handle;
 
@@ -28,6 +141,34 @@ typedef struct rpc_handle rpc_handle;
  * rpc_data* as output */
 typedef rpc_data *(*rpc_handler)(rpc_data *);
 
+/* Token for a call that is completed later, see rpc_register_async */
+typedef struct rpc_token rpc_token;
+
+/* Handler for remote functions that produces its output later by passing the token to rpc_complete,
+ * from any thread. The input stays valid until then */
+typedef void (*rpc_async_handler)(rpc_data *, rpc_token *);
+
+/* Where a streaming call sends its messages, see rpc_register_stream */
+typedef struct rpc_sink rpc_sink;
+
+/* Handler for remote functions that sends any number of messages with rpc_sink_send instead of returning
+ * a single output, returning 0 once done or -1 on failure */
+typedef int (*rpc_stream_handler)(rpc_data *, rpc_sink *);
+
+/* Where an upload's records are taken from, see rpc_register_upload */
+typedef struct rpc_source rpc_source;
+
+/* Handler for remote functions that takes a stream of records with rpc_source_next as they arrive and
+ * produces a single output, which may be NULL on failure */
+typedef rpc_data *(*rpc_upload_handler)(rpc_data *, rpc_source *);
+
+/* Handler for remote functions that runs several calls at once, setting out[i] to the output for in[i]
+ * (NULL if that call failed). Each output must be a separate allocation, and is freed once sent */
+typedef void (*rpc_batch_handler)(rpc_data *in[], rpc_data *out[], int n);
+
+/* A streaming call as seen by the client, see rpc_stream_call and rpc_stream_open */
+typedef struct rpc_stream rpc_stream;
+
 /* ---------------- */
 /* Server functions */
 /* ---------------- */
@@ -40,6 +181,22 @@ typedef rpc_data *(*rpc_handler)(rpc_data *);
  */
 rpc_server *rpc_init_server(int port);
 
+/**
+ * Fills server options with their default values (a single listener)
+ *
+ * @param opts Options to be initialised
+ */
+void rpc_server_opts_init(rpc_server_opts *opts);
+
+/**
+ * Initialises data used for the server and creates the listening sockets described by the options
+ *
+ * @param port Port number
+ * @param opts Server options, NULL for defaults
+ * @return Rpc server data
+ */
+rpc_server *rpc_init_server_opts(int port, rpc_server_opts *opts);
+
 /**
  * Registers a procedure to the server by name
  *
@@ -51,7 +208,140 @@ rpc_server *rpc_init_server(int port);
 int rpc_register(rpc_server *srv, char *name, rpc_handler handler);
 
 /**
- * Accepts new connections from clients and completes requests
+ * Registers a procedure whose handler may finish its calls later, so that waiting on disk or another
+ * service does not hold up other requests on the connection
+ *
+ * @param srv Server struct
+ * @param name Name procedure
+ * @param handler Procedure, which must eventually call rpc_complete with the token it is given
+ * @return Procedure ID on success
+ */
+int rpc_register_async(rpc_server *srv, char *name, rpc_async_handler handler);
+
+/**
+ * Registers a procedure whose handler sends any number of messages through a sink rather than returning
+ * a single output. It is never run on the thread reading the connection, as sending waits for the client
+ * to take earlier messages
+ *
+ * @param srv Server struct
+ * @param name Name procedure
+ * @param handler Procedure, returning 0 once it has sent every message or -1 on failure
+ * @return Procedure ID on success
+ */
+int rpc_register_stream(rpc_server *srv, char *name, rpc_stream_handler handler);
+
+/**
+ * Sends a message of a streaming call, first waiting until the client has room for it
+ *
+ * @param sink Sink given to the handler
+ * @param message Message to be sent, freed once sent
+ * @return 0 on success, -1 on failure or once the client has given up on the stream
+ */
+int rpc_sink_send(rpc_sink *sink, rpc_data *message);
+
+/**
+ * Registers a procedure taking a stream of records from the client, which its handler consumes as they
+ * arrive before returning a single output. Like a streaming procedure it is never run on the thread
+ * reading the connection
+ *
+ * @param srv Server struct
+ * @param name Name procedure
+ * @param handler Procedure, taking records with rpc_source_next
+ * @return Procedure ID on success
+ */
+int rpc_register_upload(rpc_server *srv, char *name, rpc_upload_handler handler);
+
+/**
+ * Waits for the next record of an upload, handing back credit to the client as records are taken
+ *
+ * @param source Source given to the handler
+ * @return Next record, to be freed by the handler with rpc_data_free, NULL once the client has sent its
+ * last record or given up
+ */
+rpc_data *rpc_source_next(rpc_source *source);
+
+/**
+ * Registers a procedure whose calls are run in batches, so that its handler can work through many inputs
+ * in one go (with SIMD kernels, say). Calls queued or pipelined together are collected until a batch is
+ * full or the first has waited long enough, see rpc_set_batch_limits
+ *
+ * @param srv Server struct
+ * @param name Name procedure
+ * @param handler Procedure, given every call of a batch together
+ * @return Procedure ID on success
+ */
+int rpc_register_batch(rpc_server *srv, char *name, rpc_batch_handler handler);
+
+/**
+ * Sets how calls of a batch procedure are collected. With no wait a batch is run once the calls that
+ * arrived together have been read, otherwise its first call waits for others up to the limit. Must be
+ * called before rpc_serve_all
+ *
+ * @param srv Server struct
+ * @param name Name of the procedure
+ * @param max_calls Most calls run in one batch, 64 by default
+ * @param max_wait_us Longest a call waits for others to join its batch in microseconds, 0 (the default)
+ * to only take calls that have already arrived
+ * @return 0 on success, -1 on failure
+ */
+int rpc_set_batch_limits(rpc_server *srv, char *name, int max_calls, int max_wait_us);
+
+/**
+ * Completes a call passed to an asynchronous handler, sending its output to the client. Both the token
+ * and the call's input are freed, the output is freed once sent
+ *
+ * @param token Token given to the handler
+ * @param result Output of the procedure, NULL if it failed
+ */
+void rpc_complete(rpc_token *token, rpc_data *result);
+
+/**
+ * Sets the scheduling class of a registered procedure, taking effect for calls handed to workers. Must
+ * be called before rpc_serve_all
+ *
+ * @param srv Server struct
+ * @param name Name of the procedure
+ * @param priority Class of the procedure, RPC_PRIORITY_NORMAL by default
+ * @return 0 on success, -1 on failure
+ */
+int rpc_set_priority(rpc_server *srv, char *name, rpc_priority priority);
+
+/**
+ * Coalesces concurrent identical calls of a registered procedure. A call arriving while another with the
+ * same input is being run waits for it and is answered with a copy of its output, so only suits
+ * procedures without side effects. Must be called before rpc_serve_all
+ *
+ * @param srv Server struct
+ * @param name Name of the procedure
+ * @param enabled 1 to coalesce calls, 0 to run every call (the default)
+ * @return 0 on success, -1 on failure
+ */
+int rpc_set_single_flight(rpc_server *srv, char *name, int enabled);
+
+/**
+ * Limits the rate of a registered procedure's calls, for each connection or for each peer address. Calls
+ * over the limit are answered with THROTTLED before their payload is read, so one client calling in a
+ * tight loop cannot take over the handlers. Must be called before rpc_serve_all
+ *
+ * @param srv Server struct
+ * @param name Name of the procedure
+ * @param scope Whether the limit applies to each connection or to each peer address
+ * @param limit Rates and bursts allowed, NULL to remove the limit
+ * @return 0 on success, -1 on failure
+ */
+int rpc_set_rate_limit(rpc_server *srv, char *name, rpc_limit_scope scope, const rpc_rate_limit *limit);
+
+/**
+ * Reads the server's load counters, summed across cores
+ *
+ * @param srv Server data
+ * @param stats Buffer to be filled
+ */
+void rpc_get_stats(rpc_server *srv, rpc_server_stats *stats);
+
+/**
+ * Accepts new connections from clients and completes requests. Each listener gets its own accept loop,
+ * the first of which runs on the calling thread
  *
  * @param srv Server data
  */
@@ -70,6 +360,26 @@ void rpc_serve_all(rpc_server *srv);
  */
 rpc_client *rpc_init_client(char *addr, int port);
 
+/**
+ * Connects a client to a server in the same process through a pair of in-memory channels instead of a
+ * socket. The server's end is handled by a thread of its own, as an accepted connection would be
+ *
+ * @param srv Server to connect to
+ * @return Rpc client data
+ */
+rpc_client *rpc_init_loopback(rpc_server *srv);
+
+/**
+ * Asks the server to end every frame on the connection with a CRC32C checksum, or to stop. A frame that
+ * arrives corrupt is not acted on, its request failing with RPC_CORRUPT instead
+ *
+ * @param cl Client data
+ * @param enabled Non-zero to turn checksums on, 0 to turn them off
+ * @return 1 if frames now carry checksums, 0 if they do not (including with a server too old to have
+ * them), -1 on failure
+ */
+int rpc_set_checksums(rpc_client *cl, int enabled);
+
 /**
  * Finds a procedure on the server given a name
  *
@@ -89,6 +399,101 @@ rpc_handle *rpc_find(rpc_client *cl, char *name);
  */
 rpc_data *rpc_call(rpc_client *cl, rpc_handle *h, rpc_data *payload);
 
+/**
+ * Calls a given procedure like rpc_call, but gives up once a deadline has passed. The deadline is sent
+ * along with the call so the server drops it without running the procedure if it expires while queued
+ *
+ * @param cl Client data
+ * @param h Handle containing ID
+ * @param payload Data to be send to server
+ * @param timeout_ms Milliseconds from now until the deadline, 0 for none
+ * @return Output data from the procedure on success, NULL on failure (RPC_TIMEOUT once the deadline passes)
+ */
+rpc_data *rpc_call_with_deadline(rpc_client *cl, rpc_handle *h, rpc_data *payload, int timeout_ms);
+
+/**
+ * Calls a given procedure like rpc_call, but decodes the output into memory provided by the caller so
+ * that nothing is allocated
+ *
+ * @param cl Client data
+ * @param h Handle containing ID
+ * @param payload Data to be send to server
+ * @param out Set to the output, its data2 pointing into out_buf (NULL if empty)
+ * @param out_buf Buffer for the output's data2
+ * @param out_cap Size of out_buf
+ * @return 0 on success, -1 on failure (RPC_TOO_SMALL if out_buf cannot hold data2, whose size is then
+ * given by out->data2_len)
+ */
+int rpc_call_into(rpc_client *cl, rpc_handle *h, rpc_data *payload, rpc_data *out, void *out_buf,
+                  size_t out_cap);
+
+/**
+ * Calls a streaming procedure, whose messages are then taken one at a time with rpc_stream_next. The
+ * client makes no other requests until the stream is closed
+ *
+ * @param cl Client data
+ * @param h Handle containing ID
+ * @param payload Data to be send to server
+ * @return Stream on success, NULL on failure
+ */
+rpc_stream *rpc_stream_call(rpc_client *cl, rpc_handle *h, rpc_data *payload);
+
+/**
+ * Waits for the next message of a stream. Credit for more messages is handed back as they are taken, so
+ * the server never has more than a window of them outstanding
+ *
+ * @param stream Stream to be read
+ * @return Next message on success, NULL once the stream has ended (status RPC_OK) or on failure
+ */
+rpc_data *rpc_stream_next(rpc_stream *stream);
+
+/**
+ * Calls an upload procedure, whose records are then sent one at a time with rpc_stream_send. The client
+ * makes no other requests until the stream is closed
+ *
+ * @param cl Client data
+ * @param h Handle containing ID
+ * @param payload Data to be send to server, given to the handler as its input
+ * @return Stream on success, NULL on failure
+ */
+rpc_stream *rpc_stream_open(rpc_client *cl, rpc_handle *h, rpc_data *payload);
+
+/**
+ * Sends a record of an upload, first waiting until the server has room for all of it
+ *
+ * @param stream Upload to be sent on
+ * @param record Record to be sent
+ * @return 0 on success, -1 on failure (RPC_TOO_LARGE for a payload over 131008 bytes, or once the server
+ * has answered early, the answer then being given by rpc_stream_close_and_recv)
+ */
+int rpc_stream_send(rpc_stream *stream, rpc_data *record);
+
+/**
+ * Ends an upload and waits for the server's answer
+ *
+ * @param stream Upload to be closed, freed along with it
+ * @return Output data from the procedure on success, NULL on failure
+ */
+rpc_data *rpc_stream_close_and_recv(rpc_stream *stream);
+
+/**
+ * Closes a stream without waiting for the rest of it, telling the server to give up on it if it has not
+ * ended. Messages or an answer already sent are dropped by the client, which may then make other
+ * requests
+ *
+ * @param stream Stream to be closed
+ */
+void rpc_stream_close(rpc_stream *stream);
+
+/**
+ * Reports the outcome of the client's most recent rpc_find or rpc_call, telling apart a server that is
+ * busy from other failures
+ *
+ * @param cl Client data
+ * @return Status of the last request
+ */
+rpc_status rpc_get_status(rpc_client *cl);
+
 /**
  * Closes client socket and data
  *
@@ -96,6 +501,76 @@ rpc_data *rpc_call(rpc_client *cl, rpc_handle *h, rpc_data *payload);
  */
 void rpc_close_client(rpc_client *cl);
 
+/* ----------------- */
+/* Cluster functions */
+/* ----------------- */
+
+/**
+ * Fills cluster options with their default values (least outstanding, ejecting after 3 failures for 1s,
+ * hedging at the 95th percentile)
+ *
+ * @param opts Options to be initialised
+ */
+void rpc_cluster_opts_init(rpc_cluster_opts *opts);
+
+/**
+ * Initialises a client that balances calls across several servers, keeping connections to each. Every
+ * cluster function may be used from several threads at once
+ *
+ * @param addrs Address of each server
+ * @param ports Port number of each server
+ * @param num_servers Number of servers
+ * @param opts Cluster options, NULL for defaults
+ * @return Cluster data, NULL on failure
+ */
+rpc_cluster *rpc_init_cluster(char **addrs, int *ports, int num_servers, rpc_cluster_opts *opts);
+
+/**
+ * Finds a procedure on one of the cluster's servers given a name. Its id on each of the other servers is
+ * found on first use there
+ *
+ * @param cl Cluster data
+ * @param name Query name
+ * @return A handle usable only with this cluster, freed with free, NULL on failure
+ */
+rpc_handle *rpc_cluster_find(rpc_cluster *cl, char *name);
+
+/**
+ * Calls a given procedure on whichever server the cluster's balancing picks. A server that cannot be
+ * connected to is ejected and the call goes to another, other failures are not retried
+ *
+ * @param cl Cluster data
+ * @param h Handle from rpc_cluster_find
+ * @param payload Data to be send to server
+ * @param timeout_ms Milliseconds from now until the deadline, 0 for none
+ * @param status Set to the outcome of the call, may be NULL
+ * @return Output data from the procedure on success, NULL on failure
+ */
+rpc_data *rpc_cluster_call(rpc_cluster *cl, rpc_handle *h, rpc_data *payload, int timeout_ms,
+                           rpc_status *status);
+
+/**
+ * Calls a given idempotent procedure like rpc_cluster_call, but sends a second copy of the call to
+ * another server if the first has not answered once the hedge percentile of the procedure's recent
+ * latencies has passed. The first answer is used and the other is dropped when it arrives
+ *
+ * @param cl Cluster data
+ * @param h Handle from rpc_cluster_find
+ * @param payload Data to be send to server
+ * @param timeout_ms Milliseconds from now until the deadline, 0 for none
+ * @param status Set to the outcome of the call, may be NULL
+ * @return Output data from the procedure on success, NULL on failure
+ */
+rpc_data *rpc_cluster_call_hedged(rpc_cluster *cl, rpc_handle *h, rpc_data *payload, int timeout_ms,
+                                  rpc_status *status);
+
+/**
+ * Closes every connection of a cluster and frees its data. No call may be in progress
+ *
+ * @param cl Cluster to be closed
+ */
+void rpc_close_cluster(rpc_cluster *cl);
+
 /* ---------------- */
 /* Shared functions */
 /* ---------------- */
@@ -107,4 +582,43 @@ void rpc_close_client(rpc_client *cl);
  */
 void rpc_data_free(rpc_data *data);
 
+/**
+ * Creates a payload made up of several buffers, such as a header, body and trailer, sent with a single
+ * writev instead of being joined into one data2 first. Its data2 is not readable directly, see
+ * rpc_data_segments. It may be passed to rpc_call or returned by a handler. The buffers are not copied,
+ * so they must stay valid until rpc_call returns or, for a handler's output, outlive the call. rpc_data_free
+ * frees only the payload itself
+ *
+ * @param data1 Integer part of the payload
+ * @param iov Buffers making up data2, in order
+ * @param iovcnt Number of buffers
+ * @return Payload on success, NULL on failure
+ */
+rpc_data *rpc_data_from_iov(int data1, const struct iovec *iov, int iovcnt);
+
+/**
+ * Creates a payload referring to a region of a file, sent with sendfile so that it is never mapped or
+ * read into user space. It may be passed to rpc_call or returned by a handler, and like a payload from
+ * rpc_data_from_iov its data2 is not readable directly
+ *
+ * @param data1 Integer part of the payload
+ * @param fd File holding data2, closed by rpc_data_free
+ * @param offset Offset of data2 in the file
+ * @param len Length of data2
+ * @return Payload on success, NULL on failure (fd is still closed)
+ */
+rpc_data *rpc_data_from_file(int data1, int fd, off_t offset, size_t len);
+
+/**
+ * Lists the segments making up a payload's data2, being a single one unless it was made by
+ * rpc_data_from_iov. Handlers may read their input this way to accept either kind of payload
+ *
+ * @param data Payload to be read
+ * @param iov Array to store up to max_segments segments
+ * @param max_segments Size of the array
+ * @return Number of segments in the payload, which may be more than max_segments, -1 on failure
+ * (including for file regions)
+ */
+int rpc_data_segments(rpc_data *data, struct iovec *iov, int max_segments);
+
 #endif